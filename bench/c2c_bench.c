@@ -0,0 +1,141 @@
+/*
+ * Cache-line contention benchmark for the TU layout, in the spirit of
+ * perf c2c: one thread keeps taking and dropping references to a TU, as
+ * every dialer of an extension does, while a second thread works on
+ * fields of the same TU that the first never writes, or on the reference
+ * count of the TU in the adjacent slab slot.  If the lines are shared, each
+ * access of the second thread is a cache-to-cache transfer and its time per
+ * operation rises by the cost of one; if not, it stays at the cost of an L1
+ * hit.
+ *
+ * For comparison the same access patterns are run on a replica of the
+ * packed layout TUs used to have (fd, ext, reference count, state and peer
+ * side by side, allocated with malloc()).  Run it on a machine with at
+ * least two cores, preferably two sockets: on one core there is nothing to
+ * transfer between.
+ *
+ * Usage: c2c_bench [<seconds per run>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+
+static double run_seconds = 1.0;
+static atomic_bool stop;
+
+// The layout of struct tu before it was split into cache lines
+typedef struct packed_tu {
+    int fd;
+    int ext;
+    atomic_int ref_count;
+    int state;
+    struct packed_tu *peer;
+    pthread_mutex_t mutex;
+} PACKED_TU;
+
+// What each thread of a run works on
+typedef struct job {
+    TU *tu; // real TU, or NULL for the packed one
+    PACKED_TU *packed;
+    int refs; // take and drop references (else: read fd and ext)
+    long ops;
+} JOB;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *job_thread(void *arg) {
+    JOB *j = arg;
+    long sum = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        for (int i = 0; i < 1000; i++) {
+            if (j->tu && j->refs) {
+                tu_ref(j->tu, "c2c");
+                tu_unref(j->tu, "c2c");
+            } else if (j->tu) {
+                sum += tu_fileno(j->tu) + tu_extension(j->tu);
+            } else if (j->refs) {
+                atomic_fetch_add_explicit(&j->packed->ref_count, 1, memory_order_relaxed);
+                atomic_fetch_sub_explicit(&j->packed->ref_count, 1, memory_order_release);
+            } else {
+                sum += ((volatile PACKED_TU *)j->packed)->fd + ((volatile PACKED_TU *)j->packed)->ext;
+            }
+        }
+        j->ops += 1000;
+    }
+    return (void *)sum; // keep the reads from being optimized away
+}
+
+// Nanoseconds per operation of the second job while the first runs alongside
+static double run(JOB *hammer, JOB *victim) {
+    pthread_t threads[2];
+    hammer->ops = victim->ops = 0;
+
+    atomic_store(&stop, false);
+    double start = now();
+    pthread_create(&threads[0], NULL, job_thread, hammer);
+    pthread_create(&threads[1], NULL, job_thread, victim);
+    usleep(run_seconds * 1e6);
+    atomic_store(&stop, true);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    return (now() - start) * 1e9 / victim->ops;
+}
+
+static TU *open_tu(int *client) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) return NULL;
+    *client = sv[0];
+    return tu_init(sv[1]);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) run_seconds = atof(argv[1]);
+
+    // Two TUs allocated one after the other: adjacent slab slots
+    int client[2];
+    TU *tu[2] = { open_tu(&client[0]), open_tu(&client[1]) };
+    // And two packed ones the way malloc() places them
+    PACKED_TU *packed[2] = { calloc(1, sizeof(PACKED_TU)), calloc(1, sizeof(PACKED_TU)) };
+    if (!tu[0] || !tu[1] || !packed[0] || !packed[1]) {
+        fprintf(stderr, "ERROR: failed to set up TUs\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-44s %10s %10s\n", "second thread, while the first refs TU 0", "split ns", "packed ns");
+
+    JOB hammer = { .tu = tu[0], .refs = 1 }, victim = { .tu = tu[0], .refs = 0 };
+    JOB phammer = { .packed = packed[0], .refs = 1 }, pvictim = { .packed = packed[0], .refs = 0 };
+    double split = run(&hammer, &victim), old = run(&phammer, &pvictim);
+    printf("%-44s %10.2f %10.2f\n", "reads fd and ext of TU 0", split, old);
+
+    victim = (JOB){ .tu = tu[1], .refs = 1 };
+    pvictim = (JOB){ .packed = packed[1], .refs = 1 };
+    split = run(&hammer, &victim);
+    old = run(&phammer, &pvictim);
+    printf("%-44s %10.2f %10.2f\n", "refs the adjacent TU 1", split, old);
+
+    victim = (JOB){ .tu = tu[0], .refs = 1 };
+    pvictim = (JOB){ .packed = packed[0], .refs = 1 };
+    split = run(&hammer, &victim);
+    old = run(&phammer, &pvictim);
+    printf("%-44s %10.2f %10.2f\n", "refs TU 0 too (true sharing, for scale)", split, old);
+
+    for (int i = 0; i < 2; i++) {
+        tu_unref(tu[i], "Benchmark done");
+        close(client[i]);
+        free(packed[i]);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*
+ * Connection churn benchmark, as from NAT'd softphones that keep
+ * reconnecting.  Each thread repeatedly sets up a TU on a fresh socket
+ * pair, registers it on the next free extension, reads its ON HOOK
+ * notification, then unregisters it and tears it down.  Reported are
+ * connects per second with 1, 2, 4, ... threads.
+ *
+ * A second table isolates the allocator: thread pairs in which one thread
+ * allocates TU-sized objects and hands them to the other to free, as when
+ * a TU's last reference is dropped by the thread of the client it was
+ * talking to, using the slab allocator and using malloc()/free().
+ *
+ * Usage: churn_bench [<max threads> [<seconds per run>]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "slab.h"
+
+#define OBJECT_SIZE 200 // about a TU
+#define RING_SIZE 256 // objects in flight between a pair of threads (a power of two)
+
+static double run_seconds = 1.0;
+static atomic_bool stop;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *connect_thread(void *arg) {
+    long *connects = arg;
+    char buf[64];
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) break;
+        TU *tu = tu_init(sv[1]);
+        if (!tu || pbx_register_next(pbx, tu) == -1) {
+            fprintf(stderr, "ERROR: failed to set up TU\n");
+            exit(EXIT_FAILURE);
+        }
+        if (recv(sv[0], buf, sizeof(buf), 0) <= 0) break; // ON HOOK <ext>
+        pbx_unregister(pbx, tu);
+        tu_unref(tu, "Client disconnected"); // closes the server end
+        close(sv[0]);
+        (*connects)++;
+    }
+    return NULL;
+}
+
+// Objects passed from an allocating to a freeing thread
+typedef struct ring {
+    void *slots[RING_SIZE];
+    atomic_ulong head; // next slot to fill
+    atomic_ulong tail; // next slot to empty
+    SLAB_CACHE *cache; // NULL for malloc()
+    long ops;
+} RING;
+
+static void *producer_thread(void *arg) {
+    RING *r = arg;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        unsigned long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+        if (h - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE) { // full
+            sched_yield();
+            continue;
+        }
+        void *obj = r->cache ? slab_alloc(r->cache) : malloc(OBJECT_SIZE);
+        *(long *)obj = h; // touch it, as a real user would
+        r->slots[h % RING_SIZE] = obj;
+        atomic_store_explicit(&r->head, h + 1, memory_order_release);
+        r->ops++;
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *arg) {
+    RING *r = arg;
+    for (;;) {
+        unsigned long t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if (t == atomic_load_explicit(&r->head, memory_order_acquire)) {
+            if (atomic_load_explicit(&stop, memory_order_relaxed)) break;
+            sched_yield(); // empty
+            continue;
+        }
+        void *obj = r->slots[t % RING_SIZE];
+        if (r->cache) slab_free(r->cache, obj);
+        else free(obj);
+        atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static double run_connects(int nthreads) {
+    pthread_t threads[nthreads];
+    long connects[nthreads];
+
+    atomic_store(&stop, false);
+    double start = now();
+    for (int t = 0; t < nthreads; t++) {
+        connects[t] = 0;
+        pthread_create(&threads[t], NULL, connect_thread, &connects[t]);
+    }
+    usleep(run_seconds * 1e6);
+    atomic_store(&stop, true);
+
+    long total = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        total += connects[t];
+    }
+    return total / (now() - start);
+}
+
+// Nanoseconds per allocate/free with npairs pairs of threads
+static double run_handoff(int npairs, SLAB_CACHE *cache) {
+    RING *rings = aligned_alloc(64, npairs * sizeof(RING));
+    pthread_t threads[2 * npairs];
+
+    atomic_store(&stop, false);
+    double start = now();
+    for (int p = 0; p < npairs; p++) {
+        atomic_init(&rings[p].head, 0);
+        atomic_init(&rings[p].tail, 0);
+        rings[p].cache = cache;
+        rings[p].ops = 0;
+        pthread_create(&threads[2 * p], NULL, producer_thread, &rings[p]);
+        pthread_create(&threads[2 * p + 1], NULL, consumer_thread, &rings[p]);
+    }
+    usleep(run_seconds * 1e6);
+    atomic_store(&stop, true);
+
+    long ops = 0;
+    for (int p = 0; p < npairs; p++) {
+        pthread_join(threads[2 * p], NULL);
+        pthread_join(threads[2 * p + 1], NULL);
+        ops += rings[p].ops;
+    }
+    double elapsed = now() - start;
+    free(rings);
+    return elapsed * npairs * 1e9 / ops;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 2) run_seconds = atof(argv[2]);
+    if (max_threads < 1) max_threads = 1;
+
+    pbx = pbx_init();
+    SLAB_CACHE *cache = slab_cache_create("bench", OBJECT_SIZE);
+    if (!pbx || !cache) {
+        fprintf(stderr, "ERROR: failed to initialize\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %12s\n", "threads", "connects/s");
+    for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) { // 1, 2, 4, ..., max_threads
+        printf("%8d %12.0f\n", n, run_connects(n));
+        if (n == max_threads) break;
+    }
+
+    printf("\n%8s %12s %12s\n", "pairs", "slab ns/obj", "malloc ns/obj");
+    for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        double slab = run_handoff(n, cache);
+        double libc = run_handoff(n, NULL);
+        printf("%8d %12.1f %12.1f\n", n, slab, libc);
+        if (n == max_threads) break;
+    }
+
+    pbx_shutdown(pbx);
+    return EXIT_SUCCESS;
+}
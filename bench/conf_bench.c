@@ -0,0 +1,121 @@
+/*
+ * Conference fan-out benchmark.  A room is filled with members, each on a
+ * socket pair whose client end is read after every chat, and one member
+ * keeps chatting.  Reported for each room size is the time per chat and
+ * per receiving member, next to the time the same number of bare
+ * sendmsg() calls of the same line take: the floor set by the system
+ * calls themselves.  The chat line is formatted once and shared by every
+ * member's queue, so the two should stay close.
+ *
+ * Usage: conf_bench [<max members> [<chats per run>]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+
+#define ROOM 9000
+#define LINE "CHAT standup: yesterday I fixed the build, today I review PRs\r\n"
+
+static int nchats = 2000;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read whatever is waiting on every client end, as the clients would
+static void drain(int *clients, int n) {
+    char buf[4096];
+    for (int i = 0; i < n; i++) {
+        while (recv(clients[i], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            ;
+    }
+}
+
+static void run(int n) {
+    int *clients = calloc(n, sizeof(int));
+    int *servers = calloc(n, sizeof(int));
+    TU **tus = calloc(n, sizeof(TU *));
+    if (!clients || !servers || !tus) exit(EXIT_FAILURE);
+
+    for (int i = 0; i < n; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+            !(tus[i] = tu_init(sv[1])) || pbx_register_next(pbx, tus[i]) == -1) {
+            fprintf(stderr, "ERROR: failed to set up TUs\n");
+            exit(EXIT_FAILURE);
+        }
+        clients[i] = sv[0];
+        servers[i] = sv[1];
+        tu_pickup(tus[i]);
+        if (pbx_dial(pbx, tus[i], ROOM) == -1) {
+            fprintf(stderr, "ERROR: failed to join the room\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    drain(clients, n);
+
+    // Chats through the room
+    const char *text = LINE + sizeof("CHAT ") - 1;
+    size_t len = sizeof(LINE) - 1 - (sizeof("CHAT ") - 1) - 2;
+    double chat_time = 0;
+    for (int c = 0; c < nchats; c++) {
+        double start = now();
+        tu_chat_buf(tus[0], text, len);
+        chat_time += now() - start;
+        drain(clients, n);
+    }
+
+    // The same line sent straight to each member's socket
+    double send_time = 0;
+    for (int c = 0; c < nchats; c++) {
+        double start = now();
+        for (int i = 1; i < n; i++) {
+            send(servers[i], LINE, sizeof(LINE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        send_time += now() - start;
+        drain(clients, n);
+    }
+
+    printf("%8d %12.1f %12.1f %14.1f\n", n, chat_time / nchats * 1e6,
+           chat_time / nchats / (n - 1) * 1e9, send_time / nchats / (n - 1) * 1e9);
+
+    for (int i = 0; i < n; i++) {
+        pbx_unregister(pbx, tus[i]); // leaves the room
+        tu_unref(tus[i], "Benchmark done"); // closes the server end
+        close(clients[i]);
+    }
+    free(clients);
+    free(servers);
+    free(tus);
+}
+
+int main(int argc, char *argv[]) {
+    int max_members = argc > 1 ? atoi(argv[1]) : 512;
+    if (argc > 2) nchats = atoi(argv[2]);
+    if (max_members < 2) max_members = 2;
+    if (nchats < 1) nchats = 1;
+
+    pbx = pbx_init();
+    if (!pbx || pbx_set_conference_ranges(pbx, "9000") == -1) {
+        fprintf(stderr, "ERROR: failed to initialize PBX\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %12s %12s %14s\n", "members", "us/chat", "ns/member", "ns/bare send");
+    for (int n = 2; ; n = n * 4 < max_members ? n * 4 : max_members) { // 2, 8, 32, ..., max_members
+        run(n);
+        if (n == max_members) break;
+    }
+
+    pbx_shutdown(pbx);
+    return EXIT_SUCCESS;
+}
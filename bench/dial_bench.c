@@ -0,0 +1,139 @@
+/*
+ * Contention benchmark for the PBX registry: each thread repeatedly picks
+ * up one TU, dials a second TU of its own and hangs up again, while its
+ * clients read their notifications as a real softphone would.  Threads
+ * never dial each other's TUs, and the target is looked up without taking
+ * any lock, so the dials should scale with the number of cores and the
+ * time per dial should stay flat.  For comparison each run is repeated
+ * with every pbx_dial() serialized by one global mutex, which is how the
+ * registry used to behave.
+ *
+ * Usage: dial_bench [<max threads> [<seconds per run>]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+
+static double run_seconds = 1.0;
+static int use_global_lock;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool stop;
+
+typedef struct worker {
+    pthread_t thread;
+    int client[2]; // client ends of the connections of the two TUs
+    TU *tu[2];
+    long dials;
+} WORKER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read whatever notifications are waiting, as the clients would
+static void drain(WORKER *w) {
+    char buf[4096];
+    for (int i = 0; i < 2; i++) {
+        while (recv(w->client[i], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            ;
+    }
+}
+
+static void *worker_thread(void *arg) {
+    WORKER *w = arg;
+    int target = tu_extension(w->tu[1]);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        tu_pickup(w->tu[0]);
+        if (use_global_lock) pthread_mutex_lock(&global_lock);
+        pbx_dial(pbx, w->tu[0], target);
+        if (use_global_lock) pthread_mutex_unlock(&global_lock);
+        tu_hangup(w->tu[0]);
+        w->dials++;
+        drain(w);
+    }
+    return NULL;
+}
+
+// Set up a TU registered on the server end of a fresh connection
+static int open_tu(WORKER *w, int i) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) return -1;
+    w->client[i] = sv[0];
+    w->tu[i] = tu_init(sv[1]);
+    if (!w->tu[i] || pbx_register(pbx, w->tu[i], sv[1]) == -1) return -1;
+    return 0;
+}
+
+static double run(int nthreads) {
+    WORKER *workers = calloc(nthreads, sizeof(WORKER));
+    if (!workers) return -1;
+
+    for (int t = 0; t < nthreads; t++) {
+        if (open_tu(&workers[t], 0) == -1 || open_tu(&workers[t], 1) == -1) {
+            fprintf(stderr, "ERROR: failed to set up TUs\n");
+            exit(EXIT_FAILURE);
+        }
+        drain(&workers[t]);
+    }
+
+    atomic_store(&stop, false);
+    double start = now();
+    for (int t = 0; t < nthreads; t++) {
+        pthread_create(&workers[t].thread, NULL, worker_thread, &workers[t]);
+    }
+    usleep(run_seconds * 1e6);
+    atomic_store(&stop, true);
+
+    long dials = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        dials += workers[t].dials;
+    }
+    double elapsed = now() - start;
+
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < 2; i++) {
+            pbx_unregister(pbx, workers[t].tu[i]);
+            tu_unref(workers[t].tu[i], "Benchmark done"); // closes the server end
+            close(workers[t].client[i]);
+        }
+    }
+    free(workers);
+    return dials / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 2) run_seconds = atof(argv[2]);
+    if (max_threads < 1) max_threads = 1;
+
+    pbx = pbx_init();
+    if (!pbx) {
+        fprintf(stderr, "ERROR: failed to initialize PBX\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %17s %16s\n", "threads", "lock-free dials/s", "global dials/s");
+    for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) { // 1, 2, 4, ..., max_threads
+        use_global_lock = 0;
+        double lockfree = run(n);
+        use_global_lock = 1;
+        double global = run(n);
+        printf("%8d %17.0f %16.0f\n", n, lockfree, global);
+        if (n == max_threads) break;
+    }
+
+    pbx_shutdown(pbx);
+    return EXIT_SUCCESS;
+}
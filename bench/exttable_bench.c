@@ -0,0 +1,100 @@
+/*
+ * Benchmark for the sparse extension table: fill it with N extensions,
+ * either numbered densely from 1 or scattered over a 7-digit dial plan,
+ * then look up random registered numbers.  Reports the time per insertion
+ * (including directory growth) and per lookup, and the memory taken by
+ * the table next to what a flat array indexed by extension number would need
+ * for the same numbers.
+ *
+ * Usage: exttable_bench [<max extensions>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "exttable.h"
+#include "rcu.h"
+
+#define LOOKUPS 10000000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Numbers of a run: 1..n, or n distinct random numbers from 1000000-9999999
+static int *make_numbers(int n, int sparse) {
+    int *numbers = malloc(n * sizeof(int));
+    if (!numbers) return NULL;
+    if (!sparse) {
+        for (int i = 0; i < n; i++) numbers[i] = i + 1;
+        return numbers;
+    }
+
+    unsigned char *used = calloc(9000000, 1);
+    if (!used) {
+        free(numbers);
+        return NULL;
+    }
+    for (int i = 0; i < n; ) {
+        int x = rand() % 9000000;
+        if (used[x]) continue;
+        used[x] = 1;
+        numbers[i++] = 1000000 + x;
+    }
+    free(used);
+    return numbers;
+}
+
+static void run(int n, int sparse) {
+    int *numbers = make_numbers(n, sparse);
+    EXT_TABLE *t = ext_table_init();
+    if (!numbers || !t) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int max = 0;
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        _Atomic(TU *) *slot = ext_table_slot(t, numbers[i]);
+        atomic_store_explicit(slot, (TU *)(uintptr_t)(i + 1), memory_order_release); // never dereferenced
+        if (numbers[i] > max) max = numbers[i];
+    }
+    double insert = now() - start;
+
+    unsigned seed = 1;
+    uintptr_t sum = 0;
+    start = now();
+    rcu_read_lock();
+    for (int i = 0; i < LOOKUPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        _Atomic(TU *) *slot = ext_table_lookup(t, numbers[(seed >> 8) % n]);
+        sum += (uintptr_t)atomic_load_explicit(slot, memory_order_acquire);
+    }
+    rcu_read_unlock();
+    double lookup = now() - start;
+
+    printf("%10d %7s %12.1f %12.1f %12.1f %12.1f%s\n", n, sparse ? "sparse" : "dense",
+           insert / n * 1e9, lookup / LOOKUPS * 1e9,
+           ext_table_memory(t) / 1048576.0, (max + 1.0) * sizeof(TU *) / 1048576.0,
+           sum ? "" : " ?"); // keep the lookups from being optimized away
+
+    ext_table_fini(t);
+    free(numbers);
+}
+
+int main(int argc, char *argv[]) {
+    int max = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (max < 1000) max = 1000;
+
+    printf("%10s %7s %12s %12s %12s %12s\n", "extensions", "numbers", "insert ns", "lookup ns", "table MB", "flat MB");
+    for (int n = 1000; ; n = n * 10 < max ? n * 10 : max) { // 1000, 10000, ..., max
+        run(n, 0);
+        run(n, 1);
+        if (n == max) break;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/*
+ * Benchmark for the line framer: time taken per byte to frame chat lines
+ * of increasing length, delivered in CHUNK_SIZE reads as by the server.
+ * The cost per byte should stay flat as lines grow.  For comparison, the
+ * same input is run through the strstr()/strlen()/memmove() loop the
+ * server used before, whose cost per byte grows with the line length.
+ * The framer is timed with each EOL scanner this CPU supports.
+ *
+ * Usage: framer_bench [<total MB per run>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pbx.h"
+#include "session.h"
+#include "framer.h"
+
+static size_t lines_seen;
+
+static void count_line(void *arg, char *line, size_t len) {
+    lines_seen++;
+}
+
+// The framing loop server.c used to run on every read
+typedef struct legacy {
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_used;
+} LEGACY;
+
+static int legacy_input(LEGACY *l, char *data, size_t len) {
+    if (l->buffer_size < l->buffer_used + len + 1) {
+        size_t size = (l->buffer_used + len + 1) * 2;
+        char *buffer = realloc(l->buffer, size);
+        if (!buffer) return -1;
+        l->buffer = buffer;
+        l->buffer_size = size;
+    }
+    memcpy(l->buffer + l->buffer_used, data, len);
+    l->buffer_used += len;
+    l->buffer[l->buffer_used] = '\0';
+
+    char *line_start = l->buffer;
+    char *line_end;
+    while ((line_end = strstr(line_start, EOL)) != NULL) {
+        *line_end = '\0';
+        count_line(NULL, line_start, line_end - line_start);
+        line_start = line_end + strlen(EOL);
+    }
+    l->buffer_used = strlen(line_start);
+    memmove(l->buffer, line_start, l->buffer_used);
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Build a stream of "chat xxx...\r\n" lines, each line_len bytes including EOL
+static char *make_stream(size_t line_len, size_t total, size_t *lenp) {
+    size_t nlines = total / line_len ? total / line_len : 1;
+    size_t len = nlines * line_len;
+    char *stream = malloc(len);
+    if (!stream) return NULL;
+    for (size_t i = 0; i < nlines; i++) {
+        char *line = stream + i * line_len;
+        memset(line, 'x', line_len - 2);
+        memcpy(line, "chat ", 5);
+        memcpy(line + line_len - 2, EOL, 2);
+    }
+    *lenp = len;
+    return stream;
+}
+
+// Feed a stream through a framer in CHUNK_SIZE pieces, returning the seconds taken
+static double run(char *stream, size_t len, int legacy) {
+    char chunk[CHUNK_SIZE];
+    FRAMER f;
+    LEGACY l = { 0 };
+    framer_init(&f);
+
+    double start = now();
+    for (size_t off = 0; off < len; off += CHUNK_SIZE) {
+        size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+        memcpy(chunk, stream + off, n); // as read() would
+        if (legacy) {
+            legacy_input(&l, chunk, n);
+        } else {
+            framer_input(&f, chunk, n, count_line, NULL);
+        }
+    }
+    double elapsed = now() - start;
+
+    framer_fini(&f);
+    free(l.buffer);
+    return elapsed;
+}
+
+static const char *scanner_names[] = { "scalar", "sse2", "avx2" };
+#define NSCANNERS (sizeof(scanner_names) / sizeof(scanner_names[0]))
+
+int main(int argc, char *argv[]) {
+    size_t total = (argc > 1 ? atol(argv[1]) : 16) * 1024 * 1024;
+    size_t legacy_max = 1024 * 1024; // beyond this the old loop takes minutes
+    const char *best = framer_scanner();
+
+    printf("EOL scanner chosen at startup: %s\n", best);
+    printf("%12s", "line bytes");
+    for (size_t i = 0; i < NSCANNERS; i++) {
+        printf(" %11s ns/B", scanner_names[i]);
+    }
+    printf(" %11s ns/B\n", "legacy");
+    for (size_t line_len = 64; line_len <= 16 * 1024 * 1024; line_len *= 4) {
+        size_t len;
+        char *stream = make_stream(line_len, total > line_len ? total : line_len, &len);
+        if (!stream) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return EXIT_FAILURE;
+        }
+
+        printf("%12zu", line_len);
+        for (size_t i = 0; i < NSCANNERS; i++) {
+            if (framer_use_scanner(scanner_names[i]) == -1) {
+                printf(" %16s", "-");
+                continue;
+            }
+            lines_seen = 0;
+            double t = run(stream, len, 0);
+            if (lines_seen != len / line_len) {
+                fprintf(stderr, "ERROR: %s scanner found %zu lines, expected %zu\n",
+                        scanner_names[i], lines_seen, len / line_len);
+                return EXIT_FAILURE;
+            }
+            printf(" %16.3f", t * 1e9 / len);
+        }
+        framer_use_scanner(best);
+
+        if (line_len <= legacy_max) {
+            double t = run(stream, len, 1);
+            printf(" %16.3f\n", t * 1e9 / len);
+        } else {
+            printf(" %16s\n", "-");
+        }
+        free(stream);
+    }
+
+    return EXIT_SUCCESS;
+}
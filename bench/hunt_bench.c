@@ -0,0 +1,163 @@
+/*
+ * Hunt group benchmark.  A group has 10 up to 10000 agents, all busy but
+ * one chosen at random for each call.  Reported for each size is the time
+ * to dial the group and have the idle agent ringing, next to the time to
+ * dial that agent's own extension directly, and the time to find it by
+ * trying the agents in turn until one rings, as a caller without a hunt
+ * group would.  Picking the agent from the group's idle list should cost
+ * the same however many agents there are.
+ *
+ * As in page_bench, every TU is on a UDP socket connected to one shared
+ * receiver, so that 10000 agents fit in the usual limit on open files.
+ *
+ * Usage: hunt_bench [<max agents> [<calls per run>]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+
+#define GROUP 100000 // the hunt group's number, above every agent's
+#define SCAN_WORK 1000000 // agents tried in all by the sequential runs, to bound their time
+
+static int ncalls = 2000;
+static int receiver = -1; // where every TU's lines end up
+static struct sockaddr_in receiver_addr;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Throw away whatever has arrived
+static void drain(void) {
+    char buf[4096];
+    while (recv(receiver, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+static TU *new_tu(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    TU *tu = NULL;
+    if (fd == -1 || connect(fd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1 ||
+        !(tu = tu_init(fd)) || pbx_register_next(pbx, tu) == -1) {
+        fprintf(stderr, "ERROR: failed to set up a TU\n");
+        exit(EXIT_FAILURE);
+    }
+    return tu;
+}
+
+// Dial the group, the idle agent's own extension, or each agent in turn until one rings
+typedef enum { DIAL_GROUP, DIAL_DIRECT, DIAL_SCAN } DIAL_HOW;
+
+static double run_calls(TU *caller, TU **agents, int n, DIAL_HOW how, int calls) {
+    double total = 0;
+    unsigned seed = 1;
+    for (int c = 0; c < calls; c++) {
+        TU *idle = agents[rand_r(&seed) % n];
+        tu_hangup(idle); // the one agent on hook
+        tu_pickup(caller);
+
+        double start = now();
+        if (how == DIAL_GROUP) {
+            pbx_dial(pbx, caller, GROUP);
+        } else if (how == DIAL_DIRECT) {
+            pbx_dial(pbx, caller, tu_extension(idle));
+        } else {
+            for (int i = 0; i < n && pbx_dial(pbx, caller, tu_extension(agents[i])) == -1; i++) {
+                tu_hangup(caller); // busy - try the next
+                tu_pickup(caller);
+            }
+        }
+        total += now() - start;
+
+        tu_hangup(caller); // the agent goes back on hook
+        tu_pickup(idle); // and busy again
+        drain();
+    }
+    return total / calls;
+}
+
+static void run(int n) {
+    TU *caller = new_tu(); // on extension 1
+    TU **agents = calloc(n, sizeof(TU *));
+    if (!agents) exit(EXIT_FAILURE);
+    for (int i = 0; i < n; i++) {
+        agents[i] = new_tu(); // on extensions 2 to n + 1
+        tu_pickup(agents[i]); // busy
+    }
+    drain();
+
+    int scan_calls = SCAN_WORK / n < ncalls ? SCAN_WORK / n : ncalls;
+    if (scan_calls < 1) scan_calls = 1;
+    double group = run_calls(caller, agents, n, DIAL_GROUP, ncalls);
+    double direct = run_calls(caller, agents, n, DIAL_DIRECT, ncalls);
+    double scan = run_calls(caller, agents, n, DIAL_SCAN, scan_calls);
+    printf("%8d %14.2f %14.2f %14.2f\n", n, group * 1e6, direct * 1e6, scan * 1e6);
+
+    for (int i = 0; i < n; i++) {
+        pbx_unregister(pbx, agents[i]);
+        tu_unref(agents[i], "Benchmark done"); // closes the socket
+    }
+    pbx_unregister(pbx, caller);
+    tu_unref(caller, "Benchmark done");
+    drain();
+    free(agents);
+}
+
+int main(int argc, char *argv[]) {
+    int max_agents = argc > 1 ? atoi(argv[1]) : 10000;
+    if (argc > 2) ncalls = atoi(argv[2]);
+    if (max_agents < 1) max_agents = 1;
+    if (ncalls < 1) ncalls = 1;
+
+    // A descriptor per TU, and a few to spare
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)max_agents + 64 > rl.rlim_cur) {
+        max_agents = rl.rlim_cur - 64;
+        fprintf(stderr, "Limited to %d agents by the limit on open files\n", max_agents);
+    }
+
+    receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(receiver_addr);
+    if (receiver == -1 || bind(receiver, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1 ||
+        getsockname(receiver, (struct sockaddr *)&receiver_addr, &alen) == -1) {
+        perror("ERROR: failed to open the receiving socket");
+        return EXIT_FAILURE;
+    }
+
+    // Numbers are handed out lowest first, so every run's agents are in the group
+    char ranges[64];
+    snprintf(ranges, sizeof(ranges), "2-%d", max_agents + 1);
+    pbx = pbx_init();
+    if (!pbx || pbx_set_extension_ranges(pbx, "1-200000") == -1 || pbx_add_hunt_group(pbx, GROUP, ranges, 0) == -1) {
+        fprintf(stderr, "ERROR: failed to initialize PBX\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %14s %14s %14s\n", "agents", "us/hunt dial", "us/direct dial", "us/sequential");
+    for (int n = max_agents < 10 ? max_agents : 10; ; n = n * 10 < max_agents ? n * 10 : max_agents) { // 10, 100, ..., max_agents
+        run(n);
+        if (n >= max_agents) break;
+    }
+
+    pbx_shutdown(pbx);
+    close(receiver);
+    return EXIT_SUCCESS;
+}
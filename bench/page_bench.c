@@ -0,0 +1,166 @@
+/*
+ * Paging fan-out benchmark.  One TU pages every other registered TU, and
+ * then a paging group holding all of them, for 100 up to 10000 extensions.
+ * Reported for each size is the time a page takes to be sent to everyone
+ * (pbx_page() returns once every line has been handed to the kernel), per
+ * page and per extension paged, next to the time the same number of bare
+ * send() calls of the same line take: the floor set by the system calls
+ * themselves.
+ *
+ * Each TU is on a UDP socket connected to one receiving socket shared by
+ * all, rather than on a socket pair, so that 10000 extensions fit in the
+ * usual limit on open files.  Lines the receiver has no room for are
+ * dropped by the kernel after they have been sent, which does not change
+ * the cost of sending them.
+ *
+ * Usage: page_bench [<max extensions> [<pages per run>]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+
+#define MSG "fire drill at 3pm, please make your way to the car park"
+
+static int npages = 50;
+static int receiver = -1; // where every TU's lines end up
+static struct sockaddr_in receiver_addr;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Throw away whatever has arrived
+static void drain(void) {
+    char buf[4096];
+    while (recv(receiver, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+static int open_sender(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1) {
+        perror("ERROR: failed to open a TU socket");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void run(int n) {
+    TU **tus = calloc(n + 1, sizeof(TU *)); // tus[0] pages the other n
+    int *fds = calloc(n + 1, sizeof(int));
+    if (!tus || !fds) exit(EXIT_FAILURE);
+
+    for (int i = 0; i <= n; i++) {
+        fds[i] = open_sender();
+        if (!(tus[i] = tu_init(fds[i])) || pbx_register_next(pbx, tus[i]) == -1) {
+            fprintf(stderr, "ERROR: failed to set up TUs\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    drain();
+
+    // Everyone registered, found under RCU
+    double all_time = 0;
+    for (int p = 0; p < npages; p++) {
+        double start = now();
+        pbx_page(pbx, tus[0], PBX_PAGE_ALL, MSG, sizeof(MSG) - 1);
+        all_time += now() - start;
+        drain();
+    }
+
+    // A group of the same extensions, looked up number by number
+    double group_time = 0;
+    for (int p = 0; p < npages; p++) {
+        double start = now();
+        pbx_page(pbx, tus[0], n, MSG, sizeof(MSG) - 1);
+        group_time += now() - start;
+        drain();
+    }
+
+    // The same line sent straight to each socket
+    char line[128];
+    int len = snprintf(line, sizeof(line), "PAGE %d %s\r\n", tu_extension(tus[0]), MSG);
+    double send_time = 0;
+    for (int p = 0; p < npages; p++) {
+        double start = now();
+        for (int i = 1; i <= n; i++) {
+            send(fds[i], line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        send_time += now() - start;
+        drain();
+    }
+
+    printf("%10d %12.1f %14.1f %12.1f %14.1f\n", n, all_time / npages * 1e6, group_time / npages * 1e6,
+           all_time / npages / n * 1e9, send_time / npages / n * 1e9);
+
+    for (int i = 0; i <= n; i++) {
+        pbx_unregister(pbx, tus[i]);
+        tu_unref(tus[i], "Benchmark done"); // closes the socket
+    }
+    free(tus);
+    free(fds);
+}
+
+int main(int argc, char *argv[]) {
+    int max_exts = argc > 1 ? atoi(argv[1]) : 10000;
+    if (argc > 2) npages = atoi(argv[2]);
+    if (max_exts < 1) max_exts = 1;
+    if (npages < 1) npages = 1;
+
+    // A descriptor per TU, and a few to spare
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)max_exts + 64 > rl.rlim_cur) {
+        max_exts = rl.rlim_cur - 64;
+        fprintf(stderr, "Limited to %d extensions by the limit on open files\n", max_exts);
+    }
+
+    receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(receiver_addr);
+    if (receiver == -1 || bind(receiver, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1 ||
+        getsockname(receiver, (struct sockaddr *)&receiver_addr, &alen) == -1) {
+        perror("ERROR: failed to open the receiving socket");
+        return EXIT_FAILURE;
+    }
+
+    pbx = pbx_init();
+    if (!pbx) {
+        fprintf(stderr, "ERROR: failed to initialize PBX\n");
+        return EXIT_FAILURE;
+    }
+
+    // A group per size holding every extension of its run (numbers are handed out lowest first)
+    for (int n = max_exts < 100 ? max_exts : 100; ; n = n * 10 < max_exts ? n * 10 : max_exts) {
+        char ranges[32];
+        snprintf(ranges, sizeof(ranges), "1-%d", n + 1);
+        if (pbx_add_paging_group(pbx, n, ranges) == -1) return EXIT_FAILURE;
+        if (n >= max_exts) break;
+    }
+
+    printf("%10s %12s %14s %12s %14s\n", "extensions", "us/page all", "us/page group", "ns/ext", "ns/bare send");
+    for (int n = max_exts < 100 ? max_exts : 100; ; n = n * 10 < max_exts ? n * 10 : max_exts) { // 100, 1000, 10000, ..., max_exts
+        run(n);
+        if (n >= max_exts) break;
+    }
+
+    pbx_shutdown(pbx);
+    close(receiver);
+    return EXIT_SUCCESS;
+}
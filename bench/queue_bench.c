@@ -0,0 +1,156 @@
+/*
+ * Call queue benchmark.  One agent answers a call queue, and 10 up to
+ * 10000 callers dial it while the agent is busy, so that all of them wait.
+ * Reported for each length of queue is the time for a caller to join it,
+ * and the time for the agent to hang up and be rung for the caller at the
+ * head, next to the time to hang up with no one waiting.  Both should cost
+ * the same however many callers are waiting.
+ *
+ * As in page_bench, every TU is on a UDP socket connected to one shared
+ * receiver, so that 10000 callers fit in the usual limit on open files.
+ *
+ * Usage: queue_bench [<max callers>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+
+#define QUEUE 100000 // the queue's number, above every caller's
+#define DRAIN_EVERY 64 // operations between emptying the receiver
+
+static int receiver = -1; // where every TU's lines end up
+static struct sockaddr_in receiver_addr;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Throw away whatever has arrived
+static void drain(void) {
+    char buf[4096];
+    while (recv(receiver, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+static TU *new_tu(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    TU *tu = NULL;
+    if (fd == -1 || connect(fd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1 ||
+        !(tu = tu_init(fd)) || pbx_register_next(pbx, tu) == -1) {
+        fprintf(stderr, "ERROR: failed to set up a TU\n");
+        exit(EXIT_FAILURE);
+    }
+    return tu;
+}
+
+static void run(int n) {
+    TU *agent = new_tu(); // on extension 1, the queue's only member
+    TU **callers = calloc(n + 1, sizeof(TU *));
+    if (!callers) exit(EXIT_FAILURE);
+    for (int i = 0; i <= n; i++) {
+        callers[i] = new_tu();
+    }
+    drain();
+
+    // Hanging up with no one waiting: the agent just goes back on the idle list
+    double idle_time = 0;
+    for (int i = 0; i < n; i++) {
+        tu_pickup(callers[i]);
+        pbx_dial(pbx, callers[i], QUEUE);
+        tu_pickup(agent);
+        double start = now();
+        tu_hangup(agent);
+        idle_time += now() - start;
+        tu_hangup(callers[i]);
+        if (i % DRAIN_EVERY == 0) drain();
+    }
+
+    // The agent busy with callers[0], and everyone else joining the queue behind it
+    tu_pickup(callers[0]);
+    pbx_dial(pbx, callers[0], QUEUE);
+    tu_pickup(agent);
+    double enqueue_time = 0;
+    for (int i = 1; i <= n; i++) {
+        tu_pickup(callers[i]);
+        double start = now();
+        pbx_dial(pbx, callers[i], QUEUE);
+        enqueue_time += now() - start;
+        if (i % DRAIN_EVERY == 0) drain();
+    }
+
+    // Each hangup rings the agent for the next in line, who is answered
+    double dequeue_time = 0;
+    for (int i = 1; i <= n; i++) {
+        double start = now();
+        tu_hangup(agent);
+        dequeue_time += now() - start;
+        tu_pickup(agent);
+        if (i % DRAIN_EVERY == 0) drain();
+    }
+    tu_hangup(agent);
+
+    printf("%8d %12.2f %12.2f %14.2f\n", n, enqueue_time / n * 1e6, dequeue_time / n * 1e6, idle_time / n * 1e6);
+
+    for (int i = 0; i <= n; i++) {
+        pbx_unregister(pbx, callers[i]);
+        tu_unref(callers[i], "Benchmark done"); // closes the socket
+    }
+    pbx_unregister(pbx, agent);
+    tu_unref(agent, "Benchmark done");
+    drain();
+    free(callers);
+}
+
+int main(int argc, char *argv[]) {
+    int max_callers = argc > 1 ? atoi(argv[1]) : 10000;
+    if (max_callers < 1) max_callers = 1;
+
+    // A descriptor per TU, and a few to spare
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)max_callers + 64 > rl.rlim_cur) {
+        max_callers = rl.rlim_cur - 64;
+        fprintf(stderr, "Limited to %d callers by the limit on open files\n", max_callers);
+    }
+
+    receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(receiver_addr);
+    if (receiver == -1 || bind(receiver, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) == -1 ||
+        getsockname(receiver, (struct sockaddr *)&receiver_addr, &alen) == -1) {
+        perror("ERROR: failed to open the receiving socket");
+        return EXIT_FAILURE;
+    }
+
+    pbx = pbx_init();
+    if (!pbx || pbx_set_extension_ranges(pbx, "1-200000") == -1 || pbx_add_hunt_group(pbx, QUEUE, "1", 1) == -1) {
+        fprintf(stderr, "ERROR: failed to initialize PBX\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %12s %12s %14s\n", "waiting", "us/enqueue", "us/dequeue", "us/idle hangup");
+    for (int n = max_callers < 10 ? max_callers : 10; ; n = n * 10 < max_callers ? n * 10 : max_callers) { // 10, 100, ..., max_callers
+        run(n);
+        if (n >= max_callers) break;
+    }
+
+    pbx_shutdown(pbx);
+    close(receiver);
+    return EXIT_SUCCESS;
+}
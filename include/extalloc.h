@@ -0,0 +1,80 @@
+#ifndef EXTALLOC_H
+#define EXTALLOC_H
+
+#include <stddef.h>
+
+/*
+ * Allocator of extension numbers.
+ *
+ * Numbers are handed out from one or more configured ranges, lowest free
+ * number first.  Each range keeps a hierarchical bitmap of its free numbers,
+ * 64 to a word at every level, so finding and taking the lowest free number
+ * is a count-trailing-zeros per level (at most five levels for the largest
+ * possible range), as is returning a number.
+ *
+ * The ranges are kept sorted, so the range holding a number is found by
+ * binary search, and each has a lock of its own: threads taking or
+ * returning numbers in different ranges do not contend.  A count of free
+ * numbers per range lets ext_alloc_get() pass over full ranges without
+ * locking them.
+ *
+ * Numbers can also be reserved for static assignment: a reserved number is
+ * never handed out by ext_alloc_get(), and is only used when it is
+ * explicitly claimed.
+ */
+typedef struct ext_alloc EXT_ALLOC;
+
+/*
+ * Create an allocator.
+ *
+ * @param ranges  Comma-separated list of ranges, each either a single
+ * number or "first-last", e.g. "100-199,500,1000-1999".  Ranges must not
+ * overlap and numbers must be non-negative.
+ * @param max  The most numbers the ranges may hold in all.  The whole list
+ * is checked against it before any memory is allocated for the ranges.
+ * @return the allocator, or NULL if the list is malformed or too long or
+ * memory runs out.
+ */
+EXT_ALLOC *ext_alloc_init(const char *ranges, size_t max);
+
+/*
+ * Free an allocator.
+ */
+void ext_alloc_fini(EXT_ALLOC *a);
+
+/*
+ * Get the highest number in any range of an allocator.
+ */
+int ext_alloc_max(EXT_ALLOC *a);
+
+/*
+ * Take the lowest free, unreserved number.
+ *
+ * @return the number, or -1 if every number is taken.
+ */
+int ext_alloc_get(EXT_ALLOC *a);
+
+/*
+ * Take a specific number.
+ *
+ * @return 0 if the number was free or is reserved, -1 if it is already
+ * taken, 1 if it lies outside every range (and so is not managed by the
+ * allocator).
+ */
+int ext_alloc_claim(EXT_ALLOC *a, int ext);
+
+/*
+ * Return a number taken with ext_alloc_get() or ext_alloc_claim().
+ * Reserved numbers and numbers outside every range are ignored.
+ */
+void ext_alloc_put(EXT_ALLOC *a, int ext);
+
+/*
+ * Reserve a free number for static assignment.
+ *
+ * @return 0 if successful, -1 if the number is taken, is reserved already or
+ * lies outside every range.
+ */
+int ext_alloc_reserve(EXT_ALLOC *a, int ext);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef EXTTABLE_H
+#define EXTTABLE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "tu.h"
+
+/*
+ * Sparse table mapping extension numbers to TUs.
+ *
+ * The table is a two-level radix tree: a directory of pointers to pages,
+ * each holding the slots of EXT_TABLE_PAGE_SIZE consecutive numbers.  Pages
+ * are allocated the first time a number in them is used, so the slots take
+ * memory only for the numbers in use; the directory takes one pointer per
+ * page up to the largest number used (2 MiB at most for 7-digit numbers,
+ * but 256 MiB once numbers near INT_MAX are used).  A lookup is two dependent
+ * loads whatever the number of extensions.
+ *
+ * When a number beyond the end of the directory is used, the directory is
+ * replaced by a copy twice as large (or larger if need be).  Only page
+ * pointers are copied, never slots, and lookups carry on in the old copy
+ * while this happens; the old copy is freed after rcu_synchronize().  Pages
+ * are never freed before the table is, so a slot pointer, once obtained,
+ * stays valid.
+ *
+ * Lookups must be made within an RCU read-side critical section (see
+ * rcu.h).  Creating slots is serialized internally.  Reading and writing
+ * the slots themselves is up to the caller.
+ */
+typedef struct ext_table EXT_TABLE;
+
+#define EXT_TABLE_PAGE_SIZE 64 // slots per page: 512 bytes of pointers
+
+/*
+ * Create an empty table.
+ *
+ * @return the table, or NULL if memory runs out.
+ */
+EXT_TABLE *ext_table_init(void);
+
+/*
+ * Free a table and all its pages.  The TUs in it are not touched.
+ */
+void ext_table_fini(EXT_TABLE *t);
+
+/*
+ * Find the slot of an extension number, if its page exists.
+ * Call within rcu_read_lock()/rcu_read_unlock().
+ *
+ * @return the slot, or NULL if no number in its page has ever been used.
+ */
+_Atomic(TU *) *ext_table_lookup(EXT_TABLE *t, int ext);
+
+/*
+ * Find the slot of an extension number, creating its page (and growing
+ * the directory) if need be.  This may call rcu_synchronize(), so it must
+ * not be called within a read-side critical section.
+ *
+ * @return the slot, or NULL if ext is negative or memory runs out.
+ */
+_Atomic(TU *) *ext_table_slot(EXT_TABLE *t, int ext);
+
+/*
+ * Get the memory taken by a table's directory and pages, in bytes.
+ */
+size_t ext_table_memory(EXT_TABLE *t);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <stddef.h>
+
+/*
+ * Incremental line framer.
+ *
+ * Splits the byte stream received on a connection into EOL-terminated
+ * lines.  Each byte is scanned for EOL exactly once, however the stream is
+ * split into reads: complete lines within a read are handed over in place,
+ * and only a line still incomplete at the end of a read is copied into the
+ * framer's buffer, which then grows with the line until its EOL arrives.
+ * The total cost is linear in the amount of data, whatever the line lengths.
+ */
+typedef struct framer {
+    char *buf; // start of an incomplete line (NULL when there is none)
+    size_t size; // allocated size of buf
+    size_t used; // bytes of buf in use
+} FRAMER;
+
+/*
+ * Function to which each complete line is handed.  The line has had its
+ * EOL replaced by a NUL terminator and may be modified in place, but is
+ * only valid until the function returns.
+ *
+ * @param arg  The argument passed to framer_input().
+ * @param line  The line.
+ * @param len  The length of the line, not counting the terminator.
+ */
+typedef void (*FRAMER_LINE_FN)(void *arg, char *line, size_t len);
+
+/*
+ * Initialize a framer, with no incomplete line.
+ */
+void framer_init(FRAMER *f);
+
+/*
+ * Release the buffer of a framer, discarding any incomplete line.
+ */
+void framer_fini(FRAMER *f);
+
+/*
+ * Feed data received on the connection into a framer, calling fn for each
+ * line it completes.
+ *
+ * @param f  The framer.
+ * @param data  The data received.  It is modified in place.
+ * @param len  Number of bytes of data.
+ * @param fn  Function to be called for each complete line.
+ * @param arg  Argument passed to fn.
+ * @return 0 if successful, -1 if memory for an incomplete line could not
+ * be allocated.
+ */
+int framer_input(FRAMER *f, char *data, size_t len, FRAMER_LINE_FN fn, void *arg);
+
+/*
+ * Lines are found with a vectorized EOL scanner (AVX2 or SSE2) where the
+ * CPU has one, otherwise with a scalar loop.  The best one is chosen at
+ * startup using CPUID.
+ *
+ * @return the name of the scanner in use: "avx2", "sse2" or "scalar".
+ */
+const char *framer_scanner(void);
+
+/*
+ * Select the EOL scanner to use, overriding the choice made at startup
+ * (for benchmarking).  Not to be called while any framer is in use.
+ *
+ * @param name  "avx2", "sse2" or "scalar".
+ * @return 0 if successful, -1 if there is no such scanner or this CPU
+ * cannot run it.
+ */
+int framer_use_scanner(const char *name);
+
+#endif
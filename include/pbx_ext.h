@@ -0,0 +1,161 @@
+#ifndef PBX_EXT_H
+#define PBX_EXT_H
+
+#include "pbx.h"
+
+/*
+ * Additional interfaces of the PBX module, beyond those fixed by pbx.h.
+ */
+
+/*
+ * Extension numbers handed out by default.
+ */
+#define PBX_DEFAULT_RANGES "1-65535"
+
+/*
+ * Register a TU with a PBX on the lowest free extension number that has not
+ * been reserved, as pbx_register() otherwise does.  Numbers come from an
+ * allocator (see extalloc.h), so they are independent of file descriptors
+ * and a number is only reused once the TU holding it has been unregistered.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU to be registered.
+ * @return the extension number assigned, or -1 if registration failed
+ * (e.g. every number is taken).
+ */
+int pbx_register_next(PBX *pbx, TU *tu);
+
+/*
+ * Set the ranges of extension numbers a PBX hands out, replacing the
+ * default PBX_DEFAULT_RANGES.  The extension table is sized to hold the
+ * highest number in any range.  This must be called before any TU has been
+ * registered.
+ *
+ * @param pbx  The PBX.
+ * @param ranges  Comma-separated list of ranges, e.g. "100-199,500".
+ * @return 0 if successful, -1 if the list is malformed or memory runs out.
+ */
+int pbx_set_extension_ranges(PBX *pbx, const char *ranges);
+
+/*
+ * Reserve an extension number for static assignment, so that it is never
+ * handed out by pbx_register_next() and can only be taken by registering
+ * a TU on it explicitly with pbx_register().
+ *
+ * @param pbx  The PBX.
+ * @param ext  The number, which must be free, not reserved already, and
+ * within one of the ranges.
+ * @return 0 if successful, otherwise -1.
+ */
+int pbx_reserve_extension(PBX *pbx, int ext);
+
+/*
+ * Set the numbers of the conference rooms of a PBX (see tu_ext.h), as a
+ * list of ranges like that of pbx_set_extension_ranges(), replacing any
+ * rooms set before.  Dialing a room's number joins the room.  Room numbers
+ * are never handed out to TUs and cannot be registered or reserved.  This
+ * must be called after pbx_set_extension_ranges() and before any TU has
+ * been registered.
+ *
+ * @param pbx  The PBX.
+ * @param ranges  Comma-separated list of ranges, e.g. "9000-9099".
+ * @return 0 if successful, -1 if the list is malformed, holds more than
+ * 10000 numbers or memory runs out.
+ */
+int pbx_set_conference_ranges(PBX *pbx, const char *ranges);
+
+/*
+ * Add a hunt group to a PBX: a number that rings whichever of a set of
+ * extensions has been on hook the longest (see tu_dial_hunt()), giving
+ * busy signal if none is, or, for a call queue, holding callers in line
+ * until one is.  The members are given as a list of ranges like
+ * that of pbx_set_extension_ranges(); a TU registered on one of them
+ * answers for the group until it is unregistered, and can still be dialed
+ * on its own extension.  The group's number is never handed out to a TU
+ * and cannot be registered or reserved.  This must be called after
+ * pbx_set_extension_ranges() and pbx_set_conference_ranges() and before any
+ * TU has been registered.
+ *
+ * @param pbx  The PBX.
+ * @param number  The number that reaches the group.
+ * @param ranges  Comma-separated list of ranges, e.g. "200-299".
+ * @param queue  Nonzero to make the group a call queue.
+ * @return 0 if successful, -1 if the number is a conference room or
+ * another hunt group, an extension is a member of another hunt group, the
+ * list is malformed or holds more than 65536 numbers, or memory runs out.
+ */
+int pbx_add_hunt_group(PBX *pbx, int number, const char *ranges, int queue);
+
+/*
+ * Paging group number that pages every registered extension.
+ */
+#define PBX_PAGE_ALL 0
+
+/*
+ * Add a paging group to a PBX: a number that pages the TUs registered on
+ * a fixed set of extension numbers, given as a list of ranges like that of
+ * pbx_set_extension_ranges().  The numbers need not be in use, or even
+ * within the ranges handed out; whoever is registered on them when a page
+ * is sent gets it.  This must be called before any TU has been registered.
+ *
+ * @param pbx  The PBX.
+ * @param group  The group's number, greater than PBX_PAGE_ALL and not
+ * already in use.
+ * @param ranges  Comma-separated list of ranges, e.g. "100-199,500".
+ * @return 0 if successful, -1 if the number is taken, the list is
+ * malformed or holds more than 65536 numbers, or memory runs out.
+ */
+int pbx_add_paging_group(PBX *pbx, int group, const char *ranges);
+
+/*
+ * Page a group: send a message from a TU to every TU registered on an
+ * extension of a paging group, or to every registered TU if the group is
+ * PBX_PAGE_ALL (see tu_page()).  The members are found without taking any
+ * PBX lock - a group's TUs are looked up like a dialed extension, and the
+ * registered TUs are read off the PBX's list under RCU - so paging does not
+ * hold up registration, or other pages.  Whoever is registered or
+ * unregistered while a page is being sent may or may not get it.  The
+ * client of the TU paging is sent its current state in all cases.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU paging.
+ * @param group  The paging group, or PBX_PAGE_ALL.
+ * @param msg  The message, which need not be NUL-terminated.
+ * @param len  The length of the message.
+ * @return the number of TUs paged, or -1 if there is no such group or
+ * memory runs out.
+ */
+int pbx_page(PBX *pbx, TU *tu, int group, const char *msg, size_t len);
+
+/*
+ * Camp on the extension that has just given a TU busy signal (see
+ * tu_camp()): as soon as the TU registered there goes on hook, it is rung
+ * for this one.  The target is looked up as pbx_dial() looks up the TU it
+ * dials.  A TU that is unregistered stops camping, and anyone camped on
+ * it gives up.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU camping, which must have busy signal from dialing
+ * another TU.
+ * @return 0 if the TU is camped, otherwise -1.
+ */
+int pbx_camp(PBX *pbx, TU *tu);
+
+/*
+ * Call a function on every TU registered with a PBX.  The PBX keeps its
+ * registered TUs on a list, so this costs time proportional to the number
+ * registered rather than to the range of extension numbers.  The TUs are
+ * taken from a snapshot, each with a reference held until fn has been
+ * called on it, and fn is called with no PBX lock held (nor is one taken
+ * for the snapshot, which is read under RCU), so it may call any
+ * tu_xxx() or pbx_xxx() function.  A TU may be unregistered by the time fn
+ * is called on it.
+ *
+ * @param pbx  The PBX.
+ * @param fn  The function, passed each TU and arg.
+ * @param arg  Passed on to fn.
+ * @return the number of TUs fn was called on.
+ */
+int pbx_foreach(PBX *pbx, void (*fn)(TU *tu, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef RCU_H
+#define RCU_H
+
+/*
+ * Minimal read-copy-update for read-mostly shared pointers.
+ *
+ * Readers bracket their accesses with rcu_read_lock() and rcu_read_unlock().
+ * Neither takes a lock nor writes to memory shared with other readers, so
+ * read-side cost does not depend on how many threads are reading.  A writer
+ * that has unpublished an object (replaced the last shared pointer to it)
+ * calls rcu_synchronize(), which returns once every reader that might still
+ * hold the old pointer has left its read-side critical section.  After
+ * that the object can be released.
+ *
+ * Read-side critical sections may nest but must not block, and must not
+ * call rcu_synchronize().
+ */
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/*
+ * Wait for all read-side critical sections in progress to finish.
+ */
+void rcu_synchronize(void);
+
+/*
+ * Deferred release, for writers that must not wait: embed an RCU_HEAD in
+ * the object and pass it to call_rcu(), which returns at once.  fn is
+ * called with the head, on a reclaimer thread, once every read-side
+ * critical section in progress at the time of the call has finished.
+ * Callbacks run in the order they were queued, and may not call
+ * rcu_synchronize() or rcu_barrier().
+ */
+typedef struct rcu_head {
+    struct rcu_head *next; // next callback queued
+    void (*fn)(struct rcu_head *head);
+} RCU_HEAD;
+
+void call_rcu(RCU_HEAD *head, void (*fn)(RCU_HEAD *head));
+
+/*
+ * Wait until every callback queued by call_rcu() before this call has run.
+ */
+void rcu_barrier(void);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/*
+ * Event-loop I/O model for client connections.
+ *
+ * Instead of a thread per connection blocked in read(), a small fixed set of
+ * loop threads each wait on an edge-triggered epoll instance and drive the
+ * sessions assigned to them.  An idle extension then costs only its TU and
+ * session rather than a thread and its stack.
+ *
+ * Connections either arrive from the main thread's accept loop via
+ * reactor_add(), or each loop accepts on its own SO_REUSEPORT listening
+ * socket (see reactor_listen()) so that accepting scales with the loops.
+ */
+
+/*
+ * Default number of loop threads if none is specified: one per online CPU.
+ */
+int reactor_default_threads(void);
+
+/*
+ * Create the loop threads.
+ *
+ * @param nloops  The number of loop threads to start.
+ * @param pin_cpus  Nonzero to pin loop i to the i-th CPU available to the
+ * process (wrapping around if there are more loops than CPUs).
+ * @return 0 if successful, otherwise -1.
+ */
+int reactor_start(int nloops, int pin_cpus);
+
+/*
+ * Give a loop its own listening socket.  The loop accepts connections on it
+ * and services them itself.
+ *
+ * @param loop  Index of the loop, from 0 to nloops - 1.
+ * @param listen_fd  A listening socket, normally one of several bound to the
+ * same port with SO_REUSEPORT.  The socket is made non-blocking.
+ * @return 0 if successful, otherwise -1.
+ */
+int reactor_listen(int loop, int listen_fd);
+
+/*
+ * Stop all loops from accepting further connections on their listening
+ * sockets.  Called before the PBX is shut down so that no new TUs register
+ * while the existing ones are being disconnected.  Does nothing if there
+ * are no loops.
+ */
+void reactor_stop_listening(void);
+
+/*
+ * Hand a newly accepted connection to one of the loop threads.
+ * A session is opened for the connection, which from then on is serviced
+ * by the loop that it was assigned to.
+ *
+ * @param fd  The file descriptor of the client connection.
+ * @return 0 if successful, otherwise -1, in which case the connection
+ * has been closed.
+ */
+int reactor_add(int fd);
+
+#endif
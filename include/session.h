@@ -0,0 +1,73 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+
+/*
+ * A session is the server-side state for one client connection: the TU
+ * registered for it and whatever partial command line has been received
+ * but not yet terminated by EOL.  Sessions are independent of the I/O
+ * model, so the same parsing and dispatch code is driven by a dedicated
+ * thread in pbx_client_service() or by the event loops in reactor.c.
+ */
+typedef struct session SESSION;
+
+/*
+ * Size of the chunks in which data is read from a client connection.
+ */
+#define CHUNK_SIZE 2048
+
+/*
+ * Read static extension assignments from a file and reserve the numbers
+ * with the PBX.  Each line holds an IPv4 address and an extension number,
+ * separated by whitespace; '#' starts a comment.  A client connecting from
+ * an assigned address is registered on its number instead of the next free
+ * one.  This must be called after the PBX has been initialized and before
+ * any connection is accepted.
+ *
+ * @param path  The file.
+ * @return 0 if successful, -1 if the file can't be read, is malformed, or
+ * assigns a number that is not free in any range.
+ */
+int session_load_assignments(const char *path);
+
+/*
+ * Create a session for a newly accepted connection: initialize a TU for it
+ * and register the TU with the PBX, on the client's statically assigned
+ * extension if it has one, otherwise on the lowest free one.
+ *
+ * @param fd  The file descriptor of the client connection.
+ * @return the new session, or NULL if the TU could not be set up, in which
+ * case the connection has been closed.
+ */
+SESSION *session_open(int fd);
+
+/*
+ * Feed data received from the client into a session.  Each complete
+ * command line is parsed and carried out; any trailing partial line is
+ * retained until more data arrives.
+ *
+ * @param s  The session.
+ * @param data  The data received.  It may be modified in place.
+ * @param len  Number of bytes of data.
+ * @return 0 if successful, -1 if the session can no longer continue.
+ */
+int session_input(SESSION *s, char *data, size_t len);
+
+/*
+ * Tear down a session once its connection has reached EOF: unregister the
+ * TU from the PBX and release the reference held by the session.
+ * The session itself is freed and must not be used again.
+ *
+ * @param s  The session.
+ */
+void session_close(SESSION *s);
+
+/*
+ * Get the file descriptor of the client connection underlying a session.
+ */
+int session_fileno(SESSION *s);
+
+#endif
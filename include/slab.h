@@ -0,0 +1,67 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Slab allocator for fixed-size objects that are allocated and freed at a
+ * high rate, such as the TU of every connection.
+ *
+ * Objects are carved out of large chunks into slots rounded up to a whole
+ * number of cache lines and aligned on a cache line, so no two objects
+ * share a line.  Each thread keeps a magazine of free objects per cache,
+ * from which it allocates and into which it frees without any locking.
+ * Only when its magazine runs empty (or full) does a thread visit the
+ * cache's depot, a global pool of full and empty magazines, to swap a whole
+ * magazine at once.  Objects freed by a thread other than the one that
+ * allocated them thus make their way back through the depot, which keeps
+ * the threads that allocate and those that free balanced.  The magazines
+ * of a thread that exits are returned to the depot, and the objects left in
+ * them are handed out again before any new slot is carved.
+ *
+ * Chunks are never returned to the system: the memory a cache takes is that
+ * needed by the most objects it has had live at once.
+ */
+typedef struct slab_cache SLAB_CACHE;
+
+#define SLAB_MAX_CACHES 8 // caches per process
+
+/*
+ * Create a cache.
+ *
+ * @param name  Name of the cache, for error messages.
+ * @param size  Size of the objects.
+ * @return the cache, or NULL if SLAB_MAX_CACHES have already been created
+ * or memory runs out.
+ */
+SLAB_CACHE *slab_cache_create(const char *name, size_t size);
+
+/*
+ * Create a cache of type-stable objects.  Each object is initialized by
+ * init once, when its slot is first carved out, rather than on every
+ * allocation, and since chunks are never returned to the system a freed
+ * object remains a valid, initialized object of the same type.  A thread
+ * holding a stale pointer to one may thus still lock a mutex inside it, and
+ * must only check afterwards that the object is still the one it wanted.
+ *
+ * @param name  Name of the cache, for error messages.
+ * @param size  Size of the objects.
+ * @param init  Called on each object once, before it is first allocated.
+ * @return the cache, or NULL if SLAB_MAX_CACHES have already been created.
+ */
+SLAB_CACHE *slab_cache_create_typesafe(const char *name, size_t size, void (*init)(void *obj));
+
+/*
+ * Allocate an object from a cache.  Its contents are undefined.
+ *
+ * @return the object, or NULL if memory runs out.
+ */
+void *slab_alloc(SLAB_CACHE *c);
+
+/*
+ * Return an object to the cache it was allocated from.  Any thread may
+ * free any object.
+ */
+void slab_free(SLAB_CACHE *c, void *obj);
+
+#endif
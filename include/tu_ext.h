@@ -0,0 +1,263 @@
+#ifndef TU_EXT_H
+#define TU_EXT_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include "tu.h"
+
+/*
+ * Additional interfaces of the TU module, beyond those fixed by tu.h.
+ */
+
+/*
+ * Per-thread hook through which the TU module sends notifications to
+ * clients.  An I/O backend that owns the client sockets (such as the
+ * io_uring loop) sets this in its own thread so that notifications
+ * produced while it runs tu_xxx() functions are submitted through it rather
+ * than written directly.  The notification is the concatenation of the
+ * iovcnt buffers in iov, which are only valid for the duration of the call.
+ * The hook returns 0 if it has taken responsibility for the data, or -1 if
+ * the TU module should write it itself.
+ */
+extern __thread int (*tu_send_hook)(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Companion to tu_send_hook: the number of bytes the backend has taken for
+ * the client on fd and not yet sent.  They count against the client's
+ * output limit (see tu_set_output_limit()) as if still queued on the TU.
+ */
+extern __thread size_t (*tu_backlog_hook)(int fd);
+
+/*
+ * Process-wide companion to tu_send_hook, for output produced in threads
+ * other than the backend's own, such as the drain thread.  A backend that
+ * owns the client sockets sets it before servicing any.  Such a thread,
+ * instead of writing a TU's output itself, hands the TU over through this
+ * hook; the backend takes a reference to it and later calls
+ * tu_send_output() from its own thread, so the output goes through
+ * tu_send_hook in order with everything else sent to that client.  The
+ * hook returns 0 if it has taken the TU, or -1 if the caller should write
+ * the output itself.
+ */
+extern int (*tu_post_hook)(TU *tu);
+
+/*
+ * Send the output queued for a TU, from a backend's thread, for a TU
+ * handed over through tu_post_hook.
+ */
+void tu_send_output(TU *tu);
+
+/*
+ * "Chat" over a connection, as tu_chat(), given the length of the message.
+ * The message need not be NUL-terminated, so a server can pass a line in
+ * place in its receive buffer.  If nothing is already waiting to go to the
+ * peer, the chat is written to the peer's socket straight from msg, with no
+ * allocation or copy.
+ *
+ * @param tu  The tu sending the chat.
+ * @param msg  The message to be sent.
+ * @param len  The length of the message.
+ * @return 0 if the chat was successfully sent, -1 if there is no call in
+ * progress or some other error occurs.
+ */
+int tu_chat_buf(TU *tu, const char *msg, size_t len);
+
+/*
+ * Bracket a batch of operations carried out by the calling thread, such as
+ * all the commands that arrived in one read.  Each operation still makes
+ * its state transitions atomically, exactly as on its own, but the
+ * notifications they queue are held back until tu_batch_end() and then
+ * sent with one write per client.  Batches may be nested; only the
+ * outermost tu_batch_end() sends.  Must not be called with any TU locked.
+ */
+void tu_batch_begin(void);
+void tu_batch_end(void);
+
+/*
+ * What to do about a client that does not read its notifications as fast as
+ * they are produced.  Notifications are never written with a blocking call:
+ * output the socket will not take is queued on the TU and sent by a drain
+ * thread once the socket becomes writable, so a stuck client cannot hold up
+ * the threads (and locks) of the clients talking to it.  The policy decides
+ * what happens once the queued output reaches the limit.
+ */
+typedef enum tu_output_policy {
+    TU_OUTPUT_DROP_CHAT,   // discard chat for the client; drop it only if it still overflows
+    TU_OUTPUT_DISCONNECT,  // drop the client as soon as it overflows
+    TU_OUTPUT_PARK         // keep queuing up to 16 times the limit before dropping the client
+} TU_OUTPUT_POLICY;
+
+#define TU_OUTPUT_LIMIT_DEFAULT (1024 * 1024) // bytes of output queued per TU
+
+/*
+ * Set the limit on the output queued for each client, and the policy
+ * applied to a client that reaches it.  Should be called before any
+ * clients connect.
+ *
+ * @param limit  Maximum number of bytes queued for a client.
+ * @param policy  What to do with a client that reaches the limit.
+ */
+void tu_set_output_limit(size_t limit, TU_OUTPUT_POLICY policy);
+
+/*
+ * Links embedded in every TU, with which the PBX keeps its registered TUs
+ * on a list without allocating anything.  They belong to whoever has
+ * registered the TU; the TU module only initializes them to NULL.  next is
+ * atomic so that the list can be walked under RCU while it changes.
+ */
+typedef struct tu_link {
+    _Atomic(TU *) next;
+    TU *prev;
+} TU_LINK;
+
+/*
+ * Get the links embedded in a TU.
+ */
+TU_LINK *tu_link(TU *tu);
+
+/*
+ * Close a TU for good: from then on it is not rung, whether dialed
+ * directly, through a hunt group or for a camp, and it neither camps nor
+ * is camped on.  The PBX does this when the TU is unregistered, before the
+ * grace period after which it hangs the TU up, so that a dialer that
+ * looked the TU up just before cannot leave it ringing after that hangup.
+ */
+void tu_close(TU *tu);
+
+/*
+ * Conference rooms, in which any number of TUs talk at once.  A TU with
+ * dial tone joins a room with tu_join() (the PBX does this when the room's
+ * number is dialed) and is then TU_CONNECTED, with the room's number
+ * reported as its peer.  A chat from a member goes to every other member:
+ * the line is formatted once into a reference-counted buffer that the
+ * output queues of all of them share, so each member costs a queued
+ * reference and a send rather than an allocation and a copy.  Hanging up
+ * leaves the room and puts the TU on hook, as after any other call; the
+ * other members carry on.
+ */
+typedef struct conference CONFERENCE;
+
+/*
+ * Create a conference room.
+ *
+ * @param number  The number dialed to join it.
+ * @return the room, or NULL if memory runs out.
+ */
+CONFERENCE *tu_conference_init(int number);
+
+/*
+ * Free a conference room, which must have no members left.
+ */
+void tu_conference_fini(CONFERENCE *conf);
+
+/*
+ * Join a conference room, as tu_dial() does a call to a TU.  If the TU is
+ * not in the TU_DIAL_TONE state there is no effect.  Otherwise it goes to
+ * the TU_CONNECTED state as a member of the room (which holds a reference
+ * to it until it hangs up), or to TU_BUSY_SIGNAL if memory runs out.  The
+ * client is notified of the resulting state in all cases.
+ *
+ * @return 0 if the TU joined the room, otherwise -1.
+ */
+int tu_join(TU *tu, CONFERENCE *conf);
+
+/*
+ * Page many TUs at once: each is sent "PAGE <ext> <msg>", ext being the
+ * extension of the TU paging, whatever state it is in.  As for a
+ * conference chat, the line is formatted once into a shared buffer.  It is
+ * queued for every target before any of them is sent anything, so the
+ * sends go out back to back (and under io_uring, in one submission).  A
+ * target whose output is backed up misses the page under
+ * TU_OUTPUT_DROP_CHAT.  The TU paging is not paged itself; its client is
+ * sent its current state, as the reply to a command that changed nothing.
+ *
+ * @param tu  The TU paging.
+ * @param targets  The TUs to page, each referenced by the caller.
+ * @param ntargets  The number of targets.
+ * @param msg  The message, which need not be NUL-terminated.
+ * @param len  The length of the message.
+ * @return the number of targets the page was queued for, or -1 if memory
+ * runs out.
+ */
+int tu_page(TU *tu, TU **targets, int ntargets, const char *msg, size_t len);
+
+/*
+ * Hunt groups, whose number rings whichever member has been on hook the
+ * longest.  Each group keeps its idle members on a list in the order they
+ * went on hook, brought up to date on every change of a member into or out
+ * of TU_ON_HOOK, so finding the member to ring takes constant time however
+ * many members there are.  A TU is in at most one hunt group.
+ *
+ * A group can also be a call queue: a caller that finds every member busy
+ * waits in TU_RING_BACK, told its place by a "QUEUED <position>" line,
+ * rather than getting busy signal.  Waiting callers are kept in a FIFO
+ * under the group's own lock, and the first member to go on hook is rung
+ * for the one that has waited longest.
+ */
+typedef struct hunt_group HUNT_GROUP;
+
+/*
+ * Create a hunt group.
+ *
+ * @param number  The number dialed to reach it.
+ * @param queue  Nonzero to make callers wait when every member is busy.
+ * @return the group, or NULL if memory runs out.
+ */
+HUNT_GROUP *tu_hunt_group_init(int number, int queue);
+
+/*
+ * Free a hunt group, which must have no members or waiting callers left.
+ */
+void tu_hunt_group_fini(HUNT_GROUP *group);
+
+/*
+ * Make a TU a member of a hunt group, or of none if group is NULL, leaving
+ * any group it was in.  The PBX does this when a TU registers on one of a
+ * group's extensions, and before the TU is freed.
+ */
+void tu_set_hunt_group(TU *tu, HUNT_GROUP *group);
+
+/*
+ * Dial a hunt group, as tu_dial() does a TU: if the TU is not in the
+ * TU_DIAL_TONE state there is no effect; otherwise the member idle longest
+ * is rung, or if no member is on hook the TU goes to TU_BUSY_SIGNAL, or
+ * waits in TU_RING_BACK if the group is a call queue.  Hanging up leaves
+ * the queue.  The client is notified of the resulting state in all cases.
+ *
+ * @return 0 if a member is ringing or the TU is waiting, otherwise -1.
+ */
+int tu_dial_hunt(TU *tu, HUNT_GROUP *group);
+
+/*
+ * Camp-on: a TU that has got busy signal dialing another can ask to be
+ * called back, and the first time the other goes on hook it is rung for
+ * the one camped on it, as if just dialed, whatever state the camper is in
+ * by then short of a call of its own.  Each TU keeps the list of those
+ * camped on it, longest first, and checks it on every change into
+ * TU_ON_HOOK - a single load when the list is empty.  A TU camps on one
+ * other at a time.
+ */
+
+/*
+ * Get the extension a TU may camp on.
+ *
+ * @return the extension of the TU whose being busy gave this one busy
+ * signal, if it still has it, otherwise -1.
+ */
+int tu_camp_extension(TU *tu);
+
+/*
+ * Camp a TU with busy signal on a target, dropping any camp it had.  If
+ * the target is on hook already, it is rung at once.  The client is sent
+ * its current state, as the reply to a command that changed nothing.
+ *
+ * @param tu  The TU camping.
+ * @param target  The TU to camp on, referenced by the caller.
+ * @return 0 if the TU is camped, or -1 if it does not have busy signal,
+ * the target is NULL or the TU itself, or either has been closed.
+ */
+int tu_camp(TU *tu, TU *target);
+
+#endif
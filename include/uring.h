@@ -0,0 +1,25 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * io_uring I/O model for client connections.
+ *
+ * A single loop thread owns an io_uring instance through which it accepts
+ * connections (one multishot accept), receives commands (one multishot recv
+ * per connection, drawing from a ring of provided buffers) and sends
+ * notifications (chains of linked sends, one chain per connection).
+ * Everything produced while handling one batch of completions is submitted
+ * together with a single io_uring_enter(), so small commands such as
+ * pickup and hangup cost a fraction of a system call each.
+ */
+
+/*
+ * Start the io_uring loop thread.
+ *
+ * @param listen_fd  The listening socket on which to accept connections.
+ * @return 0 if successful, otherwise -1 (for example if the kernel does not
+ * support io_uring or the features used).
+ */
+int uring_start(int listen_fd);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Decoding of client command lines (see command.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "command.h"
+
+#define NCOMMANDS (TU_CAMP_CMD + 1) // entries of tu_command_names[], then the commands of command.h
+
+// What follows the command word
+typedef enum command_syntax {
+    ARG_NONE,   // nothing
+    ARG_NUMBER, // a space, then a decimal number
+    ARG_TEXT,   // a space, then arbitrary text
+    ARG_NUMBER_TEXT // a number as for ARG_NUMBER, then a space and arbitrary text
+} COMMAND_SYNTAX;
+
+static const COMMAND_SYNTAX command_syntax[NCOMMANDS] = {
+    [TU_PICKUP_CMD] = ARG_NONE,
+    [TU_HANGUP_CMD] = ARG_NONE,
+    [TU_DIAL_CMD] = ARG_NUMBER,
+    [TU_CHAT_CMD] = ARG_TEXT,
+    [TU_PAGE_CMD] = ARG_NUMBER_TEXT,
+    [TU_CAMP_CMD] = ARG_NONE
+};
+
+// Names of the commands of command.h
+static const char *const added_command_names[NCOMMANDS] = {
+    [TU_PAGE_CMD] = "page",
+    [TU_CAMP_CMD] = "camp"
+};
+
+// One command word, chained with the others sharing its first byte
+typedef struct command_entry {
+    const char *name; // from tu_command_names[] or added_command_names[]
+    size_t len; // length of name
+    TU_COMMAND cmd;
+    struct command_entry *next;
+} COMMAND_ENTRY;
+
+static COMMAND_ENTRY entries[NCOMMANDS];
+static COMMAND_ENTRY *by_first_byte[UCHAR_MAX + 1];
+
+// Build the lookup table before main() runs
+__attribute__((constructor))
+static void command_table_init(void) {
+    for (int i = 0; i < NCOMMANDS; i++) {
+        COMMAND_ENTRY *e = &entries[i];
+        e->name = i <= TU_CHAT_CMD ? tu_command_names[i] : added_command_names[i];
+        e->len = strlen(e->name);
+        e->cmd = i;
+        e->next = by_first_byte[(unsigned char)e->name[0]];
+        by_first_byte[(unsigned char)e->name[0]] = e;
+    }
+}
+
+int command_parse(char *line, size_t len, COMMAND *cmd) {
+    cmd->cmd = TU_NO_CMD;
+
+    COMMAND_ENTRY *e = by_first_byte[(unsigned char)line[0]];
+    while (e && (e->len > len || memcmp(line, e->name, e->len) != 0)) {
+        e = e->next;
+    }
+    if (!e) return -1;
+
+    char *p = line + e->len;
+    char *end = line + len;
+
+    switch (command_syntax[e->cmd]) {
+        case ARG_NONE:
+            if (p != end) return -1;
+            break;
+
+        case ARG_NUMBER:
+        case ARG_NUMBER_TEXT: {
+            if (p == end || *p != ' ') return -1;
+            while (*p == ' ') p++;
+            if (*p < '0' || *p > '9') return -1;
+            long n = 0;
+            for (; *p >= '0' && *p <= '9'; p++) {
+                if (n <= INT_MAX) n = n * 10 + (*p - '0'); // saturates above INT_MAX - no such extension
+            }
+            cmd->ext = n > INT_MAX ? INT_MAX : n;
+            if (command_syntax[e->cmd] == ARG_NUMBER) break;
+            if (p == end || *p != ' ') return -1;
+            cmd->msg = p + 1;
+            cmd->msg_len = end - (p + 1);
+            break;
+        }
+
+        case ARG_TEXT:
+            if (p == end || *p != ' ') return -1;
+            cmd->msg = p + 1;
+            cmd->msg_len = end - (p + 1);
+            break;
+    }
+
+    cmd->cmd = e->cmd;
+    return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Allocator of extension numbers (see extalloc.h).
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "extalloc.h"
+
+#define EXT_LEVELS 6 // 64^6 > INT_MAX, enough for any range
+
+// One range of numbers and its bitmaps
+typedef struct ext_range {
+    pthread_mutex_t lock; // guards the bitmaps
+    atomic_size_t nfree; // numbers free, so that full ranges are passed over without locking them
+    int first; // lowest number in the range
+    int last; // highest number in the range
+    int nlevels; // levels of the free bitmap; the top one is a single word
+    uint64_t *free[EXT_LEVELS]; // free[0]: bit per number, set if free; free[n]: bit per word of free[n-1], set if nonzero
+    uint64_t *reserved; // bit per number, set if reserved
+} EXT_RANGE;
+
+struct ext_alloc {
+    int nranges;
+    int ninit; // ranges whose lock has been initialized
+    EXT_RANGE *ranges; // in increasing order, fixed once created
+};
+
+#define WORDS(nbits) (((size_t)(nbits) + 63) / 64)
+
+static void ext_range_fini(EXT_RANGE *r) {
+    for (int l = 0; l < r->nlevels; l++) {
+        free(r->free[l]);
+    }
+    free(r->reserved);
+}
+
+// Set up the bitmaps of a range with every number free
+static int ext_range_init(EXT_RANGE *r) {
+    pthread_mutex_init(&r->lock, NULL);
+    size_t nbits = (size_t)r->last - r->first + 1;
+    atomic_init(&r->nfree, nbits);
+    r->reserved = calloc(WORDS(nbits), sizeof(uint64_t));
+    if (!r->reserved) return -1;
+
+    for (int l = 0; l < EXT_LEVELS; l++) {
+        size_t nwords = WORDS(nbits);
+        r->free[l] = calloc(nwords, sizeof(uint64_t));
+        if (!r->free[l]) return -1;
+        r->nlevels = l + 1;
+
+        for (size_t i = 0; i < nbits; i++) { // whole words first, then the tail
+            if (i % 64 == 0 && nbits - i >= 64) {
+                r->free[l][i / 64] = ~(uint64_t)0;
+                i += 63;
+            } else {
+                r->free[l][i / 64] |= (uint64_t)1 << (i % 64);
+            }
+        }
+
+        if (nwords == 1) break;
+        nbits = nwords; // a bit per word of this level
+    }
+    return 0;
+}
+
+// Mark a number (as an offset into its range) taken, clearing summary bits that become 0 - caller holds r->lock
+static void ext_range_take(EXT_RANGE *r, size_t i) {
+    atomic_fetch_sub_explicit(&r->nfree, 1, memory_order_relaxed);
+    for (int l = 0; l < r->nlevels; l++) {
+        r->free[l][i / 64] &= ~((uint64_t)1 << (i % 64));
+        if (r->free[l][i / 64]) break; // word still has free numbers - summaries unchanged
+        i /= 64;
+    }
+}
+
+// Mark a number free, setting summary bits that were 0 - caller holds r->lock
+static void ext_range_give(EXT_RANGE *r, size_t i) {
+    atomic_fetch_add_explicit(&r->nfree, 1, memory_order_relaxed);
+    for (int l = 0; l < r->nlevels; l++) {
+        uint64_t was = r->free[l][i / 64];
+        r->free[l][i / 64] |= (uint64_t)1 << (i % 64);
+        if (was) break; // word already had free numbers - summaries already set
+        i /= 64;
+    }
+}
+
+static int ext_range_is_free(EXT_RANGE *r, size_t i) {
+    return (r->free[0][i / 64] >> (i % 64)) & 1;
+}
+
+static int ext_range_is_reserved(EXT_RANGE *r, size_t i) {
+    return (r->reserved[i / 64] >> (i % 64)) & 1;
+}
+
+// Find the range holding a number, by binary search of the sorted ranges
+static EXT_RANGE *ext_find_range(EXT_ALLOC *a, int ext) {
+    int lo = 0, hi = a->nranges - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        EXT_RANGE *r = &a->ranges[mid];
+        if (ext < r->first) {
+            hi = mid - 1;
+        } else if (ext > r->last) {
+            lo = mid + 1;
+        } else {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static int ext_range_compare(const void *a, const void *b) {
+    const EXT_RANGE *ra = a, *rb = b;
+    return (ra->first > rb->first) - (ra->first < rb->first);
+}
+
+// Parse a non-negative int, advancing *sp past it
+static int parse_number(const char **sp, int *n) {
+    const char *s = *sp;
+    long v = 0;
+    if (*s < '0' || *s > '9') return -1;
+    for (; *s >= '0' && *s <= '9'; s++) {
+        v = v * 10 + (*s - '0');
+        if (v > INT_MAX) return -1;
+    }
+    *n = v;
+    *sp = s;
+    return 0;
+}
+
+EXT_ALLOC *ext_alloc_init(const char *ranges, size_t max) {
+    EXT_ALLOC *a = calloc(1, sizeof(EXT_ALLOC));
+    if (!a) return NULL;
+
+    // Check the whole list, bounds included, before any bitmap is allocated
+    size_t total = 0;
+    const char *s = ranges;
+    while (*s) {
+        int first, last;
+        if (parse_number(&s, &first) == -1) goto bad;
+        last = first;
+        if (*s == '-') {
+            s++;
+            if (parse_number(&s, &last) == -1 || last < first) goto bad;
+        }
+        if (*s == ',') {
+            s++;
+        } else if (*s) {
+            goto bad;
+        }
+
+        for (int i = 0; i < a->nranges; i++) { // no overlaps
+            if (first <= a->ranges[i].last && last >= a->ranges[i].first) goto bad;
+        }
+        total += (size_t)last - first + 1;
+        if (total > max) {
+            fprintf(stderr, "ERROR: Too many numbers in '%s' (at most %zu)\n", ranges, max);
+            goto fail;
+        }
+
+        EXT_RANGE *r = realloc(a->ranges, (a->nranges + 1) * sizeof(EXT_RANGE));
+        if (!r) goto fail;
+        a->ranges = r;
+        memset(&a->ranges[a->nranges], 0, sizeof(EXT_RANGE));
+        a->ranges[a->nranges].first = first;
+        a->ranges[a->nranges].last = last;
+        a->nranges++;
+    }
+    if (a->nranges == 0) goto bad;
+
+    // Sorted, for the binary search and so that the lowest free number comes first
+    qsort(a->ranges, a->nranges, sizeof(EXT_RANGE), ext_range_compare);
+    for (int i = 0; i < a->nranges; i++) {
+        a->ninit++;
+        if (ext_range_init(&a->ranges[i]) == -1) goto fail;
+    }
+    return a;
+
+bad:
+    fprintf(stderr, "ERROR: Invalid extension ranges '%s'\n", ranges);
+fail:
+    ext_alloc_fini(a);
+    return NULL;
+}
+
+void ext_alloc_fini(EXT_ALLOC *a) {
+    if (!a) return;
+    for (int i = 0; i < a->nranges; i++) {
+        ext_range_fini(&a->ranges[i]);
+        if (i < a->ninit) pthread_mutex_destroy(&a->ranges[i].lock);
+    }
+    free(a->ranges);
+    free(a);
+}
+
+int ext_alloc_max(EXT_ALLOC *a) {
+    return a->nranges ? a->ranges[a->nranges - 1].last : -1;
+}
+
+int ext_alloc_get(EXT_ALLOC *a) {
+    for (int i = 0; i < a->nranges; i++) {
+        EXT_RANGE *r = &a->ranges[i];
+        if (atomic_load_explicit(&r->nfree, memory_order_relaxed) == 0) continue; // range full
+
+        pthread_mutex_lock(&r->lock);
+        if (!r->free[r->nlevels - 1][0]) { // filled up since
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+
+        // Follow the lowest set bit down from the top level
+        size_t idx = 0;
+        for (int l = r->nlevels - 1; l >= 0; l--) {
+            idx = idx * 64 + __builtin_ctzll(r->free[l][idx]);
+        }
+        ext_range_take(r, idx);
+        pthread_mutex_unlock(&r->lock);
+        return r->first + idx;
+    }
+    return -1;
+}
+
+int ext_alloc_claim(EXT_ALLOC *a, int ext) {
+    EXT_RANGE *r = ext_find_range(a, ext);
+    if (!r) return 1;
+
+    int ret = -1;
+    size_t i = ext - r->first;
+    pthread_mutex_lock(&r->lock);
+    if (ext_range_is_reserved(r, i)) {
+        ret = 0; // whoever it is reserved for
+    } else if (ext_range_is_free(r, i)) {
+        ext_range_take(r, i);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+void ext_alloc_put(EXT_ALLOC *a, int ext) {
+    EXT_RANGE *r = ext_find_range(a, ext);
+    if (!r) return;
+
+    size_t i = ext - r->first;
+    pthread_mutex_lock(&r->lock);
+    if (!ext_range_is_reserved(r, i) && !ext_range_is_free(r, i)) {
+        ext_range_give(r, i);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+int ext_alloc_reserve(EXT_ALLOC *a, int ext) {
+    EXT_RANGE *r = ext_find_range(a, ext);
+    if (!r) return -1;
+
+    int ret = -1;
+    size_t i = ext - r->first;
+    pthread_mutex_lock(&r->lock);
+    if (ext_range_is_free(r, i)) {
+        ext_range_take(r, i); // out of the free bitmap for good
+        r->reserved[i / 64] |= (uint64_t)1 << (i % 64);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
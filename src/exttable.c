@@ -0,0 +1,127 @@
+/*
+ * Sparse table of extensions (see exttable.h).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "exttable.h"
+#include "rcu.h"
+
+#define EXT_TABLE_MIN_PAGES 256 // initial directory: numbers 0 to 16383
+
+// Slots of EXT_TABLE_PAGE_SIZE consecutive numbers
+typedef struct ext_page {
+    _Atomic(TU *) slots[EXT_TABLE_PAGE_SIZE];
+} EXT_PAGE;
+
+// Directory of pages, replaced as a whole when it grows
+typedef struct ext_dir {
+    long npages;
+    _Atomic(EXT_PAGE *) pages[]; // NULL until a number in the page is used
+} EXT_DIR;
+
+struct ext_table {
+    _Atomic(EXT_DIR *) dir; // read under RCU
+    pthread_mutex_t lock; // serializes creating pages and growing the directory
+    long npages_used; // pages allocated
+};
+
+static EXT_DIR *ext_dir_alloc(long npages) {
+    EXT_DIR *d = calloc(1, sizeof(EXT_DIR) + npages * sizeof(d->pages[0]));
+    if (!d) return NULL;
+    d->npages = npages;
+    return d;
+}
+
+EXT_TABLE *ext_table_init(void) {
+    EXT_TABLE *t = malloc(sizeof(EXT_TABLE));
+    if (!t) return NULL;
+
+    EXT_DIR *d = ext_dir_alloc(EXT_TABLE_MIN_PAGES);
+    if (!d) {
+        free(t);
+        return NULL;
+    }
+    atomic_init(&t->dir, d);
+    pthread_mutex_init(&t->lock, NULL);
+    t->npages_used = 0;
+    return t;
+}
+
+void ext_table_fini(EXT_TABLE *t) {
+    if (!t) return;
+    EXT_DIR *d = atomic_load(&t->dir);
+    for (long i = 0; i < d->npages; i++) {
+        free(atomic_load_explicit(&d->pages[i], memory_order_relaxed));
+    }
+    free(d);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+_Atomic(TU *) *ext_table_lookup(EXT_TABLE *t, int ext) {
+    if (ext < 0) return NULL;
+    long p = ext / EXT_TABLE_PAGE_SIZE;
+
+    EXT_DIR *d = atomic_load_explicit(&t->dir, memory_order_acquire);
+    if (p >= d->npages) return NULL;
+    EXT_PAGE *page = atomic_load_explicit(&d->pages[p], memory_order_acquire);
+    return page ? &page->slots[ext % EXT_TABLE_PAGE_SIZE] : NULL;
+}
+
+_Atomic(TU *) *ext_table_slot(EXT_TABLE *t, int ext) {
+    if (ext < 0) return NULL;
+    long p = ext / EXT_TABLE_PAGE_SIZE;
+
+    // Fast path: the page is already there, and pages never go away
+    rcu_read_lock();
+    _Atomic(TU *) *slot = ext_table_lookup(t, ext);
+    rcu_read_unlock();
+    if (slot) return slot;
+
+    pthread_mutex_lock(&t->lock);
+    EXT_DIR *d = atomic_load_explicit(&t->dir, memory_order_relaxed); // only replaced under the lock
+
+    if (p >= d->npages) {
+        // Grow the directory: copy the page pointers into a larger one and switch readers over to it
+        long n = d->npages * 2;
+        while (p >= n) n *= 2;
+        EXT_DIR *nd = ext_dir_alloc(n);
+        if (!nd) {
+            pthread_mutex_unlock(&t->lock);
+            fprintf(stderr, "ERROR ext_table_slot: Failed to grow directory to %ld pages\n", n);
+            return NULL;
+        }
+        for (long i = 0; i < d->npages; i++) {
+            atomic_init(&nd->pages[i], atomic_load_explicit(&d->pages[i], memory_order_relaxed));
+        }
+        atomic_store_explicit(&t->dir, nd, memory_order_release);
+        rcu_synchronize(); // nobody is looking at the old directory any more
+        free(d);
+        d = nd;
+    }
+
+    EXT_PAGE *page = atomic_load_explicit(&d->pages[p], memory_order_relaxed);
+    if (!page) {
+        page = calloc(1, sizeof(EXT_PAGE)); // all slots NULL
+        if (!page) {
+            pthread_mutex_unlock(&t->lock);
+            fprintf(stderr, "ERROR ext_table_slot: Failed to allocate page for extension %d\n", ext);
+            return NULL;
+        }
+        atomic_store_explicit(&d->pages[p], page, memory_order_release);
+        t->npages_used++;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+    return &page->slots[ext % EXT_TABLE_PAGE_SIZE];
+}
+
+size_t ext_table_memory(EXT_TABLE *t) {
+    pthread_mutex_lock(&t->lock);
+    EXT_DIR *d = atomic_load_explicit(&t->dir, memory_order_relaxed);
+    size_t n = sizeof(EXT_DIR) + d->npages * sizeof(d->pages[0]) + t->npages_used * sizeof(EXT_PAGE);
+    pthread_mutex_unlock(&t->lock);
+    return n;
+}
@@ -0,0 +1,194 @@
+/*
+ * Incremental line framer (see framer.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pbx.h" // for EOL
+#include "framer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMER_X86 1
+#endif
+
+#define EOL_LEN (sizeof(EOL) - 1)
+
+// Find the first EOL lying entirely within [p, p + n), or NULL if there is none
+static char *find_eol_scalar(char *p, size_t n) {
+    char *end = p + n;
+    while (p < end && (p = memchr(p, EOL[0], end - p)) != NULL) {
+        if (p + 1 < end && p[1] == EOL[1]) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#ifdef FRAMER_X86
+// SSE2 version: compares 16 positions per iteration against both bytes of EOL at once
+__attribute__((target("sse2")))
+static char *find_eol_sse2(char *p, size_t n) {
+    char *end = p + n;
+    const __m128i cr = _mm_set1_epi8(EOL[0]);
+    const __m128i lf = _mm_set1_epi8(EOL[1]);
+
+    for (; end - p >= 17; p += 16) { // p[16] is the last byte looked at
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, cr), _mm_cmpeq_epi8(b, lf)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_eol_scalar(p, end - p);
+}
+
+// AVX2 version: 64 positions per iteration while no EOL turns up, then 32 at a time
+__attribute__((target("avx2")))
+static char *find_eol_avx2(char *p, size_t n) {
+    char *end = p + n;
+    const __m256i cr = _mm256_set1_epi8(EOL[0]);
+    const __m256i lf = _mm256_set1_epi8(EOL[1]);
+
+    for (; end - p >= 65; p += 64) { // p[64] is the last byte looked at
+        __m256i m0 = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), cr),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), lf));
+        __m256i m1 = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), cr),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 33)), lf));
+        if (!_mm256_testz_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m0, m1))) {
+            unsigned mask = _mm256_movemask_epi8(m0);
+            if (mask) return p + __builtin_ctz(mask);
+            return p + 32 + __builtin_ctz((unsigned)_mm256_movemask_epi8(m1));
+        }
+    }
+    for (; end - p >= 33; p += 32) { // p[32] is the last byte looked at
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, cr), _mm256_cmpeq_epi8(b, lf)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_eol_sse2(p, end - p);
+}
+#endif
+
+// The EOL scanners available, best first
+static const struct framer_scanner {
+    const char *name;
+    char *(*scan)(char *p, size_t n);
+} scanners[] = {
+#ifdef FRAMER_X86
+    { "avx2", find_eol_avx2 },
+    { "sse2", find_eol_sse2 },
+#endif
+    { "scalar", find_eol_scalar }
+};
+
+static const struct framer_scanner *scanner = &scanners[sizeof(scanners) / sizeof(scanners[0]) - 1];
+
+#define find_eol(p, n) (scanner->scan((p), (n)))
+
+// Check with CPUID whether this CPU can run a scanner
+static int framer_supported(const char *name) {
+#ifdef FRAMER_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+// Pick the best scanner for this CPU before main() runs
+__attribute__((constructor))
+static void framer_select(void) {
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+        if (framer_supported(scanners[i].name)) {
+            scanner = &scanners[i];
+            return;
+        }
+    }
+}
+
+const char *framer_scanner(void) {
+    return scanner->name;
+}
+
+int framer_use_scanner(const char *name) {
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+        if (strcmp(scanners[i].name, name) == 0 && framer_supported(name)) {
+            scanner = &scanners[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Append data to the incomplete line, growing the buffer geometrically
+static int framer_append(FRAMER *f, const char *data, size_t len) {
+    if (f->size < f->used + len + 1) { // room for the terminator too
+        size_t size = f->size ? f->size : 256;
+        while (size < f->used + len + 1) size *= 2;
+        char *buf = realloc(f->buf, size);
+        if (!buf) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        f->buf = buf;
+        f->size = size;
+    }
+    memcpy(f->buf + f->used, data, len);
+    f->used += len;
+    return 0;
+}
+
+// Idle connections hold no buffer, so thousands of quiet TUs stay cheap
+static void framer_reset(FRAMER *f) {
+    free(f->buf);
+    f->buf = NULL;
+    f->size = 0;
+    f->used = 0;
+}
+
+void framer_init(FRAMER *f) {
+    f->buf = NULL;
+    f->size = 0;
+    f->used = 0;
+}
+
+void framer_fini(FRAMER *f) {
+    framer_reset(f);
+}
+
+int framer_input(FRAMER *f, char *data, size_t len, FRAMER_LINE_FN fn, void *arg) {
+    char *end = data + len;
+
+    if (f->used) { // finish the incomplete line first
+        char *eol;
+        if (f->buf[f->used - 1] == EOL[0] && len && data[0] == EOL[1]) {
+            // EOL split across reads - the buffered part already ends with its first byte
+            f->used--;
+            eol = data - 1;
+        } else if ((eol = find_eol(data, len)) == NULL) {
+            return framer_append(f, data, len); // still incomplete
+        } else if (framer_append(f, data, eol - data) == -1) {
+            return -1;
+        }
+
+        f->buf[f->used] = '\0';
+        fn(arg, f->buf, f->used);
+        framer_reset(f);
+        data = eol + EOL_LEN;
+    }
+
+    // Lines wholly within this read are handed over where they are
+    char *eol;
+    while ((eol = find_eol(data, end - data)) != NULL) {
+        *eol = '\0';
+        fn(arg, data, eol - data);
+        data = eol + EOL_LEN;
+    }
+
+    // Keep whatever is left for the next read
+    if (data < end) {
+        return framer_append(f, data, end - data);
+    }
+    return 0;
+}
@@ -12,31 +12,69 @@
 #include <netdb.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "pbx.h" // already includes tu.h (not needed in this file)
 #include "server.h"
+#include "tu_ext.h"
+#include "pbx_ext.h"
+#include "session.h"
+#include "reactor.h"
+#include "uring.h"
 #include "debug.h"
 
+// How client connections are serviced
+typedef enum server_mode {
+    MODE_THREAD,   // one detached thread per connection (default)
+    MODE_EPOLL,    // fixed set of epoll event loop threads
+    MODE_REUSEPORT, // event loops that each accept on their own SO_REUSEPORT socket
+    MODE_URING     // single io_uring loop thread
+} SERVER_MODE;
+
 // Forward declarations
 static void terminate_server(int status);
+static void usage(char *prog);
 static void sighup_handler(int sig);
+static int spawn_client_thread(int client_socket);
+static int open_server_socket(int port, int reuseport);
+static void await_shutdown(void);
+static char *parse_numbered_ranges(char *spec, int min, int *number);
 
-// File descriptor for the server's listening socket
-static int server_socket;
+// File descriptor for the server's listening socket (-1 if there is none)
+static int server_socket = -1;
 
 static atomic_bool shutdown_request = false; // atomic flag for sig handler
 
+// Report the command line usage and exit
+static void usage(char *prog) {
+    fprintf(stderr, "ERROR Usage: %s -p <port> [-m thread|epoll|reuseport|uring] [-t <threads>] [-c] [-q <bytes>] [-s drop-chat|disconnect|park] [-e <ranges>] [-a <file>] [-r <ranges>] [-g <group>=<ranges>]... [-u <number>=<ranges>]... [-w <number>=<ranges>]...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx -p <port>
+ * Usage: pbx -p <port> [-m thread|epoll|reuseport|uring] [-t <threads>] [-c] [-q <bytes>] [-s drop-chat|disconnect|park] [-e <ranges>] [-a <file>] [-r <ranges>] [-g <group>=<ranges>]... [-u <number>=<ranges>]... [-w <number>=<ranges>]...
  */
 int main(int argc, char *argv[]) {
     int port = 8080; // Default port number
+    SERVER_MODE mode = MODE_THREAD;
+    int nthreads = 0; // Event loop threads (0 = one per CPU)
+    int pin_cpus = 0; // Pin each event loop thread to its own CPU
+    long output_limit = TU_OUTPUT_LIMIT_DEFAULT; // Output queued per client
+    TU_OUTPUT_POLICY output_policy = TU_OUTPUT_DROP_CHAT; // What to do with slow clients
+    char *ext_ranges = NULL; // Extension numbers handed out (NULL = PBX_DEFAULT_RANGES)
+    char *assignment_file = NULL; // Static extension assignments by client address
+    char *room_ranges = NULL; // Conference room numbers (NULL = none)
+    char *group_specs[argc]; // Paging groups, as "<group>=<ranges>"
+    int ngroups = 0;
+    char *hunt_specs[argc]; // Hunt groups, as "<number>=<ranges>"
+    int hunt_queues[argc]; // Whether each hunt group is a call queue
+    int nhunts = 0;
     int opt;
 
-    // Parse command-line options to extract the port number
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    // Parse command-line options to extract the port number and I/O model
+    while ((opt = getopt(argc, argv, "p:m:t:cq:s:e:a:r:g:u:w:")) != -1) {
         switch (opt) {
             case 'p': // Port option
                 port = atoi(optarg);
@@ -45,14 +83,108 @@ int main(int argc, char *argv[]) {
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'm': // Mode option
+                if (strcmp(optarg, "thread") == 0) {
+                    mode = MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "reuseport") == 0) {
+                    mode = MODE_REUSEPORT;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    mode = MODE_URING;
+                } else {
+                    fprintf(stderr, "ERROR: Invalid mode '%s' (expected thread, epoll, reuseport or uring)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't': // Thread count option
+                nthreads = atoi(optarg);
+                if (nthreads <= 0) {
+                    fprintf(stderr, "ERROR: Invalid thread count\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c': // CPU pinning option
+                pin_cpus = 1;
+                break;
+            case 'q': // Output queue limit option
+                output_limit = atol(optarg);
+                if (output_limit <= 0) {
+                    fprintf(stderr, "ERROR: Invalid output limit\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's': // Slow client policy option
+                if (strcmp(optarg, "drop-chat") == 0) {
+                    output_policy = TU_OUTPUT_DROP_CHAT;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    output_policy = TU_OUTPUT_DISCONNECT;
+                } else if (strcmp(optarg, "park") == 0) {
+                    output_policy = TU_OUTPUT_PARK;
+                } else {
+                    fprintf(stderr, "ERROR: Invalid slow client policy '%s' (expected drop-chat, disconnect or park)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e': // Extension ranges option
+                ext_ranges = optarg;
+                break;
+            case 'a': // Static assignment file option
+                assignment_file = optarg;
+                break;
+            case 'r': // Conference room option
+                room_ranges = optarg;
+                break;
+            case 'g': // Paging group option (repeatable)
+                group_specs[ngroups++] = optarg;
+                break;
+            case 'u': // Hunt group option (repeatable)
+            case 'w': // Call queue option (repeatable)
+                hunt_queues[nhunts] = opt == 'w';
+                hunt_specs[nhunts++] = optarg;
+                break;
             default:
-                fprintf(stderr, "ERROR Usage: %s -p <port>\n", argv[0]);
-                exit(EXIT_FAILURE);
+                usage(argv[0]);
         }
     }
 
+    // The event loop options mean nothing to the other modes
+    if ((nthreads || pin_cpus) && mode != MODE_EPOLL && mode != MODE_REUSEPORT) {
+        fprintf(stderr, "ERROR: -t and -c apply only to the epoll and reuseport modes\n");
+        usage(argv[0]);
+    }
+
+    tu_set_output_limit(output_limit, output_policy);
+
     // Initialize the PBX module - for ther server
     pbx = pbx_init();
+    if (!pbx) {
+        fprintf(stderr, "ERROR: Failed to initialize PBX\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ext_ranges && pbx_set_extension_ranges(pbx, ext_ranges) == -1) {
+        terminate_server(EXIT_FAILURE);
+    }
+    if (room_ranges && pbx_set_conference_ranges(pbx, room_ranges) == -1) {
+        terminate_server(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ngroups; i++) {
+        int group;
+        char *ranges = parse_numbered_ranges(group_specs[i], PBX_PAGE_ALL + 1, &group);
+        if (!ranges || pbx_add_paging_group(pbx, group, ranges) == -1) {
+            terminate_server(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nhunts; i++) {
+        int number;
+        char *ranges = parse_numbered_ranges(hunt_specs[i], 0, &number);
+        if (!ranges || pbx_add_hunt_group(pbx, number, ranges, hunt_queues[i]) == -1) {
+            terminate_server(EXIT_FAILURE);
+        }
+    }
+    if (assignment_file && session_load_assignments(assignment_file) == -1) {
+        terminate_server(EXIT_FAILURE);
+    }
 
     // Install a SIGHUP handler for server shutdown
     struct sigaction sa;
@@ -64,32 +196,48 @@ int main(int argc, char *argv[]) {
         terminate_server(EXIT_FAILURE);
     }
 
-    // Create socket for server
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        fprintf(stderr, "ERROR: failed creating a socket for the server (if reusing socket, possible time_wait violation)\n");
+    // A client hanging up mid-notification must not kill the server
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        fprintf(stderr, "ERROR: failed ignoring SIGPIPE with sigaction\n");
         terminate_server(EXIT_FAILURE);
     }
 
-    // Configure server address structure
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    if (mode == MODE_EPOLL || mode == MODE_REUSEPORT) {
+        if (nthreads == 0) nthreads = reactor_default_threads();
+        if (reactor_start(nthreads, pin_cpus) == -1) {
+            fprintf(stderr, "ERROR: failed to start event loop threads\n");
+            terminate_server(EXIT_FAILURE);
+        }
+    }
 
-    // Bind the server socket to the specified port
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        fprintf(stderr, "ERROR: failed binding server socket to port number specified (if reusing port #, possible time_wait violation)\n");
-        terminate_server(EXIT_FAILURE);
+    if (mode == MODE_REUSEPORT) {
+        // Each loop accepts on its own socket and the kernel spreads connections across them
+        for (int i = 0; i < nthreads; i++) {
+            int listen_fd = open_server_socket(port, 1);
+            if (listen_fd == -1 || reactor_listen(i, listen_fd) == -1) {
+                terminate_server(EXIT_FAILURE);
+            }
+        }
+
+        fprintf(stderr, "Server listening on port %d with %d acceptors...\n", port, nthreads);
+        await_shutdown();
     }
 
-    // Start listening for incoming connections
-    if (listen(server_socket, SOMAXCONN) == -1) {
-        fprintf(stderr, "ERROR: failed to listen for incoming connections\n");
+    server_socket = open_server_socket(port, 0);
+    if (server_socket == -1) {
         terminate_server(EXIT_FAILURE);
     }
 
+    if (mode == MODE_URING) {
+        if (uring_start(server_socket) == -1) {
+            fprintf(stderr, "ERROR: failed to start io_uring loop (kernel support missing?)\n");
+            terminate_server(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Server listening on port %d (io_uring)...\n", port);
+        await_shutdown();
+    }
+
     fprintf(stderr, "Server listening on port %d...\n", port);
 
     while (1) { // Main server loop: Accept and handle incoming client connections
@@ -101,32 +249,117 @@ int main(int argc, char *argv[]) {
         int client_socket = accept(server_socket, NULL, NULL);
         if (client_socket == -1) {
             if (errno == EINTR) {
-                break; // Interrupt by SIGHUP
+                continue; // Interrupt by SIGHUP - shutdown_request checked above
             }
             fprintf(stderr, "ERROR: failed to accept and handle incoming new client connection\n");
             continue;
         }
 
-        int *client_fd = malloc(sizeof(int)); // need memory so pass file descriptor to thread
-        if (client_fd == NULL) {
-            fprintf(stderr, "ERROR: malloc failed\n");
-            close(client_socket);
-            continue;
+        if (mode == MODE_EPOLL) {
+            reactor_add(client_socket); // closes the socket itself on failure
+        } else {
+            spawn_client_thread(client_socket);
         }
-        *client_fd = client_socket;
+    }
 
-        pthread_t thread; //  new thread for each client connection
-        if (pthread_create(&thread, NULL, pbx_client_service, client_fd) != 0) {
-            fprintf(stderr, "ERROR: failed to create new thread for client connection\n");
-            free(client_fd);
-            close(client_socket);
-            continue;
-        }
-        if (pthread_detach(thread) != 0) {
-            fprintf(stderr, "ERROR: failed to detach thread so on termination resources are NOT clean automatically - must join thread manually\n");
-        }
+    return 0;
+}
+
+/*
+ * Create a socket listening on the specified port.
+ *
+ * @param port  The port number.
+ * @param reuseport  Nonzero to set SO_REUSEPORT, so that several sockets
+ * can listen on the same port with the kernel balancing connections among them.
+ * @return the listening socket, or -1 on failure.
+ */
+static int open_server_socket(int port, int reuseport) {
+    // Create socket for server
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        fprintf(stderr, "ERROR: failed creating a socket for the server (if reusing socket, possible time_wait violation)\n");
+        return -1;
+    }
+
+    int one = 1;
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "ERROR: failed setting SO_REUSEPORT on server socket\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    // Configure server address structure
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    // Bind the server socket to the specified port
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        fprintf(stderr, "ERROR: failed binding server socket to port number specified (if reusing port #, possible time_wait violation)\n");
+        close(listen_fd);
+        return -1;
     }
 
+    // Start listening for incoming connections
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "ERROR: failed to listen for incoming connections\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+/*
+ * Park the main thread until SIGHUP arrives, for modes in which other
+ * threads do all the accepting, then shut the server down.
+ */
+static void await_shutdown(void) {
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    while (!atomic_load(&shutdown_request)) {
+        sigsuspend(&old_mask);
+    }
+    terminate_server(EXIT_SUCCESS);
+}
+
+/*
+ * Start a detached thread running pbx_client_service() for a new connection.
+ * SIGHUP is blocked in the new thread so that it is always delivered to the
+ * main thread, whose accept() it has to interrupt.
+ */
+static int spawn_client_thread(int client_socket) {
+    int *client_fd = malloc(sizeof(int)); // need memory so pass file descriptor to thread
+    if (client_fd == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        close(client_socket);
+        return -1;
+    }
+    *client_fd = client_socket;
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask); // inherited by the new thread
+
+    pthread_t thread; //  new thread for each client connection
+    int err = pthread_create(&thread, NULL, pbx_client_service, client_fd);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (err != 0) {
+        fprintf(stderr, "ERROR: failed to create new thread for client connection\n");
+        free(client_fd);
+        close(client_socket);
+        return -1;
+    }
+    if (pthread_detach(thread) != 0) {
+        fprintf(stderr, "ERROR: failed to detach thread so on termination resources are NOT clean automatically - must join thread manually\n");
+    }
     return 0;
 }
 
@@ -146,12 +379,35 @@ static void terminate_server(int status) {
 
     // Close server socket
     if (server_socket >= 0) {
+        shutdown(server_socket, SHUT_RDWR); // also stops accepts in progress on it in other threads
         close(server_socket);
         fprintf(stderr, "Server socket closed\n");
     }
 
+    // Stop any event loops from accepting further connections
+    reactor_stop_listening();
+
     // Shut down the PBX module
     pbx_shutdown(pbx);
 
     exit(status);
-}
\ No newline at end of file
+}
+
+/*
+ * Split a "<number>=<ranges>" option argument, as taken by -g, -u and -w.
+ *
+ * @param spec  The argument.
+ * @param min  The lowest number allowed.
+ * @param number  Receives the number.
+ * @return the ranges (within spec), or NULL if spec is malformed.
+ */
+static char *parse_numbered_ranges(char *spec, int min, int *number) {
+    char *end;
+    long n = strtol(spec, &end, 10);
+    if (end == spec || *end != '=' || n < min || n > INT_MAX) {
+        fprintf(stderr, "ERROR: Invalid group '%s' (expected <number>=<ranges>, number at least %d)\n", spec, min);
+        return NULL;
+    }
+    *number = n;
+    return end + 1;
+}
@@ -2,20 +2,264 @@
  * PBX: simulates a Private Branch Exchange.
  */
 #include <stdlib.h>
+#include <stdio.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include <sys/socket.h>
 
 #include "pbx.h" // includes tu.h already
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "extalloc.h"
+#include "exttable.h"
+#include "rcu.h"
 #include "debug.h"
 
+#define PBX_STRIPES 64 // locks guarding the extension slots (a power of two)
+#define PBX_SHUTDOWN_CHUNK 256 // fewest connections worth a shutdown thread of their own
+#define PBX_MAX_NUMBERS (1 << 24) // extension numbers the ranges handed out can hold in all (bounds the bitmaps)
+#define PBX_MAX_ROOMS 10000 // conference rooms a PBX can have
+#define PBX_MAX_GROUP_SIZE 65536 // extension numbers a paging or hunt group can have
+#define PBX_SNAPSHOT_MIN 256 // TUs a snapshot has room for at first
+
+// One lock of the registry, on a cache line of its own so stripes don't contend through false sharing
+typedef struct pbx_stripe {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) PBX_STRIPE;
+
+// A conference room and the number that joins it
+typedef struct pbx_room {
+    int number;
+    CONFERENCE *conf;
+} PBX_ROOM;
+
+// A hunt group and the number that reaches it
+typedef struct pbx_hunt {
+    int number;
+    HUNT_GROUP *group;
+} PBX_HUNT;
+
+// An extension number whose TU answers for a hunt group
+typedef struct pbx_hunt_member {
+    int ext;
+    HUNT_GROUP *group;
+} PBX_HUNT_MEMBER;
+
+// A paging group and the extension numbers it pages
+typedef struct pbx_group {
+    int number;
+    int nexts;
+    int *exts;
+} PBX_GROUP;
+
+// An unregistered TU, released once no reader can still be looking at it
+typedef struct pbx_retired {
+    RCU_HEAD head; // first, so the callback can find the rest
+    PBX *pbx;
+    TU *tu;
+} PBX_RETIRED;
+
 // Definition of the PBX structure
 struct pbx {
-    TU *extensions[PBX_MAX_EXTENSIONS]; // Array mapping extensions to TUs
-    pthread_mutex_t lock;              // Mutex for thread safety to try my best to avoid race conditions
+    EXT_TABLE *extensions;             // Sparse table mapping extensions to TUs (read under RCU)
+    EXT_ALLOC *numbers;                // Which extension numbers are free
+    PBX_STRIPE stripes[PBX_STRIPES];   // changes to the slot of ext are serialized by stripes[ext % PBX_STRIPES]
+    pthread_mutex_t lock;              // Serializes changes to active_tus and registered - never held across TU operations
     int active_tus;                    // Counter for active TUs
+    _Atomic(TU *) registered;          // Registered TUs, newest first, linked through tu_link() (read under RCU)
+    PBX_ROOM *rooms;                   // Conference rooms by number, fixed before any TU registers
+    int nrooms;
+    PBX_GROUP *groups;                 // Paging groups by number, fixed before any TU registers
+    int ngroups;
+    PBX_HUNT *hunts;                   // Hunt groups by number, fixed before any TU registers
+    int nhunts;
+    PBX_HUNT_MEMBER *hunt_members;     // Hunt group of each member extension, by extension
+    int nhunt_members;
     pthread_cond_t shutdown_cond;      // Condition variable for shutdown synchronization
 };
 
+// Lock guarding the slot of an extension
+static pthread_mutex_t *pbx_slot_lock(PBX *pbx, int ext) {
+    return &pbx->stripes[ext & (PBX_STRIPES - 1)].lock;
+}
+
+static int pbx_register_slot(PBX *pbx, TU *tu, int ext);
+
+static int pbx_int_compare(const void *a, const void *b) {
+    int ia = *(const int *)a, ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+static int pbx_room_compare(const void *a, const void *b) {
+    const PBX_ROOM *ra = a, *rb = b;
+    return (ra->number > rb->number) - (ra->number < rb->number);
+}
+
+// Find the conference room with a number, if any - the rooms never change once TUs are about
+static CONFERENCE *pbx_room(PBX *pbx, int ext) {
+    PBX_ROOM key = { .number = ext };
+    PBX_ROOM *room = pbx->nrooms ? bsearch(&key, pbx->rooms, pbx->nrooms, sizeof(PBX_ROOM), pbx_room_compare) : NULL;
+    return room ? room->conf : NULL;
+}
+
+static int pbx_group_compare(const void *a, const void *b) {
+    const PBX_GROUP *ga = a, *gb = b;
+    return (ga->number > gb->number) - (ga->number < gb->number);
+}
+
+// Find the paging group with a number, if any - like the rooms, the groups never change once TUs are about
+static PBX_GROUP *pbx_group(PBX *pbx, int number) {
+    PBX_GROUP key = { .number = number };
+    return pbx->ngroups ? bsearch(&key, pbx->groups, pbx->ngroups, sizeof(PBX_GROUP), pbx_group_compare) : NULL;
+}
+
+// Hunt groups and their members are kept in number order, and both looked up by number
+static int pbx_hunt_compare(const void *a, const void *b) {
+    const PBX_HUNT *ha = a, *hb = b;
+    return (ha->number > hb->number) - (ha->number < hb->number);
+}
+
+static int pbx_hunt_member_compare(const void *a, const void *b) {
+    const PBX_HUNT_MEMBER *ma = a, *mb = b;
+    return (ma->ext > mb->ext) - (ma->ext < mb->ext);
+}
+
+// Find the hunt group with a number, if any
+static HUNT_GROUP *pbx_hunt(PBX *pbx, int number) {
+    PBX_HUNT key = { .number = number };
+    PBX_HUNT *hunt = pbx->nhunts ? bsearch(&key, pbx->hunts, pbx->nhunts, sizeof(PBX_HUNT), pbx_hunt_compare) : NULL;
+    return hunt ? hunt->group : NULL;
+}
+
+// Find the hunt group an extension answers for, if any
+static HUNT_GROUP *pbx_hunt_member(PBX *pbx, int ext) {
+    PBX_HUNT_MEMBER key = { .ext = ext };
+    PBX_HUNT_MEMBER *m = pbx->nhunt_members ?
+        bsearch(&key, pbx->hunt_members, pbx->nhunt_members, sizeof(PBX_HUNT_MEMBER), pbx_hunt_member_compare) : NULL;
+    return m ? m->group : NULL;
+}
+
+// Whether a number is dialed to reach something other than a TU, so no TU can be registered on it
+static int pbx_is_service(PBX *pbx, int ext) {
+    return pbx_room(pbx, ext) || pbx_hunt(pbx, ext);
+}
+
+/*
+ * List every number in a list of ranges, in increasing order.
+ *
+ * @param max  The most numbers the list may hold.
+ * @param countp  Where to store the number of numbers.
+ * @return the numbers (to be freed by the caller), or NULL if the list is
+ * malformed or too long or memory runs out.
+ */
+static int *pbx_range_numbers(const char *ranges, int max, int *countp) {
+    EXT_ALLOC *numbers = ext_alloc_init(ranges, max); // parses the list, then hands out every number in it
+    if (!numbers) return NULL;
+
+    int *exts = NULL;
+    int n = 0;
+    int ext;
+    while ((ext = ext_alloc_get(numbers)) != -1) {
+        if (n % 64 == 0) {
+            int *e = realloc(exts, (n + 64) * sizeof(int));
+            if (!e) goto fail;
+            exts = e;
+        }
+        exts[n++] = ext;
+    }
+    ext_alloc_fini(numbers);
+    qsort(exts, n, sizeof(int), pbx_int_compare); // ranges can come in any order
+    *countp = n;
+    return exts;
+
+fail:
+    ext_alloc_fini(numbers);
+    free(exts);
+    return NULL;
+}
+
+static void pbx_free_rooms(PBX_ROOM *rooms, int nrooms) {
+    for (int i = 0; i < nrooms; i++) {
+        tu_conference_fini(rooms[i].conf);
+    }
+    free(rooms);
+}
+
+/*
+ * Take a reference to every registered TU, so they can be worked on without
+ * holding any PBX lock.  Costs O(number registered), whatever the numbering.
+ * The list is walked under RCU, so registering and unregistering go on
+ * meanwhile: a TU unregistered during the walk is still safe to reference
+ * (the registry drops its own reference only after every walk in progress
+ * is done), and one registered during it may or may not be included.
+ *
+ * @param countp  Where to store the number of TUs.
+ * @return an array of the TUs (to be freed along with the references by
+ * pbx_release()), or NULL if there are none or memory runs out.
+ */
+static TU **pbx_snapshot(PBX *pbx, int *countp) {
+    TU **tus = NULL;
+    int n = 0, size = 0;
+    rcu_read_lock();
+    for (TU *tu = atomic_load_explicit(&pbx->registered, memory_order_acquire); tu;
+         tu = atomic_load_explicit(&tu_link(tu)->next, memory_order_acquire)) {
+        if (n == size) { // out of room - the count isn't known without the lock
+            size = size ? 2 * size : PBX_SNAPSHOT_MIN;
+            TU **t = realloc(tus, size * sizeof(TU *));
+            if (!t) break;
+            tus = t;
+        }
+        tu_ref(tu, "PBX snapshot");
+        tus[n++] = tu;
+    }
+    rcu_read_unlock();
+    *countp = n;
+    return tus;
+}
+
+// Take a reference to every TU registered on an extension of a paging group, without locking
+static TU **pbx_group_snapshot(PBX *pbx, PBX_GROUP *group, int *countp) {
+    TU **tus = malloc(group->nexts * sizeof(TU *));
+    int n = 0;
+    if (tus) {
+        rcu_read_lock();
+        for (int i = 0; i < group->nexts; i++) {
+            _Atomic(TU *) *slot = ext_table_lookup(pbx->extensions, group->exts[i]); // NULL for numbers never used
+            TU *tu = slot ? atomic_load(slot) : NULL;
+            if (tu) {
+                tu_ref(tu, "PBX snapshot");
+                tus[n++] = tu;
+            }
+        }
+        rcu_read_unlock();
+    }
+    *countp = n;
+    return tus;
+}
+
+static void pbx_release(TU **tus, int count) {
+    for (int i = 0; i < count; i++) {
+        tu_unref(tus[i], "PBX snapshot done");
+    }
+    free(tus);
+}
+
+// A share of the connections to shut down
+typedef struct pbx_shutdown_work {
+    pthread_t thread;
+    TU **tus;
+    int count;
+} PBX_SHUTDOWN_WORK;
+
+static void *pbx_shutdown_worker(void *arg) {
+    PBX_SHUTDOWN_WORK *w = arg;
+    for (int i = 0; i < w->count; i++) {
+        shutdown(tu_fileno(w->tus[i]), SHUT_RDWR); // our reference keeps the fd open
+    }
+    return NULL;
+}
+
 /*
  * Initialize a new PBX.
  *
@@ -25,25 +269,47 @@ PBX *pbx_init() {
     PBX *pbx = malloc(sizeof(PBX)); // Allocate memory for PBX object
     if (!pbx) return NULL; // Return NULL if allocation fails
 
+    pbx->extensions = ext_table_init(); // pages are added as extensions are used
+    if (!pbx->extensions) goto fail_pbx;
+    pbx->numbers = NULL;
+    if (pbx_set_extension_ranges(pbx, PBX_DEFAULT_RANGES) == -1) goto fail_extensions;
+
     // attempting to add lock to prevent re entrancy issues
 
-    for (int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
-        pbx->extensions[i] = NULL; // Initialize all extensions to NULL
-    }
+    if (pthread_mutex_init(&pbx->lock, NULL) != 0) goto fail_numbers; // Initialize mutex
 
-    if (pthread_mutex_init(&pbx->lock, NULL) != 0) { // Initialize mutex
-        free(pbx);
-        return NULL;
+    for (int i = 0; i < PBX_STRIPES; i++) {
+        pthread_mutex_init(&pbx->stripes[i].lock, NULL);
     }
 
-    if (pthread_cond_init(&pbx->shutdown_cond, NULL) != 0) { // Initialize condition variable
-        free(pbx);
-        return NULL;
-    }
+    if (pthread_cond_init(&pbx->shutdown_cond, NULL) != 0) goto fail_locks; // Initialize condition variable
 
     pbx->active_tus = 0; // Initialize active TU count to 0
+    pbx->registered = NULL;
+    pbx->rooms = NULL; // no conference rooms unless configured
+    pbx->nrooms = 0;
+    pbx->groups = NULL; // no paging groups unless configured
+    pbx->ngroups = 0;
+    pbx->hunts = NULL; // no hunt groups unless configured
+    pbx->nhunts = 0;
+    pbx->hunt_members = NULL;
+    pbx->nhunt_members = 0;
 
     return pbx; // Return initialized PBX
+
+    // Undo whatever was set up, in reverse order
+fail_locks:
+    for (int i = 0; i < PBX_STRIPES; i++) {
+        pthread_mutex_destroy(&pbx->stripes[i].lock);
+    }
+    pthread_mutex_destroy(&pbx->lock);
+fail_numbers:
+    ext_alloc_fini(pbx->numbers);
+fail_extensions:
+    ext_table_fini(pbx->extensions);
+fail_pbx:
+    free(pbx);
+    return NULL;
 }
 
 
@@ -60,33 +326,54 @@ PBX *pbx_init() {
 void pbx_shutdown(PBX *pbx) {
     if (!pbx) return;
 
-    pthread_mutex_lock(&pbx->lock);
-
-    // Shut down all TUs and increment references to delay cleanup
-    for (int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
-        if (pbx->extensions[i]) { // extensions exists
-            shutdown(tu_fileno(pbx->extensions[i]), SHUT_RDWR); // shutdown associated network connection
-            tu_ref(pbx->extensions[i], "Shutdown in progress"); // increment tu reference count to delay cleanup
+    // Shut down all network connections, split among threads if there are many
+    int count;
+    TU **tus = pbx_snapshot(pbx, &count);
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > (count + PBX_SHUTDOWN_CHUNK - 1) / PBX_SHUTDOWN_CHUNK) {
+        nthreads = (count + PBX_SHUTDOWN_CHUNK - 1) / PBX_SHUTDOWN_CHUNK;
+    }
+    if (nthreads < 1) nthreads = 1;
+    PBX_SHUTDOWN_WORK work[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        work[i].tus = tus + count * i / nthreads;
+        work[i].count = count * (i + 1) / nthreads - count * i / nthreads;
+        if (i > 0 && pthread_create(&work[i].thread, NULL, pbx_shutdown_worker, &work[i]) != 0) {
+            pbx_shutdown_worker(&work[i]); // do it ourselves
+            work[i].count = 0;
         }
     }
+    pbx_shutdown_worker(&work[0]); // our own share
+    for (int i = 1; i < nthreads; i++) {
+        if (work[i].count) pthread_join(work[i].thread, NULL);
+    }
+    pbx_release(tus, count);
 
     // Wait for all active TUs to unregister
+    pthread_mutex_lock(&pbx->lock);
     while (pbx->active_tus > 0) {
         pthread_cond_wait(&pbx->shutdown_cond, &pbx->lock);
     }
+    pthread_mutex_unlock(&pbx->lock);
 
-    // Release references incremented during shutdown
-    for (int i = 0; i < PBX_MAX_EXTENSIONS; i++) {
-        if (pbx->extensions[i]) {
-            tu_unref(pbx->extensions[i], "Shutdown complete");
-            pbx->extensions[i] = NULL;
-        }
+    ext_table_fini(pbx->extensions);
+    ext_alloc_fini(pbx->numbers);
+    pbx_free_rooms(pbx->rooms, pbx->nrooms); // every member has hung up on unregistering
+    for (int i = 0; i < pbx->ngroups; i++) {
+        free(pbx->groups[i].exts);
     }
-
-    pthread_mutex_unlock(&pbx->lock);
+    free(pbx->groups);
+    for (int i = 0; i < pbx->nhunts; i++) {
+        tu_hunt_group_fini(pbx->hunts[i].group); // every member has left on unregistering
+    }
+    free(pbx->hunts);
+    free(pbx->hunt_members);
 
     pthread_mutex_destroy(&pbx->lock); // clean up mutex
     pthread_cond_destroy(&pbx->shutdown_cond); // clean up condition variable
+    for (int i = 0; i < PBX_STRIPES; i++) {
+        pthread_mutex_destroy(&pbx->stripes[i].lock);
+    }
 
     free(pbx);
 }
@@ -106,84 +393,368 @@ void pbx_shutdown(PBX *pbx) {
  * @return 0 if registration succeeds, otherwise -1.
  */
 int pbx_register(PBX *pbx, TU *tu, int ext) {
-    if (!pbx || !tu || ext < 0 || ext >= PBX_MAX_EXTENSIONS) {
+    if (!pbx || !tu || ext < 0) {
         fprintf(stderr, "ERROR pbx_register: Invalid parameters\n");
         return -1; // Return error for invalid inputs
     }
 
-    pthread_mutex_lock(&pbx->lock); // lock on registration
+    if (pbx_is_service(pbx, ext)) {
+        fprintf(stderr, "ERROR pbx_register: Extension %d is a conference room or hunt group\n", ext);
+        return -1;
+    }
+
+    // Numbers within the configured ranges are taken from the allocator, so it won't hand them out
+    int claimed = ext_alloc_claim(pbx->numbers, ext);
+    if (claimed == -1) {
+        fprintf(stderr, "ERROR pbx_register: Extension %d is already in use\n", ext);
+        return -1;
+    }
+
+    if (pbx_register_slot(pbx, tu, ext) == -1) {
+        if (claimed == 0) ext_alloc_put(pbx->numbers, ext);
+        return -1;
+    }
+    return 0;
+}
+
+// Put a TU in the slot of an extension whose number has been dealt with
+static int pbx_register_slot(PBX *pbx, TU *tu, int ext) {
+    _Atomic(TU *) *slot = ext_table_slot(pbx->extensions, ext); // before locking - may grow the table
+    if (!slot) return -1;
+
+    pthread_mutex_lock(pbx_slot_lock(pbx, ext)); // only this extension's stripe
 
-    if (pbx->extensions[ext]) { // Check if extension is already in use
+    if (atomic_load_explicit(slot, memory_order_relaxed)) { // Check if extension is already in use
         fprintf(stderr, "ERROR pbx_register: Extension %d is already in use\n", ext);
-        pthread_mutex_unlock(&pbx->lock); // unlock after registration
+        pthread_mutex_unlock(pbx_slot_lock(pbx, ext));
         return -1;
     }
 
-    pbx->extensions[ext] = tu; // Register TU
+    tu_ref(tu, "Registering TU"); // the registry's reference
+    atomic_store_explicit(slot, tu, memory_order_release); // Register TU - publish to dialers
+
+    pthread_mutex_unlock(pbx_slot_lock(pbx, ext));
+
+    pthread_mutex_lock(&pbx->lock);
     pbx->active_tus++; // Increment active TU count
-    tu_set_extension(tu, ext); // Assign extension to TU
-    tu_ref(tu, "Registering TU"); // Increment TU reference count
+    TU *head = atomic_load_explicit(&pbx->registered, memory_order_relaxed);
+    tu_link(tu)->prev = NULL; // at the head of the registered list
+    atomic_store_explicit(&tu_link(tu)->next, head, memory_order_relaxed);
+    if (head) tu_link(head)->prev = tu;
+    atomic_store_explicit(&pbx->registered, tu, memory_order_release); // publish to snapshots, links first
+    pthread_mutex_unlock(&pbx->lock);
 
-    // fprintf(stderr, "pbx_register: TU registered on extension %d\n", ext);
+    tu_set_extension(tu, ext); // Assign extension to TU (notifies the client - no locks held)
 
-    pthread_mutex_unlock(&pbx->lock); // unlock after registration
+    HUNT_GROUP *hunt = pbx_hunt_member(pbx, ext);
+    if (hunt) tu_set_hunt_group(tu, hunt); // takes calls to the group from now on
 
     return 0;
 }
 
+/*
+ * Register a TU on the lowest free extension number (see pbx_ext.h).
+ */
+int pbx_register_next(PBX *pbx, TU *tu) {
+    if (!pbx || !tu) {
+        fprintf(stderr, "ERROR pbx_register_next: Invalid parameters\n");
+        return -1;
+    }
+
+    int ext = ext_alloc_get(pbx->numbers);
+    if (ext == -1) {
+        fprintf(stderr, "ERROR pbx_register_next: No free extension numbers\n");
+        return -1;
+    }
+
+    if (pbx_register_slot(pbx, tu, ext) == -1) {
+        ext_alloc_put(pbx->numbers, ext);
+        return -1;
+    }
+    return ext;
+}
+
+/*
+ * Set the ranges of extension numbers handed out (see pbx_ext.h).
+ */
+int pbx_set_extension_ranges(PBX *pbx, const char *ranges) {
+    EXT_ALLOC *numbers = ext_alloc_init(ranges, PBX_MAX_NUMBERS);
+    if (!numbers) return -1;
+
+    ext_alloc_fini(pbx->numbers);
+    pbx->numbers = numbers;
+    return 0;
+}
+
+/*
+ * Reserve an extension number for static assignment (see pbx_ext.h).
+ */
+int pbx_reserve_extension(PBX *pbx, int ext) {
+    if (pbx_is_service(pbx, ext)) {
+        fprintf(stderr, "ERROR pbx_reserve_extension: Extension %d is a conference room or hunt group\n", ext);
+        return -1;
+    }
+    if (ext_alloc_reserve(pbx->numbers, ext) == -1) {
+        fprintf(stderr, "ERROR pbx_reserve_extension: Extension %d is taken, reserved already or in no range\n", ext);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set the numbers of the conference rooms (see pbx_ext.h).
+ */
+int pbx_set_conference_ranges(PBX *pbx, const char *ranges) {
+    EXT_ALLOC *numbers = ext_alloc_init(ranges, PBX_MAX_ROOMS); // parses the list, then hands out every number in it
+    if (!numbers) return -1;
+
+    PBX_ROOM *rooms = NULL;
+    int nrooms = 0;
+    int ext;
+    while ((ext = ext_alloc_get(numbers)) != -1) {
+        if (nrooms % 64 == 0) {
+            PBX_ROOM *r = realloc(rooms, (nrooms + 64) * sizeof(PBX_ROOM));
+            if (!r) goto fail;
+            rooms = r;
+        }
+        rooms[nrooms].number = ext;
+        rooms[nrooms].conf = tu_conference_init(ext);
+        if (!rooms[nrooms].conf) goto fail;
+        nrooms++;
+    }
+    ext_alloc_fini(numbers);
+    qsort(rooms, nrooms, sizeof(PBX_ROOM), pbx_room_compare); // ranges can come in any order
+
+    // Keep clients from being registered on room numbers
+    for (int i = 0; i < nrooms; i++) {
+        ext_alloc_reserve(pbx->numbers, rooms[i].number); // fails only for numbers outside the ranges - fine
+    }
+
+    pbx_free_rooms(pbx->rooms, pbx->nrooms);
+    pbx->rooms = rooms;
+    pbx->nrooms = nrooms;
+    return 0;
+
+fail:
+    ext_alloc_fini(numbers);
+    pbx_free_rooms(rooms, nrooms);
+    return -1;
+}
+
+/*
+ * Add a paging group (see pbx_ext.h).
+ */
+int pbx_add_paging_group(PBX *pbx, int group, const char *ranges) {
+    if (!pbx || group <= PBX_PAGE_ALL || !ranges) {
+        fprintf(stderr, "ERROR pbx_add_paging_group: Invalid parameters\n");
+        return -1;
+    }
+    if (pbx_group(pbx, group)) {
+        fprintf(stderr, "ERROR pbx_add_paging_group: Paging group %d already exists\n", group);
+        return -1;
+    }
+
+    int nexts;
+    int *exts = pbx_range_numbers(ranges, PBX_MAX_GROUP_SIZE, &nexts);
+    if (!exts) return -1;
+
+    PBX_GROUP *groups = realloc(pbx->groups, (pbx->ngroups + 1) * sizeof(PBX_GROUP));
+    if (!groups) {
+        free(exts);
+        return -1;
+    }
+    groups[pbx->ngroups].number = group;
+    groups[pbx->ngroups].nexts = nexts;
+    groups[pbx->ngroups].exts = exts;
+    pbx->groups = groups;
+    pbx->ngroups++;
+    qsort(pbx->groups, pbx->ngroups, sizeof(PBX_GROUP), pbx_group_compare);
+    return 0;
+}
+
+/*
+ * Add a hunt group (see pbx_ext.h).
+ */
+int pbx_add_hunt_group(PBX *pbx, int number, const char *ranges, int queue) {
+    if (!pbx || number < 0 || !ranges) {
+        fprintf(stderr, "ERROR pbx_add_hunt_group: Invalid parameters\n");
+        return -1;
+    }
+    if (pbx_is_service(pbx, number)) {
+        fprintf(stderr, "ERROR pbx_add_hunt_group: Number %d is a conference room or hunt group already\n", number);
+        return -1;
+    }
+
+    int nexts;
+    int *exts = pbx_range_numbers(ranges, PBX_MAX_GROUP_SIZE, &nexts);
+    if (!exts) return -1;
+    for (int i = 0; i < nexts; i++) {
+        if (exts[i] == number || pbx_hunt_member(pbx, exts[i]) || pbx_is_service(pbx, exts[i])) {
+            fprintf(stderr, "ERROR pbx_add_hunt_group: Extension %d cannot be a member of hunt group %d\n", exts[i], number);
+            free(exts);
+            return -1;
+        }
+    }
+
+    HUNT_GROUP *group = tu_hunt_group_init(number, queue);
+    PBX_HUNT *hunts = group ? realloc(pbx->hunts, (pbx->nhunts + 1) * sizeof(PBX_HUNT)) : NULL;
+    if (hunts) pbx->hunts = hunts;
+    PBX_HUNT_MEMBER *members = hunts ? realloc(pbx->hunt_members, (pbx->nhunt_members + nexts) * sizeof(PBX_HUNT_MEMBER)) : NULL;
+    if (!members) {
+        tu_hunt_group_fini(group);
+        free(exts);
+        return -1;
+    }
+    pbx->hunt_members = members;
+
+    pbx->hunts[pbx->nhunts].number = number;
+    pbx->hunts[pbx->nhunts].group = group;
+    pbx->nhunts++;
+    qsort(pbx->hunts, pbx->nhunts, sizeof(PBX_HUNT), pbx_hunt_compare);
+    for (int i = 0; i < nexts; i++) {
+        pbx->hunt_members[pbx->nhunt_members].ext = exts[i];
+        pbx->hunt_members[pbx->nhunt_members].group = group;
+        pbx->nhunt_members++;
+    }
+    qsort(pbx->hunt_members, pbx->nhunt_members, sizeof(PBX_HUNT_MEMBER), pbx_hunt_member_compare);
+    free(exts);
+
+    ext_alloc_reserve(pbx->numbers, number); // never handed out - fails only for numbers outside the ranges
+    return 0;
+}
+
+/*
+ * Page a group of extensions, or all of them (see pbx_ext.h).
+ */
+int pbx_page(PBX *pbx, TU *tu, int group, const char *msg, size_t len) {
+    if (!pbx || !tu || !msg) {
+        fprintf(stderr, "ERROR pbx_page: Invalid parameters\n");
+        return -1;
+    }
+
+    int count = 0;
+    TU **tus = NULL;
+    if (group == PBX_PAGE_ALL) {
+        tus = pbx_snapshot(pbx, &count);
+    } else {
+        PBX_GROUP *g = pbx_group(pbx, group);
+        if (!g) {
+            tu_page(tu, NULL, 0, msg, len); // nobody to page, but the client still gets its reply
+            return -1;
+        }
+        tus = pbx_group_snapshot(pbx, g, &count);
+    }
+
+    int ret = tu_page(tu, tus, count, msg, len);
+    pbx_release(tus, count);
+    return ret;
+}
+
+/*
+ * Call a function on every registered TU (see pbx_ext.h).
+ */
+int pbx_foreach(PBX *pbx, void (*fn)(TU *tu, void *arg), void *arg) {
+    int count;
+    TU **tus = pbx_snapshot(pbx, &count);
+    for (int i = 0; i < count; i++) {
+        fn(tus[i], arg);
+    }
+    pbx_release(tus, count);
+    return count;
+}
+
+// Release the registry's reference to an unregistered TU, once no reader can still be looking at it
+static void pbx_release_unregistered(PBX *pbx, TU *tu) {
+    tu_unref(tu, "TU unregistered"); // Release TU reference for removal
+
+    // Notify shutdown if no active TUs remain
+    pthread_mutex_lock(&pbx->lock);
+    pbx->active_tus--; // Decrement active TU count
+    if (pbx->active_tus == 0) {
+        pthread_cond_signal(&pbx->shutdown_cond);
+    }
+    pthread_mutex_unlock(&pbx->lock);
+}
+
+// RCU callback: a grace period has passed since a TU was unregistered
+static void pbx_retire(RCU_HEAD *head) {
+    PBX_RETIRED *retired = (PBX_RETIRED *)head;
+    pbx_release_unregistered(retired->pbx, retired->tu);
+    free(retired);
+}
+
 /*
  * Unregister a TU from a PBX.
  * This amounts to "unplugging a telephone unit from the PBX".
  * The TU is disassociated from its extension number.
  * Then a hangup operation is performed on the TU to cancel any
  * call that might be in progress.
- * Finally, the reference held by the PBX to the TU is released.
+ * The number is free again at once.  Finally, the reference held by the
+ * PBX to the TU is released once no lookup can still be using it; this
+ * happens in the background, and pbx_shutdown() waits for it.
  *
  * @param pbx  The PBX.
  * @param tu  The TU to be unregistered.
  * @return 0 if unregistration succeeds, otherwise -1.
  */
 int pbx_unregister(PBX *pbx, TU *tu) {
-    pthread_mutex_lock(&pbx->lock); // lock at unregistration
-
     if (!pbx || !tu) {
         fprintf(stderr, "ERROR pbx_unregister: Invalid parameters\n");
-        pthread_mutex_unlock(&pbx->lock);
         return -1;
     }
 
     int ext = tu_extension(tu); // retrieve tu assigned extension number
-    if (ext < 0 || ext >= PBX_MAX_EXTENSIONS || pbx->extensions[ext] != tu) {
+    rcu_read_lock();
+    _Atomic(TU *) *slot = ext_table_lookup(pbx->extensions, ext); // stays valid after unlocking - pages are never freed
+    rcu_read_unlock();
+    if (!slot) {
         fprintf(stderr, "ERROR pbx_unregister: TU not registered or invalid extension %d\n", ext);
-        pthread_mutex_unlock(&pbx->lock);
         return -1;
     }
 
-    // Increment reference to prevent cleanup during operation
-    tu_ref(tu, "Unregistering TU safely");
-
-    pbx->extensions[ext] = NULL; // Remove TU from registry
-    pbx->active_tus--; // Decrement active TU count
-
-    tu_hangup(tu); // Terminate ongoing calls
-    tu_unref(tu, "TU unregistered"); // Release TU reference for removal
-
-    // Notify shutdown if no active TUs remain
-    if (pbx->active_tus == 0) {
-        pthread_cond_signal(&pbx->shutdown_cond);
+    pthread_mutex_lock(pbx_slot_lock(pbx, ext));
+    if (atomic_load_explicit(slot, memory_order_relaxed) != tu) {
+        fprintf(stderr, "ERROR pbx_unregister: TU not registered or invalid extension %d\n", ext);
+        pthread_mutex_unlock(pbx_slot_lock(pbx, ext));
+        return -1;
     }
-
-    // Release additional reference held during operation
-    tu_unref(tu, "Unregister operation complete");
-
-    // fprintf(stderr, "pbx_unregister: TU unregistered from extension %d\n", ext);
+    atomic_store(slot, NULL); // Remove TU from registry - the registry's reference is now ours
+    pthread_mutex_unlock(pbx_slot_lock(pbx, ext));
+    ext_alloc_put(pbx->numbers, ext); // the number can be registered again at once - a late dialer still has the old TU
+    tu_set_hunt_group(tu, NULL); // no more calls through a hunt group either
+    tu_close(tu); // nor from a dialer that fetched it just before, nor callbacks
+
+    pthread_mutex_lock(&pbx->lock); // off the registered list while we still hold a reference
+    TU_LINK *link = tu_link(tu);
+    TU *next = atomic_load_explicit(&link->next, memory_order_relaxed);
+    if (link->prev) atomic_store_explicit(&tu_link(link->prev)->next, next, memory_order_release);
+    else atomic_store_explicit(&pbx->registered, next, memory_order_release);
+    if (next) tu_link(next)->prev = link->prev;
+    link->prev = NULL; // next is left alone: a snapshot may be standing on this TU and have yet to follow it
     pthread_mutex_unlock(&pbx->lock);
 
+    tu_hangup(tu); // Terminate ongoing calls - closed, it can't be dialed into another
+
+    // A dialer or snapshot may have fetched the TU just before it was removed; once they
+    // are all done it has its own reference or none, and ours can go.  That is left to
+    // the RCU reclaimer, so that the thread servicing the client need not wait for them.
+    PBX_RETIRED *retired = malloc(sizeof(PBX_RETIRED));
+    if (retired) {
+        retired->pbx = pbx;
+        retired->tu = tu;
+        call_rcu(&retired->head, pbx_retire);
+    } else {
+        rcu_synchronize();
+        pbx_release_unregistered(pbx, tu);
+    }
+
     return 0;
 }
 
 /*
  * Use the PBX to initiate a call from a specified TU to a specified extension.
+ * If no TU is registered on the extension, the call fails and the originating
+ * TU transitions to the TU_ERROR state.
  *
  * @param pbx  The PBX registry.
  * @param tu  The TU that is initiating the call.
@@ -191,33 +762,69 @@ int pbx_unregister(PBX *pbx, TU *tu) {
  * @return 0 if dialing succeeds, otherwise -1.
  */
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
-
-    if (!pbx || !tu || ext < 0 || ext >= PBX_MAX_EXTENSIONS) {
+    if (!pbx || !tu) {
         fprintf(stderr, "ERROR pbx_dial: Invalid parameters\n");
         return -1;
     }
 
-    pthread_mutex_lock(&pbx->lock);
-
-    TU *target_tu = pbx->extensions[ext]; // retrieve target tu for specified extension
-    if (!target_tu) { // Check if target exists
-        fprintf(stderr, "ERROR pbx_dial: No TU registered on extension %d\n", ext);
-        pthread_mutex_unlock(&pbx->lock);
-        return -1;
+    // Look up the target without locking, taking a reference so it can't go away while we dial it
+    // (the registry's own reference is only dropped after every such lookup in progress is done)
+    TU *target_tu = NULL;
+    rcu_read_lock();
+    _Atomic(TU *) *slot = ext_table_lookup(pbx->extensions, ext); // NULL for numbers never used
+    if (slot) {
+        target_tu = atomic_load(slot);
+        if (target_tu) {
+            tu_ref(target_tu, "Dialing target TU");
+        }
     }
+    rcu_read_unlock();
 
-    // Increment references to ensure both TUs remain valid during dialing
-    tu_ref(tu, "Dialing TU"); // increment reference count for originating tu
-    tu_ref(target_tu, "Dialing target TU"); // increment reference count for target tu
+    // No TU there: the number may be a conference room
+    CONFERENCE *room = target_tu ? NULL : pbx_room(pbx, ext);
+    if (room) return tu_join(tu, room);
 
-    // Perform dialing operation
+    // ... or a hunt group
+    HUNT_GROUP *hunt = target_tu ? NULL : pbx_hunt(pbx, ext);
+    if (hunt) return tu_dial_hunt(tu, hunt);
+
+    // Perform dialing operation with no registry lock held - a NULL target gives TU_ERROR
     int result = tu_dial(tu, target_tu);
 
-    // Release references after dialing
-    tu_unref(target_tu, "Dialing target complete");
-    tu_unref(tu, "Dialing TU complete");
+    if (target_tu) {
+        tu_unref(target_tu, "Dialing target complete");
+    }
 
-    pthread_mutex_unlock(&pbx->lock);
+    return result;
+}
+
+/*
+ * Camp on the extension that gave a TU busy signal (see pbx_ext.h).
+ */
+int pbx_camp(PBX *pbx, TU *tu) {
+    if (!pbx || !tu) {
+        fprintf(stderr, "ERROR pbx_camp: Invalid parameters\n");
+        return -1;
+    }
+
+    // Look up the target as pbx_dial() does
+    int ext = tu_camp_extension(tu);
+    TU *target_tu = NULL;
+    rcu_read_lock();
+    _Atomic(TU *) *slot = ext >= 0 ? ext_table_lookup(pbx->extensions, ext) : NULL;
+    if (slot) {
+        target_tu = atomic_load(slot);
+        if (target_tu) {
+            tu_ref(target_tu, "Camp target TU");
+        }
+    }
+    rcu_read_unlock();
+
+    int result = tu_camp(tu, target_tu); // a NULL target only repeats the TU's state
+
+    if (target_tu) {
+        tu_unref(target_tu, "Camp target complete");
+    }
 
     return result;
-}
\ No newline at end of file
+}
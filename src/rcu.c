@@ -0,0 +1,206 @@
+/*
+ * Minimal read-copy-update (see rcu.h).
+ *
+ * Each thread that reads gets a reader record of its own, on its own cache
+ * line.  On entering a read-side critical section it stores the current
+ * grace period number in its record, and on leaving it stores 0.  A writer
+ * starts a new grace period and waits until no record holds an older
+ * number: every reader that was inside when the writer unpublished its
+ * object has then left.  Records of threads that exit are recycled.
+ *
+ * Deferred callbacks are queued for a reclaimer thread, started on first
+ * use, which takes whatever has been queued, waits out one grace period
+ * for the lot, and runs them.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "rcu.h"
+
+// Per-thread reader record
+typedef struct rcu_reader {
+    atomic_ulong period; // grace period at entry, 0 when not reading
+    atomic_bool in_use; // owned by a live thread
+    struct rcu_reader *next; // all records ever created
+} __attribute__((aligned(64))) RCU_READER;
+
+static atomic_ulong grace_period = 1;
+static _Atomic(RCU_READER *) readers; // list of records, only ever pushed onto
+static pthread_mutex_t synchronize_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+// Callbacks waiting for the reclaimer thread
+static pthread_mutex_t callback_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t callback_cond = PTHREAD_COND_INITIALIZER; // callbacks queued
+static pthread_cond_t callback_done_cond = PTHREAD_COND_INITIALIZER; // callbacks run
+static RCU_HEAD *callbacks; // oldest first
+static RCU_HEAD **callbacks_tail = &callbacks;
+static unsigned long callbacks_queued; // ever queued
+static unsigned long callbacks_done; // ever run
+static int reclaimer_running;
+static pthread_once_t reclaimer_once = PTHREAD_ONCE_INIT;
+
+static __thread RCU_READER *reader; // this thread's record
+static __thread int nesting; // depth of rcu_read_lock()
+
+// Thread exit: give the record back for another thread to use
+static void rcu_reader_release(void *arg) {
+    RCU_READER *r = arg;
+    atomic_store(&r->period, 0);
+    atomic_store_explicit(&r->in_use, false, memory_order_release);
+}
+
+static void rcu_key_init(void) {
+    pthread_key_create(&reader_key, rcu_reader_release);
+}
+
+// Find this thread a record: a recycled one if possible, otherwise a new one
+static RCU_READER *rcu_reader_get(void) {
+    pthread_once(&reader_key_once, rcu_key_init);
+
+    RCU_READER *r;
+    for (r = atomic_load(&readers); r; r = r->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&r->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&r->in_use, &expected, true)) {
+            break;
+        }
+    }
+
+    if (!r) {
+        if (posix_memalign((void **)&r, 64, sizeof(RCU_READER)) != 0) {
+            fprintf(stderr, "ERROR: Failed to allocate RCU reader record\n");
+            abort(); // can't read safely without one
+        }
+        atomic_init(&r->period, 0);
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load(&readers);
+        while (!atomic_compare_exchange_weak(&readers, &r->next, r))
+            ;
+    }
+
+    pthread_setspecific(reader_key, r);
+    return r;
+}
+
+void rcu_read_lock(void) {
+    if (nesting++) return;
+    if (!reader) reader = rcu_reader_get();
+
+    atomic_store(&reader->period, atomic_load(&grace_period));
+    // The announcement must be visible before any shared pointer is read, and the
+    // readers' loads are only acquire, which a seq_cst store alone does not keep
+    // behind it - this fence pairs with the one in rcu_synchronize()
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void rcu_read_unlock(void) {
+    if (--nesting) return;
+    atomic_store_explicit(&reader->period, 0, memory_order_release);
+}
+
+void rcu_synchronize(void) {
+    pthread_mutex_lock(&synchronize_mutex);
+
+    // The caller's unpublishing store must be visible before any reader record is checked
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Readers that enter from now on see the new period, and whatever was unpublished before it
+    unsigned long period = atomic_fetch_add(&grace_period, 1) + 1;
+
+    for (RCU_READER *r = atomic_load(&readers); r; r = r->next) {
+        unsigned long p;
+        while ((p = atomic_load(&r->period)) != 0 && p < period) {
+            sched_yield(); // reader still inside a critical section begun before we started
+        }
+    }
+
+    pthread_mutex_unlock(&synchronize_mutex);
+}
+
+// Reclaimer thread: runs the queued callbacks a grace period after they were queued
+static void *rcu_reclaimer_thread(void *arg) {
+    pthread_mutex_lock(&callback_mutex);
+    while (1) {
+        while (!callbacks) {
+            pthread_cond_wait(&callback_cond, &callback_mutex);
+        }
+        RCU_HEAD *batch = callbacks;
+        callbacks = NULL;
+        callbacks_tail = &callbacks;
+        pthread_mutex_unlock(&callback_mutex);
+
+        rcu_synchronize(); // one grace period covers the whole batch
+
+        unsigned long n = 0;
+        while (batch) {
+            RCU_HEAD *next = batch->next;
+            batch->fn(batch);
+            batch = next;
+            n++;
+        }
+
+        pthread_mutex_lock(&callback_mutex);
+        callbacks_done += n;
+        pthread_cond_broadcast(&callback_done_cond);
+    }
+
+    return NULL;
+}
+
+static void rcu_reclaimer_start(void) {
+    // Signals are for the master server thread only
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, rcu_reclaimer_thread, NULL) == 0) {
+        pthread_detach(tid);
+        reclaimer_running = 1;
+    } else {
+        fprintf(stderr, "ERROR: Failed to start RCU reclaimer thread, releasing synchronously\n");
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void call_rcu(RCU_HEAD *head, void (*fn)(RCU_HEAD *head)) {
+    pthread_once(&reclaimer_once, rcu_reclaimer_start);
+    head->fn = fn;
+    head->next = NULL;
+
+    if (!reclaimer_running) { // no thread to hand it to - wait here instead
+        rcu_synchronize();
+        fn(head);
+        pthread_mutex_lock(&callback_mutex);
+        callbacks_queued++;
+        callbacks_done++;
+        pthread_cond_broadcast(&callback_done_cond);
+        pthread_mutex_unlock(&callback_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&callback_mutex);
+    *callbacks_tail = head;
+    callbacks_tail = &head->next;
+    callbacks_queued++;
+    pthread_cond_signal(&callback_cond);
+    pthread_mutex_unlock(&callback_mutex);
+}
+
+void rcu_barrier(void) {
+    pthread_mutex_lock(&callback_mutex);
+    unsigned long target = callbacks_queued;
+    while (callbacks_done < target) {
+        pthread_cond_wait(&callback_done_cond, &callback_mutex);
+    }
+    pthread_mutex_unlock(&callback_mutex);
+}
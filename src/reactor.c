@@ -0,0 +1,251 @@
+/*
+ * Reactor: epoll event loops servicing client sessions.
+ */
+#define _GNU_SOURCE // accept4(), CPU affinity
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "session.h"
+#include "reactor.h"
+#include "debug.h"
+
+#define REACTOR_MAX_EVENTS 64 // events taken from epoll per wakeup
+
+// One event loop: an epoll instance and the thread waiting on it
+struct reactor_loop {
+    int epfd; // epoll instance holding this loop's sessions
+    int listen_fd; // this loop's own listening socket, or -1 (registered with data.ptr NULL)
+    pthread_t thread; // thread running the loop
+};
+
+static struct reactor_loop *loops; // array of nloops loops
+static int nloops;
+static atomic_uint next_loop; // round-robin assignment of new connections
+
+int reactor_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/*
+ * Drop a session whose connection has reached EOF or failed.
+ */
+static void reactor_close(struct reactor_loop *loop, SESSION *s) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, session_fileno(s), NULL);
+    session_close(s);
+}
+
+/*
+ * Drain everything readable on a session's connection.  With edge-triggered
+ * notification we must keep reading until the socket reports EAGAIN.
+ * Reads are made non-blocking per call (MSG_DONTWAIT) rather than by
+ * setting O_NONBLOCK, since the socket is shared with the TU module.  Its
+ * writes do not block either: notifications are sent with MSG_DONTWAIT, and
+ * whatever the socket will not take is left to the TU drain thread, subject
+ * to the output limit and policy (see tu_set_output_limit()).
+ */
+static void reactor_service(struct reactor_loop *loop, SESSION *s, char *chunk) {
+    int fd = session_fileno(s);
+
+    while (1) {
+        ssize_t bytes_read = recv(fd, chunk, CHUNK_SIZE, MSG_DONTWAIT);
+        if (bytes_read > 0) {
+            if (session_input(s, chunk, bytes_read) < 0) {
+                reactor_close(loop, s);
+                return;
+            }
+            continue;
+        }
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // drained - wait for the next edge
+        }
+        reactor_close(loop, s); // EOF or connection error
+        return;
+    }
+}
+
+/*
+ * Register a connection accepted by or handed to a loop.
+ */
+static int reactor_attach(struct reactor_loop *loop, int fd) {
+    SESSION *s = session_open(fd);
+    if (!s) return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = s;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        session_close(s);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Accept every pending connection on a loop's own listening socket.
+ * Client sockets are left in blocking mode; every call on them says
+ * whether it may block (see reactor_service()).
+ */
+static void reactor_accept(struct reactor_loop *loop) {
+    while (1) {
+        int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            reactor_attach(loop, fd);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            fprintf(stderr, "ERROR: failed to accept and handle incoming new client connection\n");
+            return; // retried on the next incoming connection
+        }
+        // Listening socket was shut down by reactor_stop_listening()
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+        close(loop->listen_fd);
+        loop->listen_fd = -1;
+        return;
+    }
+}
+
+/*
+ * Thread function for an event loop.
+ */
+static void *reactor_run(void *arg) {
+    struct reactor_loop *loop = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    char chunk[CHUNK_SIZE]; // shared by all sessions of this loop
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(loop);
+            } else {
+                reactor_service(loop, events[i].data.ptr, chunk);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Pin a loop thread to the n-th CPU in the process's affinity mask.
+ */
+static void reactor_pin(pthread_t thread, int n) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return;
+
+    int ncpus = CPU_COUNT(&allowed);
+    if (ncpus == 0) return;
+    n %= ncpus;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+                fprintf(stderr, "ERROR: failed to pin event loop thread to CPU %d\n", cpu);
+            }
+            return;
+        }
+    }
+}
+
+int reactor_start(int count, int pin_cpus) {
+    loops = calloc(count, sizeof(struct reactor_loop));
+    if (!loops) return -1;
+
+    // SIGHUP must reach the main thread so that it can shut the server down
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (nloops = 0; nloops < count; nloops++) {
+        struct reactor_loop *loop = &loops[nloops];
+        loop->listen_fd = -1;
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd == -1) {
+            perror("epoll_create1");
+            break;
+        }
+        if (pthread_create(&loop->thread, NULL, reactor_run, loop) != 0) {
+            fprintf(stderr, "ERROR: failed to create event loop thread\n");
+            close(loop->epfd);
+            break;
+        }
+        if (pin_cpus) {
+            reactor_pin(loop->thread, nloops);
+        }
+        pthread_detach(loop->thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    return nloops == count ? 0 : -1;
+}
+
+int reactor_add(int fd) {
+    struct reactor_loop *loop = &loops[atomic_fetch_add(&next_loop, 1) % nloops];
+    return reactor_attach(loop, fd);
+}
+
+int reactor_listen(int index, int listen_fd) {
+    if (index < 0 || index >= nloops) return -1;
+    struct reactor_loop *loop = &loops[index];
+
+    int flags = fcntl(listen_fd, F_GETFL);
+    if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+
+    loop->listen_fd = listen_fd;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // marks the listener among the loop's sessions
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        loop->listen_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void reactor_stop_listening(void) {
+    for (int i = 0; i < nloops; i++) {
+        int listen_fd = loops[i].listen_fd;
+        if (listen_fd >= 0) {
+            // Linux stops a listening socket on shutdown(); the loop closes it
+            shutdown(listen_fd, SHUT_RDWR);
+        }
+    }
+}
@@ -9,40 +9,225 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdio.h>
-#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "debug.h"
 #include "pbx.h" // includes tu.h already - can't reinclude or linking error when recursive opening
 #include "server.h"
+#include "session.h"
+#include "framer.h"
+#include "command.h"
+#include "tu_ext.h"
+#include "pbx_ext.h"
+
+// Per-connection state shared by every I/O model
+struct session {
+    int fd; // File descriptor for the client connection
+    TU *tu; // TU registered for this connection
+    FRAMER framer; // splits received data into command lines
+};
+
+static void session_service(int fd);
+
+// Static extension assignment by client address (see session_load_assignments())
+typedef struct assignment {
+    in_addr_t addr; // network byte order
+    int ext;
+} ASSIGNMENT;
+
+static ASSIGNMENT *assignments; // sorted by addr
+static int nassignments;
+
+static int assignment_compare(const void *a, const void *b) {
+    in_addr_t x = ((const ASSIGNMENT *)a)->addr, y = ((const ASSIGNMENT *)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Read the static assignments from a file (see session.h).
+ */
+int session_load_assignments(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Can't open assignment file '%s'\n", path);
+        return -1;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0'; // comments run to the end of the line
+
+        char addr[64];
+        int ext;
+        int n = sscanf(line, "%63s %d", addr, &ext);
+        if (n == EOF || n == 0) continue; // blank line
+
+        struct in_addr in;
+        if (n != 2 || inet_pton(AF_INET, addr, &in) != 1 || ext < 0) {
+            fprintf(stderr, "ERROR: %s:%d: Expected '<IPv4 address> <extension>'\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (pbx_reserve_extension(pbx, ext) == -1) { // keep it away from everyone else
+            fprintf(stderr, "ERROR: %s:%d: Can't assign extension %d\n", path, lineno, ext);
+            fclose(f);
+            return -1;
+        }
+
+        ASSIGNMENT *a = realloc(assignments, (nassignments + 1) * sizeof(ASSIGNMENT));
+        if (!a) {
+            fclose(f);
+            return -1;
+        }
+        assignments = a;
+        assignments[nassignments].addr = in.s_addr;
+        assignments[nassignments].ext = ext;
+        nassignments++;
+    }
+    fclose(f);
+
+    qsort(assignments, nassignments, sizeof(ASSIGNMENT), assignment_compare);
+    return 0;
+}
+
+// Extension statically assigned to the peer of a connection, or -1 if none
+static int session_assigned_extension(int fd) {
+    if (nassignments == 0) return -1;
+
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    if (getpeername(fd, (struct sockaddr *)&sa, &len) == -1 || sa.sin_family != AF_INET) {
+        return -1;
+    }
+
+    ASSIGNMENT key = { .addr = sa.sin_addr.s_addr };
+    ASSIGNMENT *a = bsearch(&key, assignments, nassignments, sizeof(ASSIGNMENT), assignment_compare);
+    return a ? a->ext : -1;
+}
+
+/*
+ * Create a session for a new connection, initializing and registering its TU.
+ */
+SESSION *session_open(int fd) {
+    SESSION *s = calloc(1, sizeof(SESSION));
+    if (!s) {
+        close(fd);
+        return NULL;
+    }
+
+    TU *tu = tu_init(fd); // initialize tu for cient using file descriptor
+    if (tu == NULL) {
+        free(s);
+        close(fd);
+        return NULL;
+    }
+
+    // Clients with a statically assigned number get it; everyone else the lowest free one
+    int ext = session_assigned_extension(fd);
+    int registered = ext != -1 ? pbx_register(pbx, tu, ext) : pbx_register_next(pbx, tu);
+    if (registered < 0) {
+        free(s);
+        tu_unref(tu, "Failed registration of TU"); // last reference - closes fd
+        return NULL;
+    }
+
+    s->fd = fd;
+    s->tu = tu;
+    framer_init(&s->framer);
+    return s;
+}
+
+/*
+ * Decode a single command line (without EOL) and carry it out.
+ */
+static void session_dispatch(void *arg, char *line, size_t len) {
+    SESSION *s = arg;
+    TU *tu = s->tu;
+    COMMAND cmd;
+
+    if (command_parse(line, len, &cmd) == -1) {
+        return; // not a command - ignored
+    }
+
+    switch ((int)cmd.cmd) { // the commands of command.h are not among the enum's own values
+        case TU_PICKUP_CMD:
+            tu_pickup(tu);
+            break;
+        case TU_HANGUP_CMD:
+            tu_hangup(tu);
+            break;
+        case TU_DIAL_CMD:
+            pbx_dial(pbx, tu, cmd.ext);
+            break;
+        case TU_CHAT_CMD:
+            // relayed straight out of the receive buffer
+            tu_chat_buf(tu, cmd.msg, cmd.msg_len);
+            break;
+        case TU_PAGE_CMD:
+            pbx_page(pbx, tu, cmd.ext, cmd.msg, cmd.msg_len);
+            break;
+        case TU_CAMP_CMD:
+            pbx_camp(pbx, tu);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Hand received data to the session's framer, which carries out every complete
+ * line, as one batch.
+ */
+int session_input(SESSION *s, char *data, size_t len) {
+    // every command in this read is carried out before any notification goes out
+    tu_batch_begin();
+    int ret = framer_input(&s->framer, data, len, session_dispatch, s);
+    tu_batch_end();
+    return ret;
+}
+
+/*
+ * Unregister the session's TU and free the session.
+ * The file descriptor is owned by the TU and is closed when its last reference goes.
+ */
+void session_close(SESSION *s) {
+    framer_fini(&s->framer);
+    pbx_unregister(pbx, s->tu);
+    tu_unref(s->tu, "Client disconnected");
+    free(s);
+}
+
+int session_fileno(SESSION *s) {
+    return s->fd;
+}
 
 /*
  * Thread function for the thread that handles interaction with a client TU.
  * This is called after a network connection has been made via the main server
  * thread and a new thread has been created to handle the connection.
 */
-#define CHUNK_SIZE 2048 // Fixed chunk size for reading
-
 void *pbx_client_service(void *arg) {
     int *fd_ptr = (int *)arg; // extract file descriptor passed as an argument
     int fd = *fd_ptr; // take pointer to file descriptor and dereference to access actual value of file descriptor
     free(fd_ptr); // free allocated memory for ptr for rsrc management
 
-    TU *tu = tu_init(fd); // initialize tu for cient using file descriptor
-    if (tu == NULL) {
-        close(fd);
-        return NULL;
-    }
+    session_service(fd);
+    return NULL;
+}
 
-    if (pbx_register(pbx, tu, fd) < 0) { // register tu with pbx: associate tu with pbx and assign extension # (use fd for simplicity)
-        tu_unref(tu, "Failed registration of TU");
-        close(fd);
-        return NULL;
+// Service a client connection until EOF
+static void session_service(int fd) {
+    SESSION *s = session_open(fd);
+    if (s == NULL) {
+        return;
     }
 
     char chunk[CHUNK_SIZE]; // buffer of read chunk
-    char *buffer = NULL; // dynamically allocated buffer
-    size_t buffer_size = 0; // tracks buffer usage to avoid overwriting
-    size_t buffer_used = 0;
 
     while (1) { // command processing loop (infinite) to continuously read commands from client
         ssize_t bytes_read = read(fd, chunk, sizeof(chunk));
@@ -50,59 +235,10 @@ void *pbx_client_service(void *arg) {
             break;
         }
 
-        // adheres to assignment specifications when there is no limit on length of messages in command
-        // Ensure enough space in the dynamic buffer
-        if (buffer_size < buffer_used + bytes_read + 1) {
-            buffer_size = (buffer_used + bytes_read + 1) * 2;
-            buffer = realloc(buffer, buffer_size);
-            if (!buffer) {
-                perror("Memory allocation failed");
-                break;
-            }
-        }
-
-        // Append new data to the dynamic buffer
-        memcpy(buffer + buffer_used, chunk, bytes_read);
-        buffer_used += bytes_read;
-        buffer[buffer_used] = '\0';
-
-        // Process complete lines
-        char *line_start = buffer;
-        char *line_end;
-        while ((line_end = strstr(line_start, EOL)) != NULL) {
-            *line_end = '\0'; // Null-terminate the line
-            char *command = line_start;
-
-            // Process the command
-            if (strcmp(command, "pickup") == 0) { // TU_PICKUP_CMD
-                tu_pickup(tu);
-            } else if (strcmp(command, "hangup") == 0) { // TU_HANGUP_CMD
-                tu_hangup(tu);
-            } else if (strncmp(command, "dial ", 5) == 0) { // TU_DIAL_CMD
-                char *ext_str = command + 5;
-                while (*ext_str == ' ') ext_str++;
-                if (isdigit(*ext_str)) {
-                    int ext = atoi(ext_str);
-                    pbx_dial(pbx, tu, ext);
-                }
-            } else if (strncmp(command, "chat ", 5) == 0) { // TU_CHAT_CMD
-                char *msg = command + 5;
-                tu_chat(tu, msg);
-            }
-
-            // Move to the next line
-            line_start = line_end + strlen(EOL);
+        if (session_input(s, chunk, bytes_read) < 0) {
+            break;
         }
-
-        // Retain any remaining partial line
-        buffer_used = strlen(line_start);
-        memmove(buffer, line_start, buffer_used);
     }
 
-    free(buffer);
-    pbx_unregister(pbx, tu);
-    tu_unref(tu, "Client disconnected");
-    close(fd);
-
-    return NULL;
-}
\ No newline at end of file
+    session_close(s);
+}
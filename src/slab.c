@@ -0,0 +1,192 @@
+/*
+ * Slab allocator with per-thread magazines (see slab.h).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "slab.h"
+
+#define SLAB_LINE 64 // cache line size
+#define SLAB_CHUNK_SIZE (64 * 1024) // memory carved into slots at a time
+#define SLAB_MAGAZINE_SIZE 32 // free objects held by a thread per cache
+
+// A stack of free objects, owned by one thread or sitting in the depot
+typedef struct slab_magazine {
+    int count;
+    void *objs[SLAB_MAGAZINE_SIZE];
+    struct slab_magazine *next; // in the depot
+} SLAB_MAGAZINE;
+
+struct slab_cache {
+    const char *name;
+    size_t slot_size; // object size rounded up to whole cache lines
+    int id; // index of this cache's magazine in each thread
+    void (*init)(void *obj); // run once per slot, for type-stable caches
+    pthread_mutex_t lock; // guards everything below
+    SLAB_MAGAZINE *full; // depot: magazines with SLAB_MAGAZINE_SIZE objects
+    SLAB_MAGAZINE *partial; // depot: magazines partly filled, by a thread that exited
+    SLAB_MAGAZINE *empty; // depot: magazines with no objects
+    char *carve; // next unused slot of the newest chunk
+    char *carve_end; // end of the newest chunk
+};
+
+static SLAB_CACHE caches[SLAB_MAX_CACHES];
+static int ncaches;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread SLAB_MAGAZINE *magazines[SLAB_MAX_CACHES]; // this thread's, by cache id
+
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+
+// Put a magazine in the depot - caller holds c->lock
+static void slab_depot_put(SLAB_CACHE *c, SLAB_MAGAZINE *m) {
+    SLAB_MAGAZINE **list = m->count == SLAB_MAGAZINE_SIZE ? &c->full : m->count ? &c->partial : &c->empty;
+    m->next = *list;
+    *list = m;
+}
+
+// Take a magazine from one of the depot's lists, or NULL if none - caller holds c->lock
+static SLAB_MAGAZINE *slab_depot_get(SLAB_MAGAZINE **list) {
+    SLAB_MAGAZINE *m = *list;
+    if (m) *list = m->next;
+    return m;
+}
+
+// Thread exit: hand this thread's objects to the depots for other threads to use
+static void slab_thread_exit(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ncaches; i++) {
+        SLAB_MAGAZINE *m = magazines[i];
+        if (!m) continue;
+        magazines[i] = NULL;
+
+        SLAB_CACHE *c = &caches[i];
+        pthread_mutex_lock(&c->lock);
+        slab_depot_put(c, m); // a partly filled one is picked up again before anything new is carved
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+static void slab_key_init(void) {
+    pthread_key_create(&magazine_key, slab_thread_exit);
+}
+
+SLAB_CACHE *slab_cache_create(const char *name, size_t size) {
+    return slab_cache_create_typesafe(name, size, NULL);
+}
+
+SLAB_CACHE *slab_cache_create_typesafe(const char *name, size_t size, void (*init)(void *obj)) {
+    pthread_once(&magazine_key_once, slab_key_init);
+
+    pthread_mutex_lock(&caches_lock);
+    if (ncaches == SLAB_MAX_CACHES) {
+        pthread_mutex_unlock(&caches_lock);
+        fprintf(stderr, "ERROR: Too many slab caches creating '%s'\n", name);
+        return NULL;
+    }
+    SLAB_CACHE *c = &caches[ncaches];
+    c->name = name;
+    c->slot_size = (size + SLAB_LINE - 1) / SLAB_LINE * SLAB_LINE;
+    if (c->slot_size == 0) c->slot_size = SLAB_LINE;
+    c->id = ncaches;
+    c->init = init;
+    pthread_mutex_init(&c->lock, NULL);
+    c->full = c->partial = c->empty = NULL;
+    c->carve = c->carve_end = NULL;
+    ncaches++;
+    pthread_mutex_unlock(&caches_lock);
+    return c;
+}
+
+// This thread's magazine for a cache, created on first use
+static SLAB_MAGAZINE *slab_magazine(SLAB_CACHE *c) {
+    SLAB_MAGAZINE *m = magazines[c->id];
+    if (m) return m;
+
+    pthread_mutex_lock(&c->lock);
+    m = slab_depot_get(&c->partial);
+    if (!m) m = slab_depot_get(&c->empty);
+    pthread_mutex_unlock(&c->lock);
+    if (!m) {
+        m = malloc(sizeof(SLAB_MAGAZINE));
+        if (!m) return NULL;
+        m->count = 0;
+    }
+    magazines[c->id] = m;
+    pthread_setspecific(magazine_key, magazines); // any non-NULL value gets the destructor called
+    return m;
+}
+
+// Fill an empty magazine with fresh slots - caller holds c->lock
+static int slab_carve(SLAB_CACHE *c, SLAB_MAGAZINE *m) {
+    while (m->count < SLAB_MAGAZINE_SIZE) {
+        if (c->carve == c->carve_end) {
+            char *chunk = aligned_alloc(SLAB_LINE, SLAB_CHUNK_SIZE);
+            if (!chunk) break;
+            c->carve = chunk;
+            c->carve_end = chunk + SLAB_CHUNK_SIZE / c->slot_size * c->slot_size;
+            if (c->carve == c->carve_end) { // object bigger than a chunk
+                free(chunk);
+                break;
+            }
+        }
+        if (c->init) c->init(c->carve);
+        m->objs[m->count++] = c->carve;
+        c->carve += c->slot_size;
+    }
+    return m->count ? 0 : -1;
+}
+
+void *slab_alloc(SLAB_CACHE *c) {
+    SLAB_MAGAZINE *m = slab_magazine(c);
+    if (!m) return NULL;
+
+    if (m->count == 0) {
+        // Swap our empty magazine for a full one from the depot, or failing that a partly
+        // filled one, so that freed objects are reused before new slots are carved
+        pthread_mutex_lock(&c->lock);
+        SLAB_MAGAZINE *full = slab_depot_get(&c->full);
+        if (!full) full = slab_depot_get(&c->partial);
+        if (full) {
+            slab_depot_put(c, m);
+            magazines[c->id] = m = full;
+        } else if (slab_carve(c, m) == -1) {
+            pthread_mutex_unlock(&c->lock);
+            fprintf(stderr, "ERROR: Out of memory in slab cache '%s'\n", c->name);
+            return NULL;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return m->objs[--m->count];
+}
+
+void slab_free(SLAB_CACHE *c, void *obj) {
+    if (!obj) return;
+    SLAB_MAGAZINE *m = slab_magazine(c);
+    if (!m) {
+        fprintf(stderr, "ERROR: Leaking object of slab cache '%s'\n", c->name);
+        return;
+    }
+
+    if (m->count == SLAB_MAGAZINE_SIZE) {
+        // Swap our full magazine for one with room from the depot
+        pthread_mutex_lock(&c->lock);
+        slab_depot_put(c, m);
+        m = slab_depot_get(&c->empty);
+        if (!m) m = slab_depot_get(&c->partial);
+        pthread_mutex_unlock(&c->lock);
+        if (!m) {
+            m = malloc(sizeof(SLAB_MAGAZINE));
+            if (!m) {
+                magazines[c->id] = NULL;
+                fprintf(stderr, "ERROR: Leaking object of slab cache '%s'\n", c->name);
+                return;
+            }
+            m->count = 0;
+        }
+        magazines[c->id] = m;
+    }
+    m->objs[m->count++] = obj;
+}
@@ -5,103 +5,778 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #include "pbx.h" // includes tu.h already - if i try and reinclude the recursive opening breaks
+#include "tu_ext.h"
+#include "slab.h"
 #include "debug.h"
 
+#define TU_MAX_IOV 64 // notifications gathered into one sendmsg()
+#define TU_BATCH_MAX 16 // TUs whose flush can be deferred to the end of a batch
+#define TU_PARK_FACTOR 16 // a parked client is dropped once its backlog reaches this many times the limit
+#define TU_BUF_SLOT 256 // shared texts up to this size, header included, come from a slab cache
+
+// Text sent to many clients at once, such as a chat to a conference: formatted once, never changed
+// afterwards, and freed with the last queued message that refers to it
+typedef struct tu_buf {
+    atomic_int refs; // messages referring to it, plus one for whoever is still handing it out
+    int slab; // from buf_cache rather than malloc()
+    size_t len; // length of data
+    char data[];
+} TU_BUF;
+
+// A notification queued for the client of a TU
+typedef struct tu_msg {
+    struct tu_msg *next; // next queued notification
+    uint32_t gen; // generation of the TU's state it follows (see tu_notify())
+    int change; // notifies the state change that produced that generation
+    size_t len; // length of data
+    const char *data; // the notification itself: text, or the data of buf
+    TU_BUF *buf; // shared text the notification is, or NULL if it has text of its own
+    char text[]; // the notification, if it is this client's alone
+} TU_MSG;
+
+#define TU_LINE 64 // cache line size
+
 // TU structure definition
+// Fields are grouped into cache lines by who writes them, so a thread bumping the reference count of a
+// TU it dials doesn't steal the line holding the call state from the thread that owns the call.  Slab
+// slots are whole lines, so adjacent TUs never share one either.
 typedef struct tu {
+    // Taken by whoever flushes, next to what it reads; the rest is fixed once the TU is registered
+    pthread_mutex_t write_mutex; // serializes tu_flush() so queued notifications go out in order
     int fd; // File descriptor for the client connection
     int ext; // Extension number assigned to instance of TU
-    int ref_count; // Reference count for the TU, to manage lifetime
-    TU_STATE state; // Current state of the TU (what it is currently doing)
-    struct tu *peer; // Pointer to the peer TU in a call, if any
-    pthread_mutex_t mutex; // Mutex to ensure thread-safe access - or at least trying my hardest
+    TU_LINK link; // on the PBX's list of registered TUs (see tu_ext.h) - changes only as TUs come and go
+
+    // Written by any thread holding a reference, without locking
+    atomic_int ref_count __attribute__((aligned(TU_LINE))); // Reference count for the TU, to manage lifetime (no lock needed)
+
+    // Call state, changed by CAS (see tu_word()), and output queue, written under mutex
+    pthread_mutex_t mutex __attribute__((aligned(TU_LINE))); // guards the output queue - or at least trying my hardest
+    _Atomic uint64_t word; // Current state of the TU (what it is currently doing), its call and generation
+    _Atomic(struct tu *) campers; // TUs camped on this one (see camp_lock), read next to word on going on hook
+    int out_parked; // socket is full - the drain thread sends the rest when it becomes writable
+    int out_closed; // client is being dropped (1 = connection still to be shut down, 2 = done)
+    uint32_t out_gen; // generation of the last state change whose notification has been queued
+    TU_MSG *out_held; // notifications waiting for those of earlier state changes, in generation order
+    TU_MSG *out_head; // notifications queued under the lock, not yet sent (oldest first)
+    TU_MSG **out_tail; // where to append the next notification
+    size_t out_offset; // bytes of out_head already sent
+    size_t out_bytes; // bytes queued and not yet sent
+
+    // Hunt group membership (see tu_ext.h), written under the group's lock
+    _Atomic(HUNT_GROUP *) hunt __attribute__((aligned(TU_LINE))); // the group the TU answers for, or NULL
+    struct tu *hunt_next; // on the group's idle list, if hunt_idle
+    struct tu *hunt_prev;
+    int hunt_idle;
+    int conf_index; // in its conference's members, if in a conference's call - written under that call's lock
+    struct tu *wait_next; // waiting in a call queue, in the queue's call
+    struct tu *wait_prev;
+
+    // Camp-on (see tu_ext.h): TUs waiting for this one to go on hook, and the one this one waits for
+    pthread_mutex_t camp_lock __attribute__((aligned(TU_LINE))); // guards campers (longest first) and the camp_xxx links of the TUs on it
+    struct tu *campers_tail;
+    atomic_int closed; // unregistered: it is not rung, no one can camp on it, and it can't camp
+    _Atomic(struct tu *) camp_target; // the TU this one is camped on, referenced, or NULL - whoever clears it drops the camp
+    struct tu *camp_next; // on camp_target's list, if camp_linked
+    struct tu *camp_prev;
+    int camp_linked;
+    int busy_ext; // the extension that gave the TU busy signal, while it has it (else -1)
 } TU;
 
-// Helper function to send a message to the client connected to the given file descriptor
-static void notify_client(int fd, const char *message) {
-    // Write the message to the client; logs failure if write fails
-    if (fd < 0) {
-        fprintf(stderr, "ERROR: Invalid file descriptor, cannot send message: %s\n", message);
-        return; // logs and skips invalid file descriptors
+_Static_assert(sizeof(TU) % TU_LINE == 0, "TU must fill whole cache lines");
+_Static_assert(offsetof(TU, ref_count) == TU_LINE, "write_mutex and the fixed fields must fit one cache line");
+
+/*
+ * A TU's state lives in one 64-bit word, so that it changes with a single
+ * compare-and-swap: the state itself, the index of the call the TU is in
+ * (0 if none) and a generation that every change bumps, so a CAS based on
+ * an old reading of the word fails even if the state has come back to
+ * what it was.  A TU in no call changes state without taking any lock.
+ * The words of the two TUs in a call only change together, under the
+ * call's lock.
+ */
+#define TU_CALL_SHIFT 8
+#define TU_GEN_SHIFT 40
+#define TU_GEN_MASK 0xffffffu // generations are 24 bits and wrap around
+
+static inline uint64_t tu_word(TU_STATE state, uint32_t call, uint32_t gen) {
+    return (uint64_t)state | (uint64_t)call << TU_CALL_SHIFT | (uint64_t)(gen & TU_GEN_MASK) << TU_GEN_SHIFT;
+}
+
+static inline TU_STATE word_state(uint64_t w) {
+    return w & 0xff;
+}
+
+static inline uint32_t word_call(uint64_t w) {
+    return (uint32_t)(w >> TU_CALL_SHIFT);
+}
+
+static inline uint32_t word_gen(uint64_t w) {
+    return w >> TU_GEN_SHIFT;
+}
+
+// The word for the next change of a TU whose word is now w
+static inline uint64_t word_next(uint64_t w, TU_STATE state, uint32_t call) {
+    return tu_word(state, call, word_gen(w) + 1);
+}
+
+// Whether generation a is later than generation b, allowing for wraparound
+static inline int gen_after(uint32_t a, uint32_t b) {
+    uint32_t d = (a - b) & TU_GEN_MASK;
+    return d != 0 && d <= TU_GEN_MASK / 2;
+}
+
+// Change the word of a TU from *w to n, unless someone else changed it first (then *w is reloaded)
+static inline int tu_commit(TU *tu, uint64_t *w, uint64_t n) {
+    return atomic_compare_exchange_strong_explicit(&tu->word, w, n, memory_order_acq_rel, memory_order_acquire);
+}
+
+// A call between two TUs, or the call of a conference.  Its lock guards the words of the TUs in it.
+typedef struct call {
+    pthread_mutex_t lock;
+    TU *leg[2]; // the calling TU and the called one, each referenced for as long as the call lasts
+    CONFERENCE *conf; // the conference whose call this is (leg[] unused), or NULL
+    HUNT_GROUP *hunt; // the call queue whose waiting callers are in this call (leg[] unused), or NULL
+    uint32_t index; // names the call in the words of its TUs, fixed for the life of the slot (0 if none)
+} CALL;
+
+// A hunt group: calls to its number ring the member that has been idle longest.  Its call's lock
+// guards the idle list, the waiting list and the hunt_xxx and wait_xxx fields of the TUs on them.
+struct hunt_group {
+    CALL *call; // the callers waiting in a call queue are in it
+    int number; // the number dialed to reach a member
+    int queue; // callers wait for a member to be free, rather than get busy signal
+    TU *idle_head; // members on hook, longest idle first (linked through hunt_next/hunt_prev)
+    TU *idle_tail;
+    TU *wait_head; // callers waiting, longest first (linked through wait_next/wait_prev)
+    TU *wait_tail;
+    int nwaiting;
+};
+
+// A conference room: TUs join it by dialing its number and are CONNECTED to it until they hang up.
+// Its call's lock guards the member list.
+struct conference {
+    CALL *call;
+    int number; // the number dialed to join, reported as the peer of every member
+    int nmembers;
+    int size; // capacity of members, grown as members join and never shrunk
+    TU **members; // in no particular order (each knows its index), each referenced while a member
+};
+
+#define CALL_PAGE_SIZE 1024 // calls per page of the index
+#define CALL_PAGES 4096 // so no more than four million calls can be in progress at once
+
+// TU objects come from a slab cache rather than malloc(), as connections come and go all the time
+static SLAB_CACHE *tu_cache;
+
+// Messages referring to shared text are all the same size, and one is queued per conference member per chat
+static SLAB_CACHE *msg_cache;
+
+// Shared texts short enough for a slot, as nearly every chat and page is
+static SLAB_CACHE *buf_cache;
+
+// Conference members a chat has queued for and flushes once the room's lock is dropped, referenced.
+// The room's own array can change as soon as the lock is, so each thread keeps one, grown to the
+// largest room it has chatted in.
+static __thread TU **chat_tus;
+static __thread int chat_tus_size;
+static pthread_key_t chat_tus_key; // frees the array when the thread exits
+static pthread_once_t chat_tus_once = PTHREAD_ONCE_INIT;
+
+static void chat_tus_key_init(void) {
+    pthread_key_create(&chat_tus_key, free);
+}
+
+// Calls are type-stable: a thread that read a TU's word just before the call ended may still lock
+// the call's mutex, so the mutex has to stay a mutex (see tu_call_lock()), and the index stays valid
+static SLAB_CACHE *call_cache;
+
+// Calls by index, filled in as the slab cache carves slots for them
+static _Atomic(CALL **) call_pages[CALL_PAGES];
+static atomic_uint ncalls = 1; // index 0 means no call
+
+static void call_init(void *obj) {
+    CALL *call = obj;
+    pthread_mutex_init(&call->lock, NULL);
+    call->conf = NULL;
+    call->hunt = NULL;
+    call->index = 0;
+
+    unsigned i = atomic_fetch_add(&ncalls, 1);
+    if (i >= CALL_PAGES * CALL_PAGE_SIZE) return; // out of indexes
+
+    CALL **page = atomic_load_explicit(&call_pages[i / CALL_PAGE_SIZE], memory_order_acquire);
+    if (!page) {
+        CALL **fresh = calloc(CALL_PAGE_SIZE, sizeof(CALL *));
+        if (!fresh) return;
+        if (atomic_compare_exchange_strong(&call_pages[i / CALL_PAGE_SIZE], &page, fresh)) {
+            page = fresh;
+        } else {
+            free(fresh); // another thread got there first
+        }
     }
+    page[i % CALL_PAGE_SIZE] = call; // seen by others only via a TU word stored after the call is handed out
+    call->index = i;
+}
 
-    if (write(fd, message, strlen(message)) < 0) {
-        fprintf(stderr, "ERROR: Failed to write to client on fd (%d) with message: %s", fd, message);
-        close(fd); // close file descriptor if write fails
+__attribute__((constructor))
+static void tu_cache_init(void) {
+    tu_cache = slab_cache_create("TU", sizeof(TU));
+    msg_cache = slab_cache_create("TU message", sizeof(TU_MSG));
+    buf_cache = slab_cache_create("TU text", TU_BUF_SLOT);
+    call_cache = slab_cache_create_typesafe("call", sizeof(CALL), call_init);
+}
+
+static CALL *call_lookup(uint32_t index) {
+    CALL **page = atomic_load_explicit(&call_pages[index / CALL_PAGE_SIZE], memory_order_acquire);
+    return page[index % CALL_PAGE_SIZE];
+}
+
+// Get a call that can be named in a TU's word
+static CALL *call_alloc(void) {
+    CALL *call = slab_alloc(call_cache);
+    if (call && !call->index) {
+        fprintf(stderr, "ERROR: Too many calls in progress\n");
+        return NULL; // kept out of circulation for good
     }
+    return call;
 }
 
-void notify_client_of_tu_state(TU *tu) {
-    char buffer[64]; // Sufficient size to hold dynamically constructed messages
+// The other TU in a call - caller holds the call's lock
+static TU *call_peer(CALL *call, TU *tu) {
+    return call->leg[call->leg[0] == tu];
+}
+
+// What a TU in a call is connected to: its peer's extension, or the conference's number - caller holds the call's lock
+static int call_peer_ext(CALL *call, TU *tu) {
+    if (call->conf) return call->conf->number;
+    if (call->hunt) return call->hunt->number; // waiting in a call queue - not reported
+    return call_peer(call, tu)->ext;
+}
+
+/*
+ * Lock the call a TU is in, as of word w.  The words of TUs in a call only
+ * change under the call's lock, so if the TU's word is still w once the
+ * lock is held, the call and both its TUs stay as they are until it is
+ * released.
+ *
+ * @return the call, locked, or NULL if the TU's word has changed.
+ */
+static CALL *tu_call_lock(TU *tu, uint64_t w) {
+    CALL *call = call_lookup(word_call(w));
+    pthread_mutex_lock(&call->lock);
+    if (atomic_load_explicit(&tu->word, memory_order_acquire) == w) return call;
+    pthread_mutex_unlock(&call->lock);
+    return NULL; // it joined or left a call while we waited
+}
+
+// Slow-consumer handling (see tu_ext.h)
+static size_t output_limit = TU_OUTPUT_LIMIT_DEFAULT;
+static TU_OUTPUT_POLICY output_policy = TU_OUTPUT_DROP_CHAT;
+
+// epoll instance on which the drain thread waits for parked TUs to become writable
+static int drain_epfd = -1;
+static pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+
+static void tu_flush(TU *tu);
+
+// Backend-specific send path for the current thread, if any (see tu_ext.h)
+__thread int (*tu_send_hook)(int fd, const struct iovec *iov, int iovcnt);
+__thread size_t (*tu_backlog_hook)(int fd);
+int (*tu_post_hook)(TU *tu);
+
+// Batch of commands being carried out by the current thread (see tu_ext.h)
+static __thread int batch_depth; // nesting of tu_batch_begin()
+static __thread TU *batch_tus[TU_BATCH_MAX]; // TUs with output held back until the batch ends (referenced)
+static __thread int batch_ntus;
+
+/*
+ * Set the limit on output queued for each client and what happens to a
+ * client that reaches it.
+ */
+void tu_set_output_limit(size_t limit, TU_OUTPUT_POLICY policy) {
+    output_limit = limit;
+    output_policy = policy;
+}
 
-    TU_STATE state = tu->state;
-    // fprintf(stderr, "tu state: %d\n", tu->state);
+// Allocate a message with len bytes of text of its own
+static TU_MSG *tu_msg_new(size_t len) {
+    TU_MSG *msg = malloc(sizeof(TU_MSG) + len);
+    if (!msg) return NULL;
+    msg->len = len;
+    msg->data = msg->text;
+    msg->buf = NULL;
+    return msg;
+}
+
+// Allocate shared text of len bytes, with the one reference of whoever hands it out
+static TU_BUF *tu_buf_new(size_t len) {
+    TU_BUF *buf;
+    if (sizeof(TU_BUF) + len <= TU_BUF_SLOT && (buf = slab_alloc(buf_cache))) {
+        buf->slab = 1;
+    } else {
+        buf = malloc(sizeof(TU_BUF) + len);
+        if (!buf) return NULL;
+        buf->slab = 0;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    return buf;
+}
+
+static void tu_buf_unref(TU_BUF *buf) {
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        if (buf->slab) slab_free(buf_cache, buf);
+        else free(buf);
+    }
+}
+
+static void tu_msg_free(TU_MSG *msg) {
+    if (msg->buf) {
+        tu_buf_unref(msg->buf);
+        slab_free(msg_cache, msg);
+    } else {
+        free(msg);
+    }
+}
+
+// Free a chain of messages
+static void tu_free_msgs(TU_MSG *msg) {
+    while (msg) {
+        TU_MSG *next = msg->next;
+        tu_msg_free(msg);
+        msg = next;
+    }
+}
 
-    switch (state) {
+// Discard everything queued for the client of a TU and drop the client - caller must hold tu->mutex
+static void tu_drop_output(TU *tu) {
+    tu_free_msgs(tu->out_head);
+    tu_free_msgs(tu->out_held);
+    tu->out_head = NULL;
+    tu->out_held = NULL;
+    tu->out_tail = &tu->out_head;
+    tu->out_offset = 0;
+    tu->out_bytes = 0;
+    if (!tu->out_closed) tu->out_closed = 1; // the connection is shut down on the next flush
+}
+
+// Check whether len more bytes can be queued for the client of a TU - caller must hold tu->mutex
+// A single line longer than the limit is still accepted when nothing else is waiting
+static int tu_output_fits(TU *tu, size_t len) {
+    size_t limit = output_limit;
+    if (output_policy == TU_OUTPUT_PARK) limit *= TU_PARK_FACTOR;
+    size_t queued = tu->out_bytes;
+    if (tu_backlog_hook) queued += tu_backlog_hook(tu->fd); // taken by the I/O backend but not yet sent
+    return queued == 0 || queued + len <= limit;
+}
+
+// Append a message to the queue of a TU, or drop the client if it is too far behind - caller must hold tu->mutex
+static void tu_append(TU *tu, TU_MSG *msg) {
+    if (tu->out_closed) { // client is being dropped - nothing more to tell it
+        tu_msg_free(msg);
+        return;
+    }
+
+    if (!tu_output_fits(tu, msg->len)) {
+        fprintf(stderr, "ERROR: Client on fd (%d) is not reading its notifications, disconnecting\n", tu->fd);
+        tu_msg_free(msg);
+        tu_drop_output(tu);
+        return;
+    }
+
+    msg->next = NULL;
+    *tu->out_tail = msg;
+    tu->out_tail = &msg->next;
+    tu->out_bytes += msg->len;
+}
+
+// Whether a message can be queued yet: the notification of a change once that of the change before
+// it has been, anything else once the change it follows has been - caller must hold tu->mutex
+static int tu_msg_due(TU *tu, TU_MSG *msg) {
+    if (msg->change) return msg->gen == ((tu->out_gen + 1) & TU_GEN_MASK);
+    return !gen_after(msg->gen, tu->out_gen);
+}
+
+// Append a message to the queue of a TU once it is due, with any held back messages that
+// become due with it - caller must hold tu->mutex
+// Nothing is written until tu_flush() is called after the locks have been dropped
+static void tu_queue(TU *tu, TU_MSG *msg) {
+    if (tu->out_closed) {
+        tu_msg_free(msg);
+        return;
+    }
+
+    if (!tu_msg_due(tu, msg)) { // hold it back, ahead of anything that must follow it
+        TU_MSG **pp = &tu->out_held;
+        while (*pp && !gen_after((*pp)->gen, msg->gen) && ((*pp)->gen != msg->gen || (*pp)->change || !msg->change)) {
+            pp = &(*pp)->next;
+        }
+        msg->next = *pp;
+        *pp = msg;
+        return;
+    }
+
+    for (;;) {
+        if (msg->change) tu->out_gen = msg->gen;
+        tu_append(tu, msg);
+
+        msg = tu->out_held;
+        if (!msg || !tu_msg_due(tu, msg)) break;
+        tu->out_held = msg->next;
+    }
+}
+
+/*
+ * Queue a notification of the state of a TU as of word w, peer_ext being
+ * the extension of its peer if it is connected.  If change is set, this is
+ * the notification of the change that produced w; otherwise it repeats the
+ * state, as the reply to a command that changed nothing.  Changes are
+ * committed before they are notified, so threads may get here in another
+ * order than they made their changes; the generations put the
+ * notifications back in order.
+ *
+ * @return 0 if queued, or -1 if a repeat is out of date because a later
+ * change has been notified already (it should be made again from the
+ * current word).
+ */
+static int tu_notify(TU *tu, uint64_t w, int peer_ext, int change) {
+    char buffer[64]; // Sufficient size to hold dynamically constructed messages
+    int len;
+
+    switch (word_state(w)) {
         case TU_ON_HOOK:
-            // Construct message with the current TU's file descriptor
-            snprintf(buffer, sizeof(buffer), "ON HOOK %d\r\n", tu->fd);
+            // Construct message with the TU's own extension number
+            len = snprintf(buffer, sizeof(buffer), "%s %d%s", tu_state_names[TU_ON_HOOK], tu->ext, EOL);
             break;
 
         case TU_CONNECTED:
             // Construct message with the peer's extension number
-            snprintf(buffer, sizeof(buffer), "CONNECTED %d\r\n", tu->peer->ext);
+            len = snprintf(buffer, sizeof(buffer), "%s %d%s", tu_state_names[TU_CONNECTED], peer_ext, EOL);
             break;
 
         default:
-            // Use static messages for other states
-            {
-                static const char *state_messages[] = {
-                    "ON_HOOK\r\n", // placholder for matching never returned (matched first case above)
-                    "RINGING\r\n",
-                    "DIAL_TONE\r\n",
-                    "RING_BACK\r\n",
-                    "BUSY_SIGNAL\r\n",
-                    "CONNECTED\r\n", // placeholder for matching never returned (matched second case above)
-                    "ERROR\r\n"
-                };
-                strncpy(buffer, state_messages[state], sizeof(buffer) - 1);
-                buffer[sizeof(buffer) - 1] = '\0'; // Ensure null termination
-            }
+            len = snprintf(buffer, sizeof(buffer), "%s%s", tu_state_names[word_state(w)], EOL);
             break;
     }
-    // Notify the client of the constructed message
-    notify_client(tu->fd, buffer);
+
+    TU_MSG *msg = tu_msg_new(len);
+    pthread_mutex_lock(&tu->mutex);
+    if (!msg) {
+        fprintf(stderr, "ERROR: Failed to queue message for client on fd (%d)\n", tu->fd);
+        if (change) tu_drop_output(tu); // a lost change would hold back every later notification
+        pthread_mutex_unlock(&tu->mutex);
+        return 0;
+    }
+    if (!change && gen_after(tu->out_gen, word_gen(w))) {
+        pthread_mutex_unlock(&tu->mutex);
+        tu_msg_free(msg);
+        return -1;
+    }
+    msg->gen = word_gen(w);
+    msg->change = change;
+    memcpy(msg->text, buffer, len);
+    tu_queue(tu, msg);
+    pthread_mutex_unlock(&tu->mutex);
+    return 0;
 }
 
-// PREVENT DEADLOCKS when working with multiple tu objects simulataneously in multithreads
-// deadlock is when threads acquire locks on same set of resources in different orders
-// function wrapper for safe mutex lock with multithreading with multiple tu objects
-void safe_mutex_lock(TU *tu1, TU *tu2) { // use functions to ensure consistent behavior across functions that interact w/ mutliple tus
-    // guarantees no matter which thread locking tus, order will always be the same
+// Repeat the current state of a TU to its client, as the reply to a command that changed nothing
+static void tu_notify_current(TU *tu) {
+    for (;;) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
+        int peer_ext = -1;
+        if (word_call(w)) { // a word naming a call only counts once the call's lock confirms it (see tu_dial())
+            CALL *call = tu_call_lock(tu, w);
+            if (!call) continue;
+            peer_ext = call_peer_ext(call, tu);
+            pthread_mutex_unlock(&call->lock);
+        }
+        if (tu_notify(tu, w, peer_ext, 0) == 0) return;
+    }
+}
 
-    // fprintf(stderr, "safe mutex lock\n");
+/*
+ * Send as much of a chain of queued messages to the client as the socket
+ * will take without blocking, with as few system calls as possible.
+ * Messages sent completely are freed; *msgp and *offsetp are left
+ * describing whatever is still to be sent.
+ *
+ * @return the number of bytes sent, or -1 if the connection has failed.
+ */
+static ssize_t write_messages(int fd, TU_MSG **msgp, size_t *offsetp) {
+    TU_MSG *msg = *msgp;
+    size_t offset = *offsetp; // bytes of the first message already sent
+    ssize_t total = 0;
+
+    if (tu_send_hook && offset == 0) { // hand them to the I/O backend driving this thread
+        while (msg && tu_send_hook(fd, &(struct iovec){ (char *)msg->data, msg->len }, 1) == 0) {
+            TU_MSG *next = msg->next;
+            total += msg->len;
+            tu_msg_free(msg);
+            msg = next;
+        }
+    }
 
-    if (tu1 < tu2) { // if both threads hold respective first locks, neither can proceed to acquire second lock resulting in deadlock
-        pthread_mutex_lock(&tu1->mutex);
-        pthread_mutex_lock(&tu2->mutex);
-    } else { // acquires lock in consistent address order
-        pthread_mutex_lock(&tu2->mutex);
-        pthread_mutex_lock(&tu1->mutex);
+    while (msg) {
+        struct iovec iov[TU_MAX_IOV];
+        int iovcnt = 0;
+        for (TU_MSG *m = msg; m && iovcnt < TU_MAX_IOV; m = m->next, iovcnt++) {
+            iov[iovcnt].iov_base = (char *)m->data;
+            iov[iovcnt].iov_len = m->len;
+        }
+        iov[0].iov_base = (char *)msg->data + offset;
+        iov[0].iov_len = msg->len - offset;
+
+        // The socket itself stays blocking for the reader; only our sends must never wait
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t written = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break; // socket full - keep the rest
+            total = -1;
+            break;
+        }
+
+        // Release the messages that went out completely
+        total += written;
+        offset += written;
+        while (msg && offset >= msg->len) {
+            TU_MSG *next = msg->next;
+            offset -= msg->len;
+            tu_msg_free(msg);
+            msg = next;
+        }
     }
-} // ensures state transitions and client interactions are synchronized across threads
 
-// function wrapper for safe mutex unlock - therefore mutexes are always acquired in the same order
-// locks must be acquired in consistent, deterministic order
-void safe_mutex_unlock(TU *tu1, TU *tu2) { // conditions based on memory address - always same order
+    *msgp = msg;
+    *offsetp = offset;
+    return total;
+}
 
-    // fprintf(stderr, "safe mutex unlock\n");
+/*
+ * Send what is queued for the client of a TU.  The caller must hold
+ * tu->write_mutex but not tu->mutex.  Unless draining, nothing is sent
+ * while the TU is parked, since the drain thread owns its output then.
+ *
+ * @return 1 if output is left over and the TU is parked (when draining:
+ * remains parked), otherwise 0.
+ */
+static int tu_send_queue(TU *tu, int draining) {
+    pthread_mutex_lock(&tu->mutex);
+    if (tu->out_parked && !draining) {
+        pthread_mutex_unlock(&tu->mutex);
+        return 0;
+    }
+    int hangup = tu->out_closed == 1;
+    if (hangup) tu->out_closed = 2;
+    TU_MSG *msg = tu->out_head;
+    size_t offset = tu->out_offset;
+    tu->out_head = NULL;
+    tu->out_tail = &tu->out_head;
+    pthread_mutex_unlock(&tu->mutex);
 
-    if (tu1 < tu2) { // release locks in same order as acquired
-        pthread_mutex_unlock(&tu1->mutex);
-        pthread_mutex_unlock(&tu2->mutex);
+    if (hangup) { // drop the client - the fd itself is closed by the TU that owns it
+        shutdown(tu->fd, SHUT_RDWR);
+    }
+
+    ssize_t sent = msg ? write_messages(tu->fd, &msg, &offset) : 0;
+
+    pthread_mutex_lock(&tu->mutex);
+    if (sent < 0) {
+        fprintf(stderr, "ERROR: Failed to write to client on fd (%d)\n", tu->fd);
+        if (!tu->out_closed) tu->out_closed = 2;
+        shutdown(tu->fd, SHUT_RDWR);
+        tu_drop_output(tu);
+        tu_free_msgs(msg); // undeliverable
+    } else if (tu->out_closed) { // dropped while we were sending
+        tu_free_msgs(msg);
+    } else {
+        tu->out_bytes -= sent;
+        if (msg) { // put back what the socket would not take, ahead of anything queued since
+            TU_MSG *last = msg;
+            while (last->next) last = last->next;
+            last->next = tu->out_head;
+            if (!tu->out_head) tu->out_tail = &last->next;
+            tu->out_head = msg;
+            tu->out_offset = offset;
+        } else {
+            tu->out_offset = 0;
+        }
+    }
+    int parked = tu->out_parked;
+    tu->out_parked = tu->out_head != NULL && !tu->out_closed;
+    int ret = draining ? tu->out_parked : tu->out_parked && !parked;
+    pthread_mutex_unlock(&tu->mutex);
+
+    return ret;
+}
+
+// Drain thread: sends the output of parked TUs as their sockets become writable
+static void *tu_drain_thread(void *arg) {
+    struct epoll_event events[64];
+
+    while (1) {
+        int n = epoll_wait(drain_epfd, events, 64, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ERROR: drain thread failed waiting for writable clients\n");
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            TU *tu = events[i].data.ptr;
+
+            if (tu_post_hook) { // the backend owns the socket: unpark the TU and let it send the rest
+                pthread_mutex_lock(&tu->write_mutex);
+                epoll_ctl(drain_epfd, EPOLL_CTL_DEL, tu->fd, NULL);
+                pthread_mutex_lock(&tu->mutex);
+                tu->out_parked = 0;
+                pthread_mutex_unlock(&tu->mutex);
+                pthread_mutex_unlock(&tu->write_mutex);
+
+                tu_flush(tu); // handed to the backend through tu_post_hook
+                tu_unref(tu, "Output drained");
+                continue;
+            }
+
+            pthread_mutex_lock(&tu->write_mutex);
+            int parked = tu_send_queue(tu, 1);
+            if (parked) {
+                struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = tu };
+                if (epoll_ctl(drain_epfd, EPOLL_CTL_MOD, tu->fd, &ev) == -1) {
+                    pthread_mutex_lock(&tu->mutex);
+                    tu_drop_output(tu);
+                    tu->out_parked = 0;
+                    pthread_mutex_unlock(&tu->mutex);
+                    parked = 0;
+                }
+            }
+            if (!parked) {
+                epoll_ctl(drain_epfd, EPOLL_CTL_DEL, tu->fd, NULL);
+            }
+            pthread_mutex_unlock(&tu->write_mutex);
+
+            if (!parked) {
+                tu_flush(tu); // anything dropped still needs the connection shut down
+                tu_unref(tu, "Output drained");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void tu_drain_start(void) {
+    drain_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (drain_epfd == -1) return;
+
+    // Signals are for the master server thread only
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, tu_drain_thread, NULL) == 0) {
+        pthread_detach(tid);
     } else {
-        pthread_mutex_unlock(&tu2->mutex);
-        pthread_mutex_unlock(&tu1->mutex);
+        close(drain_epfd);
+        drain_epfd = -1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Hand a TU whose socket is full to the drain thread, which holds a reference until it is drained
+// Caller must hold tu->write_mutex
+static void tu_park(TU *tu) {
+    pthread_once(&drain_once, tu_drain_start);
+
+    tu_ref(tu, "Output parked");
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = tu };
+    if (drain_epfd == -1 || epoll_ctl(drain_epfd, EPOLL_CTL_ADD, tu->fd, &ev) == -1) {
+        fprintf(stderr, "ERROR: Failed to park output for client on fd (%d)\n", tu->fd);
+        pthread_mutex_lock(&tu->mutex);
+        tu_drop_output(tu);
+        tu->out_parked = 0;
+        pthread_mutex_unlock(&tu->mutex);
+        tu_send_queue(tu, 0); // shut the connection down
+        tu_unref(tu, "Output parked");
+    }
+}
+
+/*
+ * Send the notifications queued for a TU's client.  Called after the locks
+ * under which they were queued have been dropped, so that no system call
+ * is made inside a critical section.  Whoever takes the queue first writes
+ * it first, so notifications reach the client in the order they were queued.
+ * Sends never block: whatever the socket will not take stays queued and the
+ * TU is parked until the drain thread finds the socket writable again.
+ * Outside the thread of a backend that owns the sockets, the TU is handed
+ * to the backend instead (see tu_post_hook).
+ */
+static void tu_flush_now(TU *tu) {
+    if (!tu_send_hook && tu_post_hook && tu_post_hook(tu) == 0) return; // sent from the backend's thread
+
+    pthread_mutex_lock(&tu->write_mutex);
+    if (tu_send_queue(tu, 0)) {
+        tu_park(tu);
+    }
+    pthread_mutex_unlock(&tu->write_mutex);
+}
+
+// Flush a TU now, or at the end of the batch the current thread is carrying out
+static void tu_flush(TU *tu) {
+    if (batch_depth) {
+        for (int i = 0; i < batch_ntus; i++) {
+            if (batch_tus[i] == tu) return; // already due to be flushed
+        }
+        if (batch_ntus < TU_BATCH_MAX) {
+            tu_ref(tu, "Batched flush");
+            batch_tus[batch_ntus++] = tu;
+            return;
+        }
+    }
+    tu_flush_now(tu);
+}
+
+/*
+ * Send the output queued for a TU handed to a backend (see tu_ext.h).
+ */
+void tu_send_output(TU *tu) {
+    tu_flush_now(tu);
+}
+
+/*
+ * Begin a batch of operations (see tu_ext.h).
+ */
+void tu_batch_begin(void) {
+    batch_depth++;
+}
+
+/*
+ * End a batch of operations, sending everything it queued: one write per
+ * client, however many notifications the batch produced for it.
+ */
+void tu_batch_end(void) {
+    if (--batch_depth > 0) return;
+
+    for (int i = 0; i < batch_ntus; i++) {
+        tu_flush_now(batch_tus[i]);
+        tu_unref(batch_tus[i], "Batched flush");
     }
+    batch_ntus = 0;
 }
 
 /*
@@ -112,28 +787,43 @@ void safe_mutex_unlock(TU *tu1, TU *tu2) { // conditions based on memory address
  * was successful, otherwise NULL.
  */
 TU *tu_init(int fd) {
-    TU *tu = malloc(sizeof(TU)); // Allocate memory for the TU - gotta make sure to manage this to free it later
+    TU *tu = slab_alloc(tu_cache); // Allocate memory for the TU - gotta make sure to manage this to free it later
     if (!tu) { // Check for memory allocation failure
         return NULL;
     }
 
-    pthread_mutex_lock(&tu->mutex);
-
     tu->fd = fd; // Set file descriptor for the TU
-    // tu->ext = -1; // Initialize extension number to -1 (unset)
-    tu->ext = fd;
-    tu->ref_count = 1; // Set initial reference count to 1
-    tu->state = TU_ON_HOOK; // Initialize state to ON_HOOK
-    tu->peer = NULL; // No peer connected initially
+    tu->ext = -1; // Initialize extension number to -1 (unset) - the PBX assigns it on registration
+    atomic_init(&tu->ref_count, 1); // Set initial reference count to 1
+    atomic_init(&tu->word, tu_word(TU_ON_HOOK, 0, 0)); // Initialize state to ON_HOOK, in no call
+    tu->out_gen = 0;
+    tu->out_held = NULL;
+    tu->out_head = NULL; // Nothing queued for the client yet
+    tu->out_tail = &tu->out_head;
+    tu->out_offset = 0;
+    tu->out_bytes = 0;
+    tu->out_parked = 0;
+    tu->out_closed = 0;
+    tu->link.next = NULL; // not on any list until registered
+    tu->link.prev = NULL;
+    atomic_init(&tu->hunt, NULL); // in no hunt group unless the PBX puts it in one
+    tu->hunt_next = tu->hunt_prev = NULL;
+    tu->hunt_idle = 0;
+    tu->conf_index = -1;
+    tu->wait_next = tu->wait_prev = NULL;
+    atomic_init(&tu->campers, NULL);
+    tu->campers_tail = NULL;
+    atomic_init(&tu->closed, 0);
+    atomic_init(&tu->camp_target, NULL);
+    tu->camp_next = tu->camp_prev = NULL;
+    tu->camp_linked = 0;
+    tu->busy_ext = -1;
 
     pthread_mutex_init(&tu->mutex, NULL); // Initialize the mutex
+    pthread_mutex_init(&tu->write_mutex, NULL);
+    pthread_mutex_init(&tu->camp_lock, NULL);
 
-    char buffer [15];
-    snprintf(buffer, 15, "ON HOOK %d\r\n", fd);
-    notify_client(fd, buffer); // Notify the client of the initial state
-
-    pthread_mutex_unlock(&tu->mutex);
-
+    // The client is first notified by tu_set_extension(), once it has a number to report
     return tu;
 }
 
@@ -145,7 +835,8 @@ TU *tu_init(int fd) {
  * (for debugging purposes).
  */
 void tu_ref(TU *tu, char *reason) {
-    tu->ref_count++; // Increment reference count
+    // Relaxed is enough: a new reference is always made from one already held
+    atomic_fetch_add_explicit(&tu->ref_count, 1, memory_order_relaxed); // Increment reference count
     // fprintf(stderr, "TU reference count incremented: %s (count=%d)\n", reason, tu->ref_count); // Log the operation
 }
 
@@ -159,31 +850,17 @@ void tu_ref(TU *tu, char *reason) {
 void tu_unref(TU *tu, char *reason) {
     if (!tu) return;
 
-    pthread_mutex_lock(&tu->mutex);
-    tu->ref_count--; // Decrement reference count
-    int ref_count = tu->ref_count;
-    pthread_mutex_unlock(&tu->mutex);
+    // Release: our last accesses to the TU happen before whoever frees it.
+    // Acquire (on the final release only): the freeing thread sees all of theirs.
+    int ref_count = atomic_fetch_sub_explicit(&tu->ref_count, 1, memory_order_release) - 1;
 
     if (ref_count == 0) { // If reference count reaches 0
+        atomic_thread_fence(memory_order_acquire);
         // fprintf(stderr, "Freeing TU resources: %s\n", reason);
+        // No call to clean up: a peer holds a reference to us for as long as the call lasts
 
-        if (tu->peer) { // if peer exists
-
-            pthread_mutex_lock(&tu->peer->mutex);
-
-            tu->peer->state = TU_ON_HOOK; // reset peer state
-
-            char buffer [15];
-            snprintf(buffer, 15, "ON HOOK %d\r\n", tu->peer->fd);
-            notify_client(tu->peer->fd, buffer); // Notify the client of the initial state
-
-            tu_unref(tu->peer, "Peer disconnected during cleanup"); // unref peer
-            tu->peer->peer = NULL;
-            tu->peer = NULL;
-
-            pthread_mutex_unlock(&tu->peer->mutex);
-
-        }
+        tu_free_msgs(tu->out_head); // drop anything never sent
+        tu_free_msgs(tu->out_held);
 
         if (tu->fd >= 0) { // close file descriptor if valid
             close(tu->fd);
@@ -191,7 +868,9 @@ void tu_unref(TU *tu, char *reason) {
         }
 
         pthread_mutex_destroy(&tu->mutex);
-        free(tu); // Free the TU memory
+        pthread_mutex_destroy(&tu->write_mutex);
+        pthread_mutex_destroy(&tu->camp_lock);
+        slab_free(tu_cache, tu); // Free the TU memory
     }
 }
 
@@ -208,6 +887,13 @@ int tu_fileno(TU *tu) {
     return tu->fd; // returns tu file descriptor (by default it is -1)
 }
 
+/*
+ * Get the links by which a TU is kept on a list (see tu_ext.h).
+ */
+TU_LINK *tu_link(TU *tu) {
+    return &tu->link;
+}
+
 /*
  * Get the extension number for a TU.
  * This extension number is assigned by the PBX when a TU is registered
@@ -237,14 +923,432 @@ int tu_set_extension(TU *tu, int ext) {
     }
 
     tu->ext = ext; // Set the extension number
+    tu_notify_current(tu); // Notify the client of the initial state
+    tu_flush(tu);
 
-    char buffer [15];
-    snprintf(buffer, 15, "ON HOOK %d\r\n", tu->ext);
-    notify_client(tu->fd, buffer); // Notify the client of the initial state
+    return 0;
+}
 
+// Add a TU to the members of a conference - caller holds the conference's call's lock
+static int conference_add(CONFERENCE *conf, TU *tu) {
+    if (conf->nmembers == conf->size) {
+        int size = conf->size ? conf->size * 2 : 8;
+        TU **members = realloc(conf->members, size * sizeof(TU *));
+        if (!members) return -1;
+        conf->members = members;
+        conf->size = size;
+    }
+    tu->conf_index = conf->nmembers;
+    conf->members[conf->nmembers++] = tu;
     return 0;
 }
 
+// Take a TU off the members of a conference, moving the last member into its place - caller holds
+// the conference's call's lock
+static void conference_remove(CONFERENCE *conf, TU *tu) {
+    TU *last = conf->members[--conf->nmembers];
+    conf->members[tu->conf_index] = last;
+    last->conf_index = tu->conf_index;
+}
+
+// Put a member at the back of its hunt group's idle list - caller holds the group's lock
+static void hunt_append(HUNT_GROUP *group, TU *tu) {
+    tu->hunt_next = NULL;
+    tu->hunt_prev = group->idle_tail;
+    if (group->idle_tail) group->idle_tail->hunt_next = tu;
+    else group->idle_head = tu;
+    group->idle_tail = tu;
+    tu->hunt_idle = 1;
+}
+
+// Take a member off its hunt group's idle list - caller holds the group's lock
+static void hunt_unlink(HUNT_GROUP *group, TU *tu) {
+    if (tu->hunt_prev) tu->hunt_prev->hunt_next = tu->hunt_next;
+    else group->idle_head = tu->hunt_next;
+    if (tu->hunt_next) tu->hunt_next->hunt_prev = tu->hunt_prev;
+    else group->idle_tail = tu->hunt_prev;
+    tu->hunt_next = tu->hunt_prev = NULL;
+    tu->hunt_idle = 0;
+}
+
+// Put a caller at the back of a call queue - caller holds the group's lock
+static void hunt_wait_append(HUNT_GROUP *group, TU *tu) {
+    tu->wait_next = NULL;
+    tu->wait_prev = group->wait_tail;
+    if (group->wait_tail) group->wait_tail->wait_next = tu;
+    else group->wait_head = tu;
+    group->wait_tail = tu;
+    group->nwaiting++;
+}
+
+// Take a caller out of a call queue - caller holds the group's lock
+static void hunt_wait_unlink(HUNT_GROUP *group, TU *tu) {
+    if (tu->wait_prev) tu->wait_prev->wait_next = tu->wait_next;
+    else group->wait_head = tu->wait_next;
+    if (tu->wait_next) tu->wait_next->wait_prev = tu->wait_prev;
+    else group->wait_tail = tu->wait_prev;
+    tu->wait_next = tu->wait_prev = NULL;
+    group->nwaiting--;
+}
+
+/*
+ * Tell a caller that has just joined a call queue, as of its word w, its
+ * place in the queue.  The line follows the caller's RING BACK whatever
+ * order the two are queued in.
+ */
+static void hunt_queued(TU *tu, uint64_t w, int position) {
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "QUEUED %d%s", position, EOL);
+    TU_MSG *msg = tu_msg_new(len);
+    if (!msg) {
+        fprintf(stderr, "ERROR: Failed to queue message for client on fd (%d)\n", tu->fd);
+        return;
+    }
+    msg->gen = word_gen(w);
+    msg->change = 0;
+    memcpy(msg->text, buffer, len);
+
+    pthread_mutex_lock(&tu->mutex);
+    tu_queue(tu, msg);
+    pthread_mutex_unlock(&tu->mutex);
+}
+
+/*
+ * Ring a member of a call queue that has just gone on hook for the caller
+ * that has waited longest, as tu_ring() would have had the member been
+ * idle when the caller dialed.  The caller holds the group's lock, which
+ * is released here.  If the member is no longer on hook, the caller stays
+ * at the head of the queue: whatever took the member off hook syncs it
+ * again when it is back.
+ */
+static void hunt_serve(HUNT_GROUP *group, TU *agent) {
+    TU *waiter = group->wait_head;
+    uint64_t ww = atomic_load_explicit(&waiter->word, memory_order_relaxed); // stable under the group's lock
+    uint64_t aw = atomic_load_explicit(&agent->word, memory_order_acquire);
+    if (word_state(aw) != TU_ON_HOOK || atomic_load(&agent->closed)) {
+        pthread_mutex_unlock(&group->call->lock);
+        return;
+    }
+
+    CALL *call = call_alloc();
+    if (!call) { // the caller waits on - the member is idle meanwhile
+        hunt_append(group, agent);
+        pthread_mutex_unlock(&group->call->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&call->lock); // can't block: no one else knows the call yet
+    call->leg[0] = waiter;
+    call->leg[1] = agent;
+    call->conf = NULL;
+    call->hunt = NULL;
+    uint64_t an = word_next(aw, TU_RINGING, call->index);
+    if (!tu_commit(agent, &aw, an)) { // picked up or rung directly meanwhile
+        pthread_mutex_unlock(&call->lock);
+        slab_free(call_cache, call);
+        pthread_mutex_unlock(&group->call->lock);
+        return;
+    }
+    uint64_t wn = word_next(ww, TU_RING_BACK, call->index);
+    atomic_store_explicit(&waiter->word, wn, memory_order_release);
+    hunt_wait_unlink(group, waiter);
+
+    tu_ref(agent, "Dial target"); // the queue's reference to the waiter carries over to the call
+    tu_ref(waiter, "Queue flush"); // keep the waiter alive until its notification is out
+    pthread_mutex_unlock(&call->lock);
+    pthread_mutex_unlock(&group->call->lock);
+
+    tu_notify(waiter, wn, -1, 1);
+    tu_notify(agent, an, -1, 1);
+    tu_flush(waiter);
+    tu_flush(agent);
+    tu_unref(waiter, "Queue flush");
+}
+
+/*
+ * Bring a TU's place on its hunt group's idle list into line with its
+ * state, after a change into or out of TU_ON_HOOK.  The list is set from
+ * the word as it is now, not from the change just made, so threads that
+ * get here in another order than they made their changes still leave it
+ * right.  A member of a call queue going on hook is rung for the caller
+ * waiting longest instead of going on the list.  Costs one load for a TU
+ * in no hunt group.
+ */
+static void tu_hunt_sync(TU *tu) {
+    HUNT_GROUP *group = atomic_load_explicit(&tu->hunt, memory_order_acquire);
+    if (!group) return;
+
+    pthread_mutex_lock(&group->call->lock);
+    if (atomic_load_explicit(&tu->hunt, memory_order_relaxed) == group) { // not left the group meanwhile
+        int idle = word_state(atomic_load_explicit(&tu->word, memory_order_acquire)) == TU_ON_HOOK;
+        if (idle && !tu->hunt_idle && group->wait_head) {
+            hunt_serve(group, tu); // drops the lock
+            return;
+        }
+        if (idle && !tu->hunt_idle) hunt_append(group, tu);
+        else if (!idle && tu->hunt_idle) hunt_unlink(group, tu);
+    }
+    pthread_mutex_unlock(&group->call->lock);
+}
+
+/*
+ * Send a chat from a member of a conference, as of its word w, to all the
+ * other members.  The caller holds the conference's call's lock, which is
+ * released here.  The line is formatted once into a shared buffer, and
+ * each member's queue gets a message referring to it; the members are
+ * flushed once the lock has been dropped.  Buffer and messages come from
+ * slab caches (unless the line is long), and the members to flush are
+ * listed in an array the thread keeps, so a chat normally calls malloc()
+ * not at all.
+ *
+ * @return 0 if the chat was sent, -1 if memory ran out.
+ */
+static int tu_conference_chat(TU *tu, uint64_t w, CONFERENCE *conf, const char *msg, size_t len) {
+    size_t n = sizeof("CHAT ") - 1 + len + sizeof(EOL) - 1;
+    TU_BUF *buf = tu_buf_new(n);
+    int ntus = 0;
+    int ret = -1;
+
+    if (chat_tus_size < conf->nmembers) {
+        TU **tus = realloc(chat_tus, conf->nmembers * sizeof(TU *));
+        if (tus) {
+            pthread_once(&chat_tus_once, chat_tus_key_init);
+            pthread_setspecific(chat_tus_key, tus);
+            chat_tus = tus;
+            chat_tus_size = conf->nmembers;
+        }
+    }
+
+    if (buf && chat_tus_size >= conf->nmembers) {
+        memcpy(buf->data, "CHAT ", sizeof("CHAT ") - 1);
+        memcpy(buf->data + sizeof("CHAT ") - 1, msg, len);
+        memcpy(buf->data + sizeof("CHAT ") - 1 + len, EOL, sizeof(EOL) - 1);
+
+        for (int i = 0; i < conf->nmembers; i++) {
+            TU *member = conf->members[i];
+            if (member == tu) continue;
+            TU_MSG *m = slab_alloc(msg_cache);
+            if (!m) break;
+            m->gen = word_gen(atomic_load_explicit(&member->word, memory_order_relaxed)); // stable under the lock
+            m->change = 0;
+            m->len = n;
+            m->data = buf->data;
+            m->buf = buf;
+            atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+
+            pthread_mutex_lock(&member->mutex);
+            if (output_policy == TU_OUTPUT_DROP_CHAT && !tu_output_fits(member, n)) {
+                tu_msg_free(m); // member is not keeping up - drop the chat rather than let its backlog grow
+            } else {
+                tu_queue(member, m);
+            }
+            pthread_mutex_unlock(&member->mutex);
+
+            tu_ref(member, "Conference chat");
+            chat_tus[ntus++] = member;
+        }
+        ret = 0;
+    } else {
+        fprintf(stderr, "ERROR: Failed to queue message for conference %d\n", conf->number);
+    }
+
+    tu_notify(tu, w, conf->number, 0); // can't be out of date while the call is locked
+    pthread_mutex_unlock(&conf->call->lock);
+
+    for (int i = 0; i < ntus; i++) {
+        tu_flush(chat_tus[i]);
+        tu_unref(chat_tus[i], "Conference chat");
+    }
+    if (buf) tu_buf_unref(buf);
+    tu_flush(tu);
+
+    return ret;
+}
+
+static void tu_camp_serve(TU *tu);
+
+// Outcomes of tu_ring()
+#define TU_RING_OK 0 // the target is ringing
+#define TU_RING_BUSY 1 // the target is not on hook
+#define TU_RING_AGAIN 2 // a word changed under us - look again
+#define TU_RING_NO_CALL 3 // no call could be set up
+
+/*
+ * Ring a target from a TU with dial tone, as of the TU's word w: the
+ * target first, so no one else can ring it, then the TU.  If both change,
+ * they are notified; otherwise nothing has changed.  A target that has been
+ * closed is busy, and a TU that has been closed gets no call.
+ *
+ * @return TU_RING_OK, TU_RING_BUSY, TU_RING_AGAIN or TU_RING_NO_CALL.
+ */
+static int tu_ring(TU *tu, uint64_t w, TU *target) {
+    uint64_t tw = atomic_load_explicit(&target->word, memory_order_acquire);
+    if (word_state(tw) != TU_ON_HOOK) return TU_RING_BUSY; // in a call already, or about to be
+
+    CALL *call = call_alloc();
+    if (!call) return TU_RING_NO_CALL;
+
+    pthread_mutex_lock(&call->lock);
+    call->leg[0] = tu;
+    call->leg[1] = target;
+    call->conf = NULL;
+    call->hunt = NULL;
+    uint64_t tn = word_next(tw, TU_RINGING, call->index);
+    uint64_t n = word_next(w, TU_RING_BACK, call->index);
+    // seq_cst, as tu_close() is: either closed is seen below, or the hangup that follows it sees the ring
+    if (!atomic_compare_exchange_strong(&target->word, &tw, tn)) { // target picked up or was called in the meantime
+        pthread_mutex_unlock(&call->lock);
+        slab_free(call_cache, call);
+        return TU_RING_AGAIN;
+    }
+    // Only the holder of the call's lock can act on the target ringing, so it can be put back as it was
+    if (atomic_load(&target->closed)) { // unregistered: its last hangup may already have found it on hook
+        atomic_store_explicit(&target->word, tw, memory_order_release);
+        pthread_mutex_unlock(&call->lock);
+        slab_free(call_cache, call);
+        return TU_RING_BUSY;
+    }
+    if (!atomic_compare_exchange_strong(&tu->word, &w, n)) { // we were hung up from elsewhere
+        atomic_store_explicit(&target->word, tw, memory_order_release);
+        pthread_mutex_unlock(&call->lock);
+        slab_free(call_cache, call);
+        tu_camp_serve(target); // anyone who camped on it meanwhile found it busy
+        return TU_RING_AGAIN;
+    }
+    if (atomic_load(&tu->closed)) { // a camper rung after being unregistered - as for the target
+        atomic_store_explicit(&tu->word, w, memory_order_release);
+        atomic_store_explicit(&target->word, tw, memory_order_release);
+        pthread_mutex_unlock(&call->lock);
+        slab_free(call_cache, call);
+        tu_camp_serve(target);
+        return TU_RING_NO_CALL;
+    }
+
+    tu_ref(target, "Dial target"); // Increment reference count for target
+    tu_ref(tu, "Dial originating"); // Increment reference count for tu
+    pthread_mutex_unlock(&call->lock);
+    tu_hunt_sync(target); // no longer idle
+
+    tu_notify(tu, n, -1, 1); // Notify the client
+    tu_notify(target, tn, -1, 1); // Notify the target
+
+    // caller holds a reference to target for the duration of the call
+    tu_flush(tu);
+    tu_flush(target);
+
+    return TU_RING_OK;
+}
+
+// Put a TU at the back of the list of those camped on target - caller holds target's camp_lock
+static void camp_append(TU *target, TU *tu) {
+    tu->camp_next = NULL;
+    tu->camp_prev = target->campers_tail;
+    if (target->campers_tail) target->campers_tail->camp_next = tu;
+    else atomic_store_explicit(&target->campers, tu, memory_order_release);
+    target->campers_tail = tu;
+    tu->camp_linked = 1;
+}
+
+// Put a TU back at the front of the list of those camped on target - caller holds target's camp_lock
+static void camp_push(TU *target, TU *tu) {
+    TU *head = atomic_load_explicit(&target->campers, memory_order_relaxed);
+    tu->camp_prev = NULL;
+    tu->camp_next = head;
+    if (head) head->camp_prev = tu;
+    else target->campers_tail = tu;
+    atomic_store_explicit(&target->campers, tu, memory_order_release);
+    tu->camp_linked = 1;
+}
+
+// Take a TU off the list of those camped on target - caller holds target's camp_lock
+static void camp_unlink(TU *target, TU *tu) {
+    if (tu->camp_prev) tu->camp_prev->camp_next = tu->camp_next;
+    else atomic_store_explicit(&target->campers, tu->camp_next, memory_order_release);
+    if (tu->camp_next) tu->camp_next->camp_prev = tu->camp_prev;
+    else target->campers_tail = tu->camp_prev;
+    tu->camp_next = tu->camp_prev = NULL;
+    tu->camp_linked = 0;
+}
+
+/*
+ * Drop the camp of a TU, if it has one.  Whoever clears camp_target owns
+ * the camp, and with it the references it holds: the TU's to its target
+ * and the target's list's to the TU.  The target can't be freed before
+ * that first reference goes, and taking its camp_lock after clearing
+ * camp_target waits out a tu_camp_serve() that has just taken the TU off
+ * the list.
+ */
+static void tu_camp_cancel(TU *tu) {
+    TU *target = atomic_exchange(&tu->camp_target, NULL);
+    if (!target) return;
+
+    pthread_mutex_lock(&target->camp_lock);
+    if (tu->camp_linked) camp_unlink(target, tu);
+    pthread_mutex_unlock(&target->camp_lock);
+
+    tu_unref(target, "Camped on");
+    tu_unref(tu, "Camper");
+}
+
+/*
+ * Ring a TU that has just gone on hook for whoever has been camped on it
+ * longest, as if they had dialed it, passing over any that are in a call
+ * of their own by now (their camp is dropped).  If the TU is no longer on
+ * hook, the camper stays first in line for the next time it is.  Costs
+ * one load when no one is camped on the TU.
+ */
+static void tu_camp_serve(TU *tu) {
+    while (atomic_load_explicit(&tu->campers, memory_order_acquire)) {
+        pthread_mutex_lock(&tu->camp_lock);
+        TU *camper = atomic_load_explicit(&tu->campers, memory_order_relaxed);
+        if (!camper) {
+            pthread_mutex_unlock(&tu->camp_lock);
+            return;
+        }
+        camp_unlink(tu, camper);
+        int ours = atomic_exchange(&camper->camp_target, NULL) == tu;
+        pthread_mutex_unlock(&tu->camp_lock);
+        if (!ours) continue; // gave up meanwhile - tu_camp_cancel() drops the references
+
+        int rung;
+        for (;;) {
+            uint64_t cw = atomic_load_explicit(&camper->word, memory_order_acquire);
+            TU_STATE state = word_state(cw);
+            if (state != TU_ON_HOOK && state != TU_DIAL_TONE && state != TU_BUSY_SIGNAL) {
+                rung = TU_RING_NO_CALL; // busy itself now
+                break;
+            }
+            rung = tu_ring(camper, cw, tu);
+            if (rung != TU_RING_AGAIN) break;
+        }
+
+        if (rung == TU_RING_OK) {
+            tu_hunt_sync(camper); // off its own group's idle list if it was on hook
+        } else if (rung == TU_RING_BUSY) { // taken first - back at the head of the line
+            pthread_mutex_lock(&tu->camp_lock);
+            int closed = atomic_load(&tu->closed);
+            if (!closed) {
+                camp_push(tu, camper);
+                atomic_store(&camper->camp_target, tu);
+            }
+            pthread_mutex_unlock(&tu->camp_lock);
+            if (!closed) {
+                if (atomic_load(&camper->closed)) tu_camp_cancel(camper); // unregistered meanwhile
+                return;
+            }
+        }
+        tu_unref(tu, "Camped on");
+        tu_unref(camper, "Camper");
+        if (rung == TU_RING_OK) return;
+    }
+}
+
+// Act on a TU having gone on hook: ring it for whoever is camped on it, or else let its hunt group have it
+static void tu_on_hook(TU *tu) {
+    tu_camp_serve(tu);
+    tu_hunt_sync(tu);
+}
+
 /*
  * Initiate a call from a specified originating TU to a specified target TU.
  *   If the originating TU is not in the TU_DIAL_TONE state, then there is no effect.
@@ -278,58 +1382,29 @@ int tu_set_extension(TU *tu, int ext) {
 int tu_dial(TU *tu, TU *target) {
     if (!tu) return -1;
 
-    pthread_mutex_lock(&tu->mutex); // locks mutex for originating tu
+    for (;;) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
 
-    if (tu->state != TU_DIAL_TONE) { // Ensure TU is in DIAL_TONE state
-        // response will be sent from server that just repeats the state of the TU which does not change
-        notify_client_of_tu_state(tu);
-        pthread_mutex_unlock(&tu->mutex);
-        return -1; // originating TU is not in the TU_DIAL_TONE state, then there is no effect
-    }
-
-    if (!target) { // Check if target is NULL
-        tu->state = TU_ERROR; // Set TU state to ERROR
-        notify_client(tu->fd, "ERROR\r\n");
-        pthread_mutex_unlock(&tu->mutex);
-        return -1;
-    }
-
-    pthread_mutex_unlock(&tu->mutex);
-
-    safe_mutex_lock(tu, target);
-
-    if (tu == target ||                // Check if TU dials itself
-        target->state != TU_ON_HOOK || // Target is not ON_HOOK
-        target->peer != NULL) {        // Target has peer connection already
-
-        // fprintf(stderr, "Target is invalid\n");
-
-        tu->state = TU_BUSY_SIGNAL; // Set TU state to BUSY_SIGNAL (do i have to notify the client?)
-        notify_client(tu->fd, "BUSY SIGNAL\r\n");
-
-        safe_mutex_unlock(tu, target);
+        if (word_state(w) != TU_DIAL_TONE) { // Ensure TU is in DIAL_TONE state
+            // response will be sent from server that just repeats the state of the TU which does not change
+            tu_notify_current(tu);
+            tu_flush(tu);
+            return -1; // originating TU is not in the TU_DIAL_TONE state, then there is no effect
+        }
 
+        // target is NULL or TU dials itself: no call
+        int rung = target && tu != target ? tu_ring(tu, w, target) : TU_RING_BUSY;
+        if (rung == TU_RING_OK) return 0;
+        if (rung == TU_RING_AGAIN) continue; // changed under us - look again
+
+        // busy, or no call to be had
+        uint64_t n = word_next(w, target ? TU_BUSY_SIGNAL : TU_ERROR, 0);
+        tu->busy_ext = target && tu != target ? target->ext : -1; // a TU can camp on another, not on itself
+        if (!tu_commit(tu, &w, n)) continue;
+        tu_notify(tu, n, -1, 1);
+        tu_flush(tu);
         return -1;
     }
-
-    // fprintf(stderr, "Target is valid: setting up tu_target\n");
-
-    // establish the connection
-    tu->peer = target; // Set target as TU's peer
-    target->peer = tu; // Set TU as target's peer
-
-    tu_ref(target, "Dial target"); // Increment reference count for target
-    tu_ref(tu, "Dial originating"); // Increment reference count for tu
-
-    tu->state = TU_RING_BACK; // Set TU state to RING_BACK
-    target->state = TU_RINGING; // Set target state to RINGING
-
-    notify_client(tu->fd, "RING BACK\r\n"); // Notify the client
-    notify_client(target->fd, "RINGING\r\n"); // Notify the target
-
-    safe_mutex_unlock(tu, target);
-
-    return 0;
 }
 
 /*
@@ -352,41 +1427,45 @@ int tu_dial(TU *tu, TU *target) {
 int tu_pickup(TU *tu) {
     if (!tu) return -1;
 
-    pthread_mutex_lock(&tu->mutex);
+    for (;;) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
 
-    if (tu->state != TU_ON_HOOK && tu->state != TU_RINGING) {
-        notify_client_of_tu_state(tu);
-        pthread_mutex_unlock(&tu->mutex);
-        return 0;
-    }
-
-    else if (tu->state == TU_ON_HOOK) {
-        tu->state = TU_DIAL_TONE;
-        notify_client(tu->fd, "DIAL TONE\r\n");
-    }
-
-    else if (tu->state == TU_RINGING) {
-
-        pthread_mutex_lock(&tu->peer->mutex);
-
-        tu->state = TU_CONNECTED;
-
-        char buffer [15];
-        snprintf(buffer, 15, "CONNECTED %d\r\n", tu->peer->ext);
-        notify_client(tu->fd, buffer);
+        if (word_state(w) == TU_ON_HOOK) { // a single CAS - no call, no lock
+            uint64_t n = word_next(w, TU_DIAL_TONE, 0);
+            if (!tu_commit(tu, &w, n)) continue;
+            tu_hunt_sync(tu);
+            tu_notify(tu, n, -1, 1);
+            tu_flush(tu);
+            return 0;
+        }
 
-        tu->peer->state = TU_CONNECTED;
+        if (word_state(w) != TU_RINGING) {
+            tu_notify_current(tu);
+            tu_flush(tu);
+            return 0;
+        }
 
-        char buff [15];
-        snprintf(buff, 15, "CONNECTED %d\r\n", tu->ext);
-        notify_client(tu->peer->fd, buff);
+        // TU_RINGING - the call's lock covers the caller too
+        CALL *call = tu_call_lock(tu, w);
+        if (!call) continue;
+        TU *peer = call_peer(call, tu);
+        uint64_t pw = atomic_load_explicit(&peer->word, memory_order_relaxed);
+        uint64_t n = word_next(w, TU_CONNECTED, word_call(w));
+        uint64_t pn = word_next(pw, TU_CONNECTED, word_call(pw));
+        atomic_store_explicit(&tu->word, n, memory_order_release);
+        atomic_store_explicit(&peer->word, pn, memory_order_release);
+        tu_ref(peer, "Pickup flush"); // keep peer alive until its notification is out
+        pthread_mutex_unlock(&call->lock);
+
+        tu_notify(tu, n, peer->ext, 1);
+        tu_notify(peer, pn, tu->ext, 1);
+
+        tu_flush(tu);
+        tu_flush(peer);
+        tu_unref(peer, "Pickup flush");
 
-        pthread_mutex_unlock(&tu->peer->mutex);
+        return 0;
     }
-
-    pthread_mutex_unlock(&tu->mutex);
-
-    return 0;
 }
 
 /*
@@ -413,118 +1492,555 @@ int tu_pickup(TU *tu) {
 int tu_hangup(TU *tu) {
     if (!tu) return -1;
 
-    pthread_mutex_lock(&tu->mutex);
+    for (;;) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
+        TU_STATE state = word_state(w);
+
+        if (state == TU_DIAL_TONE || state == TU_BUSY_SIGNAL || state == TU_ERROR) { // a single CAS - no call, no lock
+            uint64_t n = word_next(w, TU_ON_HOOK, 0);
+            if (!tu_commit(tu, &w, n)) continue;
+            tu_on_hook(tu);
+            tu_notify(tu, n, -1, 1);
+            tu_flush(tu);
+            return 0;
+        }
 
-    if (tu->state == TU_CONNECTED || tu->state == TU_RINGING) {
-        pthread_mutex_lock(&tu->peer->mutex);
+        if (state == TU_ON_HOOK) {
+            tu_notify_current(tu);
+            tu_flush(tu);
+            return -1;
+        }
+
+        // TU_CONNECTED, TU_RINGING or TU_RING_BACK - the call's lock covers the peer too
+        CALL *call = tu_call_lock(tu, w);
+        if (!call) continue;
+
+        if (call->hunt) { // give up waiting in a call queue
+            hunt_wait_unlink(call->hunt, tu);
+            uint64_t n = word_next(w, TU_ON_HOOK, 0);
+            atomic_store_explicit(&tu->word, n, memory_order_release);
+            pthread_mutex_unlock(&call->lock);
+            tu_on_hook(tu);
+
+            tu_notify(tu, n, -1, 1);
+            tu_flush(tu);
+            tu_unref(tu, "Left queue"); // the queue's reference (the caller still holds one)
+            return 0;
+        }
 
-        tu->state = TU_ON_HOOK;
+        if (call->conf) { // leave the conference - the other members carry on
+            conference_remove(call->conf, tu);
+            uint64_t n = word_next(w, TU_ON_HOOK, 0);
+            atomic_store_explicit(&tu->word, n, memory_order_release);
+            pthread_mutex_unlock(&call->lock);
+            tu_on_hook(tu);
+
+            tu_notify(tu, n, -1, 1);
+            tu_flush(tu);
+            tu_unref(tu, "Left conference"); // the conference's reference (the caller still holds one)
+            return 0;
+        }
 
-        char buffer [15];
-        snprintf(buffer, 15, "ON HOOK %d\r\n", tu->fd);
-        notify_client(tu->fd, buffer); // Notify the client of the initial state
+        TU *peer = call_peer(call, tu);
+        uint64_t pw = atomic_load_explicit(&peer->word, memory_order_relaxed);
 
-        tu->peer->state = TU_DIAL_TONE;
+        // a peer we were talking to drops back to dial tone; one we were ringing goes on hook
+        uint64_t pn = word_next(pw, state == TU_RING_BACK ? TU_ON_HOOK : TU_DIAL_TONE, 0);
+        uint64_t n = word_next(w, TU_ON_HOOK, 0); // Disconnect the peer
+        atomic_store_explicit(&peer->word, pn, memory_order_release);
+        atomic_store_explicit(&tu->word, n, memory_order_release);
+        pthread_mutex_unlock(&call->lock);
+        slab_free(call_cache, call);
+        tu_on_hook(tu);
+        if (state == TU_RING_BACK) tu_on_hook(peer);
 
-        notify_client(tu->peer->fd, "DIAL TONE\r\n");
+        tu_notify(tu, n, -1, 1);
+        tu_notify(peer, pn, -1, 1);
 
-        tu->peer->peer = NULL;
+        tu_flush(tu);
+        tu_flush(peer);
+        tu_unref(tu, "Peer disconnected"); // the peer's reference to us (the caller still holds one)
+        tu_unref(peer, "Peer disconnected"); // Decrement peer's ref count
 
-        pthread_mutex_unlock(&tu->peer->mutex);
+        return 0;
     }
+}
 
-    else if (tu->state == TU_RING_BACK) {
-        pthread_mutex_lock(&tu->peer->mutex);
+/*
+ * "Chat" over a connection.
+ *
+ * If the state of the TU is not TU_CONNECTED, then nothing is sent and -1 is returned.
+ * Otherwise, the specified message is sent via the network connection to the peer TU.
+ * In all cases, the states of the TUs are left unchanged and a notification containing
+ * the current state is sent to the TU sending the chat.
+ *
+ * @param tu  The tu sending the chat.
+ * @param msg  The message to be sent.
+ * @return 0  If the chat was successfully sent, -1 if there is no call in progress
+ * or some other error occurs.
+ */
+int tu_chat(TU *tu, char *msg) {
+    if (!tu || !msg) return -1;
+    return tu_chat_buf(tu, msg, strlen(msg));
+}
 
-        tu->state = TU_ON_HOOK;
+/*
+ * Relay a chat line straight to the peer's socket: "CHAT ", the message
+ * where it lies in the sender's buffer and EOL go out as one sendmsg(),
+ * without allocating or copying.  Only the part the socket will not take
+ * is copied into a queued message.  The caller holds peer->write_mutex
+ * (and no other lock), having checked that nothing is queued ahead of the chat.
+ */
+static void tu_relay_chat(TU *peer, const char *msg, size_t len) {
+    struct iovec iov[3] = {
+        { "CHAT ", sizeof("CHAT ") - 1 },
+        { (char *)msg, len },
+        { EOL, sizeof(EOL) - 1 }
+    };
+    size_t n = iov[0].iov_len + len + iov[2].iov_len;
+
+    if (tu_send_hook && tu_send_hook(peer->fd, iov, 3) == 0) return;
+
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 3 };
+    ssize_t written;
+    do {
+        written = sendmsg(peer->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (written < 0 && errno == EINTR);
+
+    if (written == (ssize_t)n) return; // the common case
+
+    if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        pthread_mutex_lock(&peer->mutex);
+        tu_drop_output(peer); // shut down by tu_send_queue() below
+        pthread_mutex_unlock(&peer->mutex);
+    } else {
+        size_t sent = written < 0 ? 0 : written;
+        TU_MSG *m = tu_msg_new(n - sent);
+        if (!m) {
+            fprintf(stderr, "ERROR: Failed to queue message for client on fd (%d)\n", peer->fd);
+            return;
+        }
+        // copy out whatever is left of the line
+        m->len = 0;
+        for (int i = 0; i < 3; i++) {
+            size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+            memcpy(m->text + m->len, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+            m->len += iov[i].iov_len - skip;
+            sent -= skip;
+        }
 
-        char buff [15];
-        snprintf(buff, 15, "ON HOOK %d\r\n", tu->fd);
-        notify_client(tu->fd, buff);
+        pthread_mutex_lock(&peer->mutex);
+        if (peer->out_closed) {
+            tu_msg_free(m);
+        } else { // it goes ahead of anything queued since
+            m->next = peer->out_head;
+            if (!peer->out_head) peer->out_tail = &m->next;
+            peer->out_head = m;
+            peer->out_offset = 0;
+            peer->out_bytes += m->len;
+        }
+        pthread_mutex_unlock(&peer->mutex);
+    }
 
-        tu->peer->state = TU_ON_HOOK; // i think the peer is the calling tu?
+    if (tu_send_queue(peer, 0)) {
+        tu_park(peer);
+    }
+}
 
-        char buffer [15];
-        snprintf(buffer, 15, "ON HOOK %d\r\n", tu->peer->fd);
-        notify_client(tu->peer->fd, buffer);
+/*
+ * Like tu_chat(), but for a message of known length that need not be
+ * NUL-terminated (see tu_ext.h).
+ */
+int tu_chat_buf(TU *tu, const char *msg, size_t len) {
+    if (!tu || !msg) return -1;
+
+    TU *peer = NULL;
+    while (!peer) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
+        if (word_state(w) != TU_CONNECTED) { // Ensure TU is connected
+            tu_notify_current(tu);
+            tu_flush(tu);
+            return -1;
+        }
+        CALL *call = tu_call_lock(tu, w);
+        if (!call) continue;
+        if (call->conf) return tu_conference_chat(tu, w, call->conf, msg, len);
+        peer = call_peer(call, tu);
+        tu_ref(peer, "Chat"); // peer could hang up once we let go of the lock
+        pthread_mutex_unlock(&call->lock);
+    }
 
-        tu->peer->peer = NULL;
+    // Holding the peer's write mutex keeps its output in order if we write to it directly
+    pthread_mutex_lock(&peer->write_mutex);
+
+    int ret = -1;
+    int direct = 0;
+    size_t n = sizeof("CHAT ") - 1 + len + sizeof(EOL) - 1;
+    uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
+    CALL *call = word_state(w) == TU_CONNECTED ? tu_call_lock(tu, w) : NULL;
+    int connected = call && !call->conf && call_peer(call, tu) == peer; // not hung up in the meantime
+
+    if (connected) {
+        // The chat follows whatever the peer has been told of the call so far
+        uint32_t gen = word_gen(atomic_load_explicit(&peer->word, memory_order_relaxed));
+        pthread_mutex_lock(&peer->mutex);
+        if (output_policy == TU_OUTPUT_DROP_CHAT && !tu_output_fits(peer, n)) {
+            // peer is not keeping up - drop the chat rather than let its backlog grow
+        } else if (!peer->out_head && !peer->out_held && !peer->out_parked && !peer->out_closed &&
+                   !gen_after(gen, peer->out_gen) && tu_output_fits(peer, n)) {
+            direct = 1; // nothing ahead of it - send it from where it is
+            ret = 0;
+        } else {
+            TU_MSG *m = tu_msg_new(n);
+            if (m) {
+                // build the whole line in a single node
+                m->gen = gen;
+                m->change = 0;
+                memcpy(m->text, "CHAT ", sizeof("CHAT ") - 1);
+                memcpy(m->text + sizeof("CHAT ") - 1, msg, len);
+                memcpy(m->text + sizeof("CHAT ") - 1 + len, EOL, sizeof(EOL) - 1);
+                tu_queue(peer, m);
+                ret = 0;
+            }
+        }
+        pthread_mutex_unlock(&peer->mutex);
 
-        pthread_mutex_unlock(&tu->peer->mutex);
+        tu_notify(tu, w, peer->ext, 0); // can't be out of date while the call is locked
     }
 
-    else if (tu->state == TU_DIAL_TONE || tu->state == TU_BUSY_SIGNAL || tu->state == TU_ERROR) {
-        tu->state = TU_ON_HOOK;
+    if (call) {
+        pthread_mutex_unlock(&call->lock);
+    }
+    if (!connected) {
+        tu_notify_current(tu);
+    }
 
-        char buffer [15];
-        snprintf(buffer, 15, "ON HOOK %d\r\n", tu->fd);
-        notify_client(tu->fd, buffer); // Notify the client of the initial state
+    if (direct) {
+        tu_relay_chat(peer, msg, len);
     }
+    pthread_mutex_unlock(&peer->write_mutex);
 
-    else {
-        notify_client_of_tu_state(tu);
-        pthread_mutex_unlock(&tu->mutex);
-        return -1;
+    if (!direct) {
+        tu_flush(peer);
     }
+    tu_flush(tu);
+    tu_unref(peer, "Chat");
 
-    tu_unref(tu->peer, "Peer disconnected"); // Decrement peer's ref count
-    tu->peer = NULL; // Disconnect the peer
+    return ret;
+}
 
-    pthread_mutex_unlock(&tu->mutex);
+/*
+ * Create a conference room (see tu_ext.h).
+ */
+CONFERENCE *tu_conference_init(int number) {
+    CONFERENCE *conf = calloc(1, sizeof(CONFERENCE));
+    if (!conf) return NULL;
 
-    return 0;
+    conf->call = call_alloc(); // the room's members are all in its call
+    if (!conf->call) {
+        free(conf);
+        return NULL;
+    }
+    conf->call->leg[0] = conf->call->leg[1] = NULL;
+    conf->call->conf = conf;
+    conf->call->hunt = NULL;
+    conf->number = number;
+    return conf;
 }
 
 /*
- * "Chat" over a connection.
- *
- * If the state of the TU is not TU_CONNECTED, then nothing is sent and -1 is returned.
- * Otherwise, the specified message is sent via the network connection to the peer TU.
- * In all cases, the states of the TUs are left unchanged and a notification containing
- * the current state is sent to the TU sending the chat.
- *
- * @param tu  The tu sending the chat.
- * @param msg  The message to be sent.
- * @return 0  If the chat was successfully sent, -1 if there is no call in progress
- * or some other error occurs.
+ * Free a conference room with no members (see tu_ext.h).
  */
-int tu_chat(TU *tu, char *msg) {
+void tu_conference_fini(CONFERENCE *conf) {
+    if (!conf) return;
+    conf->call->conf = NULL;
+    slab_free(call_cache, conf->call);
+    free(conf->members);
+    free(conf);
+}
+
+/*
+ * Join a conference room (see tu_ext.h).
+ */
+int tu_join(TU *tu, CONFERENCE *conf) {
+    if (!tu || !conf) return -1;
+
+    for (;;) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
+
+        if (word_state(w) != TU_DIAL_TONE) {
+            tu_notify_current(tu);
+            tu_flush(tu);
+            return -1;
+        }
+
+        CALL *call = conf->call;
+        pthread_mutex_lock(&call->lock);
+        uint64_t n = word_next(w, TU_CONNECTED, call->index);
+        if (conference_add(conf, tu) == -1) {
+            pthread_mutex_unlock(&call->lock);
+            fprintf(stderr, "ERROR: Failed to add a member to conference %d\n", conf->number);
+            n = word_next(w, TU_BUSY_SIGNAL, 0);
+            tu->busy_ext = -1;
+            if (!tu_commit(tu, &w, n)) continue;
+            tu_notify(tu, n, -1, 1);
+            tu_flush(tu);
+            return -1;
+        }
+        if (!tu_commit(tu, &w, n)) { // we were hung up from elsewhere
+            conference_remove(conf, tu);
+            pthread_mutex_unlock(&call->lock);
+            continue;
+        }
+        tu_ref(tu, "Joined conference");
+        pthread_mutex_unlock(&call->lock);
+
+        tu_notify(tu, n, conf->number, 1);
+        tu_flush(tu);
+        return 0;
+    }
+}
+
+/*
+ * Page many TUs at once (see tu_ext.h).
+ */
+int tu_page(TU *tu, TU **targets, int ntargets, const char *msg, size_t len) {
     if (!tu || !msg) return -1;
 
-    pthread_mutex_lock(&tu->mutex);
+    char head[32];
+    size_t hlen = snprintf(head, sizeof(head), "PAGE %d ", tu->ext);
+    size_t n = hlen + len + sizeof(EOL) - 1;
+    TU_BUF *buf = tu_buf_new(n);
+    int count = -1;
+
+    if (buf) {
+        memcpy(buf->data, head, hlen);
+        memcpy(buf->data + hlen, msg, len);
+        memcpy(buf->data + hlen + len, EOL, sizeof(EOL) - 1);
+
+        // Queue it for everyone first, so the sends below follow each other without a break
+        count = 0;
+        for (int i = 0; i < ntargets; i++) {
+            TU *target = targets[i];
+            if (target == tu) continue;
+            TU_MSG *m = slab_alloc(msg_cache);
+            if (!m) {
+                fprintf(stderr, "ERROR: Failed to queue page for client on fd (%d)\n", target->fd);
+                break;
+            }
+            m->change = 0;
+            m->len = n;
+            m->data = buf->data;
+            m->buf = buf;
+            atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+
+            for (;;) {
+                // It follows whatever the target has been told so far, as for a chat
+                uint64_t w = atomic_load_explicit(&target->word, memory_order_acquire);
+                CALL *call = NULL;
+                if (word_call(w) && !(call = tu_call_lock(target, w))) continue; // confirmed by the call (see tu_dial())
+                m->gen = word_gen(w);
+
+                pthread_mutex_lock(&target->mutex);
+                if (output_policy == TU_OUTPUT_DROP_CHAT && !tu_output_fits(target, n)) {
+                    tu_msg_free(m); // target is not keeping up - it misses the page
+                } else {
+                    tu_queue(target, m);
+                    count++;
+                }
+                pthread_mutex_unlock(&target->mutex);
+
+                if (call) pthread_mutex_unlock(&call->lock);
+                break;
+            }
+        }
 
-    if (tu->state != TU_CONNECTED || !tu->peer) { // Ensure TU is connected
-        // fprintf(stderr, "TU is not connected with a peer\n");
-        notify_client_of_tu_state(tu);
-        pthread_mutex_unlock(&tu->mutex);
-        return -1;
+        for (int i = 0; i < ntargets; i++) {
+            if (targets[i] != tu) tu_flush(targets[i]);
+        }
+        tu_buf_unref(buf);
+    } else {
+        fprintf(stderr, "ERROR: Failed to format page from extension %d\n", tu->ext);
     }
 
-    pthread_mutex_unlock(&tu->mutex);
+    tu_notify_current(tu);
+    tu_flush(tu);
+    return count;
+}
 
-    safe_mutex_lock(tu, tu->peer);
+/*
+ * Create a hunt group (see tu_ext.h).
+ */
+HUNT_GROUP *tu_hunt_group_init(int number, int queue) {
+    HUNT_GROUP *group = calloc(1, sizeof(HUNT_GROUP));
+    if (!group) return NULL;
 
-    size_t message_length = strlen("CHAT ") + strlen(msg) + strlen("\r\n") + 1;
-    char *message = malloc(message_length);
-    if (!message) {
-        safe_mutex_unlock(tu, tu->peer);
-        return -1;
+    group->call = call_alloc(); // callers waiting in the queue are all in its call
+    if (!group->call) {
+        free(group);
+        return NULL;
     }
+    group->call->leg[0] = group->call->leg[1] = NULL;
+    group->call->hunt = group;
+    group->number = number;
+    group->queue = queue;
+    return group;
+}
+
+/*
+ * Free a hunt group with no members (see tu_ext.h).
+ */
+void tu_hunt_group_fini(HUNT_GROUP *group) {
+    if (!group) return;
+    group->call->hunt = NULL;
+    slab_free(call_cache, group->call);
+    free(group);
+}
 
-    snprintf(message, message_length, "CHAT %s\r\n", msg);
+/*
+ * Put a TU in a hunt group, or take it out of the one it is in (see tu_ext.h).
+ */
+void tu_set_hunt_group(TU *tu, HUNT_GROUP *group) {
+    if (!tu) return;
 
-    // fprintf(stderr, "message received by tu_chat: %s (send to ext: %d)\n", message, tu->peer->ext);
+    HUNT_GROUP *old = atomic_load_explicit(&tu->hunt, memory_order_acquire);
+    if (old) {
+        pthread_mutex_lock(&old->call->lock);
+        if (tu->hunt_idle) hunt_unlink(old, tu);
+        atomic_store_explicit(&tu->hunt, NULL, memory_order_release);
+        pthread_mutex_unlock(&old->call->lock);
+    }
+    if (group) {
+        pthread_mutex_lock(&group->call->lock);
+        atomic_store_explicit(&tu->hunt, group, memory_order_release);
+        pthread_mutex_unlock(&group->call->lock);
+        tu_hunt_sync(tu); // on the idle list if on hook
+    }
+}
 
-    notify_client(tu->peer->ext, message); // Send the message to the peer
+/*
+ * Dial a hunt group (see tu_ext.h).
+ */
+int tu_dial_hunt(TU *tu, HUNT_GROUP *group) {
+    if (!tu || !group) return -1;
 
-    free(message);
+    for (;;) {
+        uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
 
-    // do i need this?
-    char buffer [15];
-    snprintf(buffer, 15, "CONNECTED %d\r\n", tu->peer->ext);
-    notify_client(tu->fd, buffer);
+        if (word_state(w) != TU_DIAL_TONE) {
+            tu_notify_current(tu);
+            tu_flush(tu);
+            return -1;
+        }
 
-    safe_mutex_unlock(tu, tu->peer);
+        // The member idle longest, off the list so that no one else rings it meanwhile
+        pthread_mutex_lock(&group->call->lock);
+        TU *target = group->idle_head;
+        if (target) {
+            hunt_unlink(group, target);
+            tu_ref(target, "Hunt target");
+        } else if (group->queue) { // every member is busy - wait for one in the group's call
+            uint64_t n = word_next(w, TU_RING_BACK, group->call->index);
+            if (!tu_commit(tu, &w, n)) { // hung up from elsewhere
+                pthread_mutex_unlock(&group->call->lock);
+                continue;
+            }
+            hunt_wait_append(group, tu);
+            tu_ref(tu, "Queued");
+            hunt_queued(tu, n, group->nwaiting); // before the lock goes, so it can't follow a later change
+            pthread_mutex_unlock(&group->call->lock);
+
+            tu_notify(tu, n, -1, 1);
+            tu_flush(tu);
+            return 0;
+        }
+        pthread_mutex_unlock(&group->call->lock);
 
-    return 0;
-}
\ No newline at end of file
+        int rung = TU_RING_NO_CALL; // every member is busy
+        if (target) {
+            rung = target != tu ? tu_ring(tu, w, target) : TU_RING_BUSY;
+            if (rung != TU_RING_OK) {
+                tu_hunt_sync(target); // back on the list if it is still on hook after all
+            }
+            tu_unref(target, "Hunt target");
+        }
+        if (rung == TU_RING_OK) return 0;
+        if (rung != TU_RING_NO_CALL) continue; // that member was taken meanwhile, or our word changed - look again
+
+        uint64_t n = word_next(w, TU_BUSY_SIGNAL, 0);
+        tu->busy_ext = -1;
+        if (!tu_commit(tu, &w, n)) continue;
+        tu_notify(tu, n, -1, 1);
+        tu_flush(tu);
+        return -1;
+    }
+}
+
+/*
+ * Get the extension a TU with busy signal may camp on (see tu_ext.h).
+ */
+int tu_camp_extension(TU *tu) {
+    if (!tu) return -1;
+    return word_state(atomic_load_explicit(&tu->word, memory_order_acquire)) == TU_BUSY_SIGNAL ? tu->busy_ext : -1;
+}
+
+/*
+ * Camp on a busy TU (see tu_ext.h).
+ */
+int tu_camp(TU *tu, TU *target) {
+    if (!tu) return -1;
+
+    uint64_t w = atomic_load_explicit(&tu->word, memory_order_acquire);
+    int ret = -1;
+    if (target && target != tu && word_state(w) == TU_BUSY_SIGNAL && !atomic_load(&tu->closed)) {
+        tu_camp_cancel(tu); // one camp at a time
+
+        pthread_mutex_lock(&target->camp_lock);
+        if (!atomic_load(&target->closed)) {
+            tu_ref(target, "Camped on");
+            tu_ref(tu, "Camper");
+            camp_append(target, tu);
+            atomic_store(&tu->camp_target, target);
+            ret = 0;
+        }
+        pthread_mutex_unlock(&target->camp_lock);
+    }
+
+    tu_notify_current(tu);
+    tu_flush(tu);
+    if (ret == 0) {
+        if (atomic_load(&tu->closed)) tu_camp_cancel(tu); // unregistered meanwhile
+        tu_camp_serve(target); // it may have gone on hook already
+    }
+    return ret;
+}
+
+/*
+ * Close a TU for good (see tu_ext.h).
+ */
+void tu_close(TU *tu) {
+    if (!tu) return;
+
+    pthread_mutex_lock(&tu->camp_lock);
+    atomic_store(&tu->closed, 1);
+    pthread_mutex_unlock(&tu->camp_lock);
+    atomic_thread_fence(memory_order_seq_cst); // a tu_ring() that misses closed has rung before anything we load next (see there)
+    tu_camp_cancel(tu);
+
+    // Everyone camped on it gives up
+    for (;;) {
+        pthread_mutex_lock(&tu->camp_lock);
+        TU *camper = atomic_load_explicit(&tu->campers, memory_order_relaxed);
+        int ours = 0;
+        if (camper) {
+            camp_unlink(tu, camper);
+            ours = atomic_exchange(&camper->camp_target, NULL) == tu;
+        }
+        pthread_mutex_unlock(&tu->camp_lock);
+        if (!camper) return;
+        if (ours) {
+            tu_unref(tu, "Camped on");
+            tu_unref(camper, "Camper");
+        }
+    }
+}
@@ -0,0 +1,701 @@
+/*
+ * Uring: io_uring event loop servicing client sessions.
+ *
+ * The ring is driven through the raw system calls and the kernel's
+ * <linux/io_uring.h>, so there is no dependency on liburing.  All sessions
+ * are serviced by the one loop thread, which therefore also runs every
+ * tu_xxx() call; notifications are handed to the loop via tu_send_hook and
+ * queued on the connection they are addressed to.  Before each
+ * io_uring_enter() every connection with queued notifications gets them
+ * submitted as a chain of linked sends.  A connection never has more than
+ * one chain in flight, so notifications reach each client in order.
+ * What a connection has queued or in flight is reported back through
+ * tu_backlog_hook, so that the output limit and policy apply as they do to
+ * output queued on the TU.  Output produced in other threads (the TU drain
+ * thread, say) is not written there: the TU is posted to the loop through
+ * tu_post_hook, and an eventfd read by the ring wakes the loop to send it.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "pbx.h"
+#include "session.h"
+#include "tu_ext.h"
+#include "uring.h"
+#include "debug.h"
+
+#define URING_ENTRIES 1024 // submission queue size
+#define URING_BUFFERS 1024 // provided receive buffers of CHUNK_SIZE bytes (power of two)
+#define URING_BGID 0 // buffer group of the provided buffers
+
+// Kind of request, kept in the low bits of user_data (the rest is a pointer)
+#define URING_WAKE 0
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_TAG_MASK 3
+
+struct uring_conn;
+
+// A notification waiting to be sent, or being sent, to a connection
+struct uring_msg {
+    struct uring_msg *next; // next queued notification
+    struct uring_conn *conn; // connection it is addressed to
+    size_t len; // length of data
+    char data[]; // the notification itself
+};
+
+// A TU posted to the loop by another thread, to have its output sent (see tu_post_hook)
+struct uring_post {
+    struct uring_post *next;
+    TU *tu; // referenced
+};
+
+// A connection serviced by the loop
+struct uring_conn {
+    int fd; // File descriptor for the client connection
+    SESSION *s; // session for the connection
+    struct uring_msg *pending; // notifications not yet submitted
+    struct uring_msg **pending_tail; // where to append the next one
+    int inflight; // sends submitted but not yet completed
+    size_t backlog; // bytes queued or in flight, counted against the client's output limit
+    int closed; // client gone; session closed, and conn freed, once nothing refers to them
+    int dirty; // on the loop's dirty list
+    struct uring_conn *next_dirty; // next connection with notifications to submit
+    struct uring_conn *next_starved; // next connection whose receive is waiting for buffers
+};
+
+// The ring and everything the loop keeps alongside it
+struct uring {
+    int ring_fd; // io_uring instance
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // tail including SQEs not yet published to the kernel
+    unsigned to_submit; // SQEs published but not yet submitted
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring; // ring of provided receive buffers
+    char *buf_base; // memory backing the provided buffers
+    unsigned short buf_tail; // local copy of buf_ring->tail
+    int listen_fd; // listening socket, or -1 once it has been shut down
+    struct uring_conn **conns; // open connections indexed by fd
+    int nconns; // size of conns
+    struct uring_conn *dirty; // connections with notifications to submit
+    struct uring_conn *starved; // connections to rearm as buffers are returned, longest waiting first
+    struct uring_conn **starved_tail; // where to append the next one
+    pthread_t thread; // thread running the loop
+    int wake_fd; // eventfd written by threads posting TUs, read by the ring
+    uint64_t wake_count; // what the read of wake_fd reads into
+    pthread_mutex_t post_lock; // guards posts
+    struct uring_post *posts; // TUs posted by other threads, newest first
+};
+
+static struct uring ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Publish queued SQEs to the kernel, submit them, and optionally wait for
+ * at least one completion.
+ */
+static int uring_enter(struct uring *r, unsigned min_complete) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    int ret = sys_io_uring_enter(r->ring_fd, r->to_submit, min_complete,
+                                 min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (ret > 0) {
+        r->to_submit -= (unsigned)ret;
+    }
+    return ret;
+}
+
+/*
+ * Number of free slots in the submission queue.
+ */
+static unsigned uring_sq_space(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return r->sq_entries - (r->sq_local_tail - head);
+}
+
+/*
+ * Get a cleared SQE, submitting what is queued first if the queue is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    if (uring_sq_space(r) == 0) {
+        uring_enter(r, 0);
+        if (uring_sq_space(r) == 0) {
+            fprintf(stderr, "ERROR: io_uring submission queue full\n");
+            return NULL;
+        }
+    }
+    unsigned index = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_local_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+/*
+ * Return a provided buffer to the kernel once its data has been consumed.
+ */
+static void uring_provide(struct uring *r, unsigned short bid) {
+    struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(r->buf_base + (size_t)bid * CHUNK_SIZE);
+    buf->len = CHUNK_SIZE;
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * (Re)arm the multishot accept on the listening socket.
+ */
+static void uring_arm_accept(struct uring *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+/*
+ * (Re)arm the multishot receive on a connection.
+ */
+static void uring_arm_recv(struct uring *r, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) {
+        shutdown(conn->fd, SHUT_RDWR); // cannot service it - drop the client
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uintptr_t)conn | URING_RECV;
+}
+
+/*
+ * Park a connection whose receive stopped for want of provided buffers
+ * until some are returned.
+ */
+static void uring_starve(struct uring *r, struct uring_conn *conn) {
+    conn->next_starved = NULL;
+    *r->starved_tail = conn;
+    r->starved_tail = &conn->next_starved;
+}
+
+/*
+ * Rearm the receives of up to n parked connections, longest waiting first.
+ */
+static void uring_feed_starved(struct uring *r, unsigned n) {
+    while (r->starved && n-- > 0) {
+        struct uring_conn *conn = r->starved;
+        r->starved = conn->next_starved;
+        if (!r->starved) r->starved_tail = &r->starved;
+        uring_arm_recv(r, conn);
+    }
+}
+
+/*
+ * Queue a connection for submission of its pending notifications.
+ */
+static void uring_mark_dirty(struct uring *r, struct uring_conn *conn) {
+    if (conn->dirty) return;
+    conn->dirty = 1;
+    conn->next_dirty = r->dirty;
+    r->dirty = conn;
+}
+
+static void uring_free_conn(struct uring_conn *conn) {
+    if (conn->closed && !conn->s && conn->inflight == 0 && !conn->dirty) {
+        free(conn);
+    }
+}
+
+/*
+ * Send hook installed in the loop thread: queue a notification on the
+ * connection with the given fd.
+ */
+static int uring_send(int fd, const struct iovec *iov, int iovcnt) {
+    struct uring *r = &ring;
+    struct uring_conn *conn = fd < r->nconns ? r->conns[fd] : NULL;
+    if (!conn) return -1; // not one of ours any more - let the TU write it
+
+    if (conn->closed) return 0; // client is going away - nothing to tell it
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+
+    struct uring_msg *msg = malloc(sizeof(struct uring_msg) + len);
+    if (!msg) return -1;
+    msg->next = NULL;
+    msg->conn = conn;
+    msg->len = 0;
+    for (int i = 0; i < iovcnt; i++) { // the send is asynchronous, so it needs its own copy
+        memcpy(msg->data + msg->len, iov[i].iov_base, iov[i].iov_len);
+        msg->len += iov[i].iov_len;
+    }
+
+    *conn->pending_tail = msg;
+    conn->pending_tail = &msg->next;
+    conn->backlog += msg->len;
+    uring_mark_dirty(r, conn);
+    return 0;
+}
+
+/*
+ * Backlog hook installed in the loop thread: the bytes taken for the
+ * connection with the given fd and not yet sent.
+ */
+static size_t uring_backlog(int fd) {
+    struct uring *r = &ring;
+    struct uring_conn *conn = fd < r->nconns ? r->conns[fd] : NULL;
+    return conn ? conn->backlog : 0;
+}
+
+/*
+ * Post hook, called from threads other than the loop: have the loop send
+ * the output of a TU, and wake it up to do so.
+ */
+static int uring_post(TU *tu) {
+    struct uring *r = &ring;
+    struct uring_post *post = malloc(sizeof(struct uring_post));
+    if (!post) return -1;
+    tu_ref(tu, "Posted to io_uring loop");
+    post->tu = tu;
+
+    pthread_mutex_lock(&r->post_lock);
+    int idle = r->posts == NULL; // otherwise the loop has been woken already
+    post->next = r->posts;
+    r->posts = post;
+    pthread_mutex_unlock(&r->post_lock);
+
+    if (idle) {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            fprintf(stderr, "ERROR: failed to wake io_uring loop\n");
+        }
+    }
+    return 0;
+}
+
+/*
+ * (Re)arm the read of the eventfd by which other threads wake the loop.
+ */
+static void uring_arm_wake(struct uring *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wake_fd;
+    sqe->addr = (uintptr_t)&r->wake_count;
+    sqe->len = sizeof(r->wake_count);
+    sqe->user_data = URING_WAKE;
+}
+
+/*
+ * Send the output of the TUs other threads have posted, oldest first.
+ */
+static void uring_take_posts(struct uring *r) {
+    pthread_mutex_lock(&r->post_lock);
+    struct uring_post *posts = r->posts;
+    r->posts = NULL;
+    pthread_mutex_unlock(&r->post_lock);
+
+    struct uring_post *oldest = NULL;
+    while (posts) { // reverse into the order they were posted
+        struct uring_post *next = posts->next;
+        posts->next = oldest;
+        oldest = posts;
+        posts = next;
+    }
+    while (oldest) {
+        struct uring_post *next = oldest->next;
+        tu_send_output(oldest->tu);
+        tu_unref(oldest->tu, "Posted to io_uring loop");
+        free(oldest);
+        oldest = next;
+    }
+}
+
+/*
+ * Submit the pending notifications of every dirty connection as one chain
+ * of linked sends per connection.  MSG_WAITALL makes a short send count as
+ * a failure, so the rest of a chain is cancelled rather than sent out of order.
+ */
+static void uring_flush(struct uring *r) {
+    while (r->dirty) {
+        struct uring_conn *conn = r->dirty;
+        r->dirty = conn->next_dirty;
+        conn->dirty = 0;
+
+        if (conn->closed) {
+            uring_free_conn(conn);
+            continue;
+        }
+        if (conn->inflight || !conn->pending) {
+            continue; // resubmitted when the chain in flight completes
+        }
+
+        // A chain must not be split across submissions
+        unsigned space = uring_sq_space(r);
+        if (space == 0) {
+            uring_enter(r, 0);
+            space = uring_sq_space(r);
+        }
+
+        struct io_uring_sqe *last = NULL;
+        while (conn->pending && conn->inflight < (int)space) {
+            struct uring_msg *msg = conn->pending;
+            conn->pending = msg->next;
+
+            struct io_uring_sqe *sqe = uring_get_sqe(r);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->fd;
+            sqe->addr = (uintptr_t)msg->data;
+            sqe->len = msg->len;
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = (uintptr_t)msg | URING_SEND;
+            conn->inflight++;
+            last = sqe;
+        }
+        if (!conn->pending) {
+            conn->pending_tail = &conn->pending;
+        }
+        if (last) {
+            last->flags &= ~IOSQE_IO_LINK; // end of this connection's chain
+        }
+    }
+}
+
+/*
+ * Set up a session for a connection delivered by the multishot accept.
+ */
+static void uring_open_conn(struct uring *r, int fd) {
+    if (fd >= r->nconns) {
+        int n = r->nconns ? r->nconns : 64;
+        while (n <= fd) n *= 2;
+        struct uring_conn **conns = realloc(r->conns, n * sizeof(struct uring_conn *));
+        if (!conns) {
+            close(fd);
+            return;
+        }
+        memset(conns + r->nconns, 0, (n - r->nconns) * sizeof(struct uring_conn *));
+        r->conns = conns;
+        r->nconns = n;
+    }
+
+    struct uring_conn *conn = calloc(1, sizeof(struct uring_conn));
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->pending_tail = &conn->pending;
+    r->conns[fd] = conn; // before session_open(), which sends the first notification
+
+    conn->s = session_open(fd);
+    if (!conn->s) { // fd has been closed: drop anything queued for it
+        r->conns[fd] = NULL;
+        while (conn->pending) {
+            struct uring_msg *msg = conn->pending;
+            conn->pending = msg->next;
+            free(msg);
+        }
+        conn->closed = 1;
+        uring_free_conn(conn);
+        return;
+    }
+
+    uring_arm_recv(r, conn);
+}
+
+/*
+ * Close the session of a connection once no send refers to its fd any more:
+ * session_close() may close the fd, and the kernel could then give its
+ * number to a new connection that a send still in flight would write to.
+ */
+static void uring_finish_close(struct uring *r, struct uring_conn *conn) {
+    session_close(conn->s);
+    conn->s = NULL;
+    r->conns[conn->fd] = NULL;
+    uring_free_conn(conn);
+}
+
+/*
+ * Tear down a connection whose receive has reached EOF or failed.
+ * Notifications not yet submitted are discarded, and a chain still in
+ * flight is made to fail quickly by shutting the connection down; the
+ * session is closed when the last of its completions has been reaped.
+ */
+static void uring_close_conn(struct uring *r, struct uring_conn *conn) {
+    conn->closed = 1;
+    while (conn->pending) {
+        struct uring_msg *msg = conn->pending;
+        conn->pending = msg->next;
+        conn->backlog -= msg->len;
+        free(msg);
+    }
+    conn->pending_tail = &conn->pending;
+
+    if (conn->inflight) {
+        shutdown(conn->fd, SHUT_RDWR); // a send blocked on a client that is not reading fails
+        return;
+    }
+    uring_finish_close(r, conn);
+}
+
+/*
+ * Handle one completion.
+ */
+static void uring_complete(struct uring *r, struct io_uring_cqe *cqe) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (cqe->user_data & URING_TAG_MASK) {
+        case URING_WAKE:
+            uring_take_posts(r);
+            uring_arm_wake(r);
+            break;
+
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                uring_open_conn(r, cqe->res);
+            } else if (cqe->res == -EINVAL || cqe->res == -EBADF) {
+                r->listen_fd = -1; // listening socket shut down for termination
+                break;
+            } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+                fprintf(stderr, "ERROR: failed to accept and handle incoming new client connection\n");
+            }
+            if (!more && r->listen_fd >= 0) {
+                uring_arm_accept(r);
+            }
+            break;
+
+        case URING_RECV: {
+            struct uring_conn *conn = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+            if (cqe->res > 0) {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                char *data = r->buf_base + (size_t)bid * CHUNK_SIZE;
+                if (session_input(conn->s, data, cqe->res) < 0) {
+                    shutdown(conn->fd, SHUT_RDWR); // EOF will follow
+                }
+                uring_provide(r, bid);
+            } else if (cqe->res == -ENOBUFS) {
+                if (!more) {
+                    uring_starve(r, conn); // rearmed once buffers have been returned
+                }
+                break;
+            } else {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    uring_provide(r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                if (!more) {
+                    uring_close_conn(r, conn); // EOF or connection error
+                }
+                break;
+            }
+            if (!more) {
+                uring_arm_recv(r, conn);
+            }
+            break;
+        }
+
+        case URING_SEND: {
+            struct uring_msg *msg = (struct uring_msg *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+            struct uring_conn *conn = msg->conn;
+            conn->backlog -= msg->len;
+            free(msg);
+            conn->inflight--;
+            if (cqe->res < 0 && cqe->res != -ECANCELED && !conn->closed) {
+                shutdown(conn->fd, SHUT_RDWR); // drop the client, as a failed write() would
+            }
+            if (conn->inflight == 0) {
+                if (conn->closed) {
+                    uring_finish_close(r, conn);
+                } else if (conn->pending) {
+                    uring_mark_dirty(r, conn);
+                }
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Handle all available completions.
+ */
+static void uring_reap(struct uring *r) {
+    unsigned short buf_tail = r->buf_tail;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE); // slot may be reused from here on
+        uring_complete(r, &cqe);
+    }
+
+    // The buffers a receive found missing were all taken by completions reaped
+    // no earlier than its own, so whatever came back in this pass may be had
+    uring_feed_starved(r, (unsigned short)(r->buf_tail - buf_tail));
+}
+
+/*
+ * Thread function for the io_uring loop.
+ */
+static void *uring_run(void *arg) {
+    struct uring *r = arg;
+    tu_send_hook = uring_send;
+    tu_backlog_hook = uring_backlog;
+
+    uring_arm_accept(r);
+    uring_arm_wake(r);
+
+    while (1) {
+        uring_flush(r);
+        if (uring_enter(r, 1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        uring_reap(r);
+    }
+
+    return NULL;
+}
+
+/*
+ * Create the ring, map its queues and register the provided buffers.
+ */
+static int uring_init(struct uring *r, int listen_fd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    r->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->ring_fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        r->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    char *cq_ptr = sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    // Ring of provided buffers for the multishot receives
+    r->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buf_base = malloc((size_t)URING_BUFFERS * CHUNK_SIZE);
+    if (r->buf_ring == MAP_FAILED || !r->buf_base) {
+        fprintf(stderr, "ERROR: failed to allocate io_uring receive buffers\n");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+    r->starved_tail = &r->starved;
+    for (unsigned short bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_provide(r, bid);
+    }
+
+    r->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (r->wake_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&r->post_lock, NULL);
+    r->posts = NULL;
+
+    r->listen_fd = listen_fd;
+    return 0;
+}
+
+int uring_start(int listen_fd) {
+    if (uring_init(&ring, listen_fd) == -1) {
+        return -1;
+    }
+    tu_post_hook = uring_post; // before any client is serviced, so before any other thread sends
+
+    // SIGHUP must reach the main thread so that it can shut the server down
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    int err = pthread_create(&ring.thread, NULL, uring_run, &ring);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (err != 0) {
+        fprintf(stderr, "ERROR: failed to create io_uring loop thread\n");
+        return -1;
+    }
+    pthread_detach(ring.thread);
+    return 0;
+}
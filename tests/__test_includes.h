@@ -1,5 +1,6 @@
 #include "pbx.h"
 #include "server.h"
+#include "command.h"
 
 #define QUOTE1(x) #x
 #define QUOTE(x) QUOTE1(x)
@@ -11,7 +12,7 @@
 #define SERVER_HOSTNAME "localhost"
 
 #define NUM_STATES 7
-#define NUM_COMMANDS 5
+#define NUM_COMMANDS 7
 #define DELAY_COMMAND (NUM_COMMANDS-1)
 
 #define ZERO_SEC { 0, 0 }
@@ -23,6 +24,14 @@
 #define QTR_SEC  { 0, 250000 }
 #define ONE_SEC { 1, 0 }
 
+/*
+ * Meta-command beyond those of server.h (clear of its special values, the
+ * last of which is TU_EOF_CMD): send the step's text to the server as a
+ * line, exactly as given, and read no response.  Lines that are not
+ * commands are ignored by the server.
+ */
+#define TU_LINE_CMD ((TU_COMMAND)(TU_EOF_CMD + 1))
+
 #define SERVER_STARTUP_SLEEP 1
 #define SERVER_SHUTDOWN_SLEEP 1
 
@@ -36,6 +45,10 @@ typedef struct test_step {
     TU_STATE response;		   // Expected response.
     struct timeval timeout;        // Limit on time to wait for response (zero for no limit)
                                    // or time to delay.
+    char *text;                    // Optional: what follows the command word, in place of
+                                   // the default (e.g. a number to dial), or the line itself
+                                   // for TU_LINE_CMD.  For other meta-commands, a line to
+                                   // wait for instead of the response.
 } TEST_STEP;
 
 int run_test_script(char *name, TEST_STEP *scr, int port);
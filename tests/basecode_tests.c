@@ -50,12 +50,32 @@ static void wait_for_no_server() {
     } while(1);
 }
 
-static void init() {
+#define MAX_SERVER_ARGS 20
+
+// Fill in the server's arguments: the port, the mode (unless NULL), then the options
+// given (NULL-terminated, or NULL)
+static void server_args(char *args[], char *mode, char *opts[]) {
+    int n = 0;
+    args[n++] = "pbx";
+    args[n++] = "-p";
+    args[n++] = SERVER_PORT_STR;
+    if(mode) {
+	args[n++] = "-m";
+	args[n++] = mode;
+    }
+    for(int i = 0; opts && opts[i] && n < MAX_SERVER_ARGS - 1; i++)
+	args[n++] = opts[i];
+    args[n] = NULL;
+}
+
+static void start_server_opts(char *mode, char *opts[]) {
+    char *args[MAX_SERVER_ARGS];
+    server_args(args, mode, opts);
     server_pid = 0;
     wait_for_no_server();
-    fprintf(stderr, "***Starting server...");
+    fprintf(stderr, "***Starting server (%s mode)...", mode);
     if((server_pid = fork()) == 0) {
-	execlp("bin/pbx", "pbx", "-p", SERVER_PORT_STR, NULL);
+	execvp("bin/pbx", args);
 	fprintf(stderr, "Failed to exec server\n");
 	abort();
     }
@@ -64,6 +84,52 @@ static void init() {
     wait_for_server();
 }
 
+static void start_server(char *mode) {
+    start_server_opts(mode, NULL);
+}
+
+/*
+ * Run the server with options that it should refuse, and return its exit status
+ * (-1 if it was killed by a signal).
+ */
+static int server_exit_status(char *opts[]) {
+    char *args[MAX_SERVER_ARGS];
+    int pid, ret;
+    server_args(args, NULL, opts);
+    wait_for_no_server();
+    if((pid = fork()) == 0) {
+	execvp("bin/pbx", args);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    waitpid(pid, &ret, 0);
+    return WIFEXITED(ret) ? WEXITSTATUS(ret) : -1;
+}
+
+// Create (or replace) a file holding the given text, for options that name a file
+static void write_file(char *path, char *text) {
+    FILE *f = fopen(path, "w");
+    cr_assert(f != NULL, "Can't create %s\n", path);
+    fputs(text, f);
+    fclose(f);
+}
+
+static void init() {
+    start_server("thread");
+}
+
+static void init_epoll() {
+    start_server("epoll");
+}
+
+static void init_reuseport() {
+    start_server("reuseport");
+}
+
+static void init_uring() {
+    start_server("uring");
+}
+
 static void fini(int chk) {
     int ret;
     cr_assert(server_pid != 0, "No server was started!\n");
@@ -183,3 +249,829 @@ Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
     fini(0);
 }
 #undef TEST_NAME
+
+#define TEST_NAME epoll_dial_answer_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME reuseport_dial_disconnect_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        2,           TU_RING_BACK,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_reuseport, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME uring_dial_answer_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_uring, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME dial_self_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        0,           TU_BUSY_SIGNAL, TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME epoll_dial_self_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        0,           TU_BUSY_SIGNAL, TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * Lines that are not quite commands are ignored, without a response, and
+ * "dial" allows extra spaces before the number and ignores what follows it.
+ * The command after a run of lines can be held up by Nagle's algorithm,
+ * hence its longer timeout.
+ */
+#define TEST_NAME command_syntax_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "pickup " },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "PICKUP" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "pick" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "" },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "dial" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "dial x" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "dial2" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "hangup now" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "chat" },
+    {   0,  TU_LINE_CMD,       -1,           -1,             ZERO_SEC,  "camp it" },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   0,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "   2 and the rest" },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define ASSIGNMENT_FILE "/tmp/pbx_tests_assignments"
+
+static void init_ranges() {
+    char *opts[] = { "-e", "100-101,500", NULL };
+    start_server_opts("thread", opts);
+}
+
+static void init_assignments() {
+    write_file(ASSIGNMENT_FILE, "# Clients on this host get 7\n127.0.0.1 7\n");
+    char *opts[] = { "-e", "1-10", "-a", ASSIGNMENT_FILE, NULL };
+    start_server_opts("thread", opts);
+}
+
+/*
+ * Clients get the lowest free number of the ranges given with -e, and a
+ * number is free again once its client has disconnected.
+ */
+#define TEST_NAME extension_ranges_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 100" },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 101" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 500" },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        2,           TU_RING_BACK,   TEN_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 101" },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_ranges, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * A client from an address assigned a number with -a gets that number,
+ * which is not handed out to anyone else.
+ */
+#define TEST_NAME extension_assignment_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 7" },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,       -1,           TU_BUSY_SIGNAL, TEN_MSEC,  "7" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 7" },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_assignments, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * The server refuses to start with numbering it can't use.
+ */
+#define TEST_NAME bad_numbering_test
+Test(SUITE, TEST_NAME, .fini = killall, .timeout = 30) {
+    char *backwards[] = { "-e", "5-1", NULL };
+    char *overlapping[] = { "-e", "1-3,2", NULL };
+    char *too_many[] = { "-e", "0-16777216", NULL };
+    char *assigned[] = { "-e", "1-3", "-a", ASSIGNMENT_FILE, NULL };
+    int ret;
+
+    ret = server_exit_status(backwards);
+    cr_assert_eq(ret, EXIT_FAILURE, "-e 5-1: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+    ret = server_exit_status(overlapping);
+    cr_assert_eq(ret, EXIT_FAILURE, "-e 1-3,2: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+    ret = server_exit_status(too_many);
+    cr_assert_eq(ret, EXIT_FAILURE, "-e 0-16777216: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+
+    write_file(ASSIGNMENT_FILE, "10.0.0.1 2\n10.0.0.2 2\n");
+    ret = server_exit_status(assigned);
+    cr_assert_eq(ret, EXIT_FAILURE, "Number assigned twice: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+    write_file(ASSIGNMENT_FILE, "10.0.0.1 9\n");
+    ret = server_exit_status(assigned);
+    cr_assert_eq(ret, EXIT_FAILURE, "Number outside -e: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+}
+#undef TEST_NAME
+
+/*
+ * The server refuses to start with an output limit or slow client policy it
+ * doesn't know (the policies themselves are tested in tu_tests.c).
+ */
+#define TEST_NAME bad_output_limit_test
+Test(SUITE, TEST_NAME, .fini = killall, .timeout = 30) {
+    char *zero[] = { "-q", "0", NULL };
+    char *negative[] = { "-q", "-5", NULL };
+    char *policy[] = { "-s", "block", NULL };
+    int ret;
+
+    ret = server_exit_status(zero);
+    cr_assert_eq(ret, EXIT_FAILURE, "-q 0: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+    ret = server_exit_status(negative);
+    cr_assert_eq(ret, EXIT_FAILURE, "-q -5: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+    ret = server_exit_status(policy);
+    cr_assert_eq(ret, EXIT_FAILURE, "-s block: expected exit status %d, was %d\n", EXIT_FAILURE, ret);
+}
+#undef TEST_NAME
+
+static void init_rooms() {
+    char *opts[] = { "-r", "100", NULL };
+    start_server_opts("thread", opts);
+}
+
+static void init_rooms_uring() {
+    char *opts[] = { "-r", "100", NULL };
+    start_server_opts("uring", opts);
+}
+
+/*
+ * Dialing a conference room connects to it straight away, a chat goes to
+ * every other member, and a member that hangs up hears no more.
+ */
+#define TEST_NAME conference_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "100" },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "100" },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "100" },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "hello" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CHAT hello" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CHAT hello" },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "still here" },
+    {   0,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CHAT still here" },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_rooms, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+
+#undef TEST_NAME
+
+#define TEST_NAME uring_conference_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "100" },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "100" },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "100" },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "hello" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CHAT hello" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CHAT hello" },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   TEN_MSEC,  "still here" },
+    {   0,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CHAT still here" },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_rooms_uring, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+static void init_paging() {
+    char *opts[] = { "-g", "1=2-3", NULL };
+    start_server_opts("thread", opts);
+}
+
+static void init_paging_uring() {
+    char *opts[] = { "-g", "1=2-3", NULL };
+    start_server_opts("uring", opts);
+}
+
+/*
+ * A page reaches every member of the group, whatever its state, and no one
+ * else; group 0 reaches everyone but the client paging.  The client paging
+ * gets its state back.
+ */
+#define TEST_NAME page_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 1" },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 2" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 3" },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 4" },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_PAGE_CMD,       -1,           TU_ON_HOOK,     TEN_MSEC,  "1 hello group" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello group" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello group" },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_PAGE_CMD,       -1,           TU_ON_HOOK,     TEN_MSEC,  "0 hello all" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello all" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello all" },
+    {   3,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello all" },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_paging, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME uring_page_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 1" },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 2" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 3" },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 4" },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_PAGE_CMD,       -1,           TU_ON_HOOK,     TEN_MSEC,  "1 hello group" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello group" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello group" },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_PAGE_CMD,       -1,           TU_ON_HOOK,     TEN_MSEC,  "0 hello all" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello all" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello all" },
+    {   3,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "PAGE 1 hello all" },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_paging_uring, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+static void init_hunt() {
+    char *opts[] = { "-u", "500=1-3", NULL };
+    start_server_opts("thread", opts);
+}
+
+/*
+ * Dialing a hunt group rings the agent that has been on hook the longest,
+ * skips agents that are off hook, and gives busy signal when there is none.
+ */
+#define TEST_NAME hunt_group_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 1" },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 2" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 3" },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 4" },
+    {   4,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 5" },
+    // Extension 1 has been on hook the longest
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   3,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CONNECTED 1" },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    // Extension 1 went back on hook last, so 2 is next
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   3,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CONNECTED 2" },
+    // 3 off hook and 2 in a call leave only 1
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   4,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   4,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   4,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_ON_HOOK,     FTY_MSEC },
+    // No agent on hook at all
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   4,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   4,  TU_DIAL_CMD,       -1,           TU_BUSY_SIGNAL, TEN_MSEC,  "500" },
+    {   4,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_hunt, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+static void init_queue() {
+    char *opts[] = { "-w", "500=1", NULL };
+    start_server_opts("thread", opts);
+}
+
+/*
+ * Callers that find the only agent of a call queue busy wait in RING BACK,
+ * told their place, and the agent is rung for them in turn once it hangs
+ * up.  A caller that hangs up leaves the queue.
+ */
+#define TEST_NAME call_queue_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 1" },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 2" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 3" },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 4" },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CONNECTED 1" },
+    // Two callers wait
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "QUEUED 1" },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   3,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "QUEUED 2" },
+    // The first of them gets the agent when it hangs up
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CONNECTED 1" },
+    // Another joins behind the second, who then gives up
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,       -1,           TU_RING_BACK,   TEN_MSEC,  "500" },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "QUEUED 2" },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CONNECTED 1" },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_queue, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * A caller that gets busy signal and camps is called back when the other
+ * goes on hook: the other rings and the caller is put in RING BACK.
+ */
+#define TEST_NAME camp_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 1" },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 2" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC,  "ON HOOK 3" },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,        1,           TU_BUSY_SIGNAL, TEN_MSEC },
+    {   2,  TU_CAMP_CMD,       -1,           TU_BUSY_SIGNAL, TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_RING_BACK,   FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           -1,             FTY_MSEC,  "CONNECTED 2" },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * Raw clients, for tests with more clients or more concurrency than a
+ * script can express.
+ */
+
+// Connect to the server, returning the socket or -1
+static int raw_connect(void) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(SERVER_PORT) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+// Send a line to the server
+static int raw_send(int fd, char *line) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "%s" EOL, line);
+    return send(fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// Wait up to ms milliseconds for something to read; 1 if there is, 0 if not
+static int raw_wait(int fd, int ms) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    struct timeval tv = { ms / 1000, ms % 1000 * 1000 };
+    return select(fd + 1, &set, NULL, NULL, &tv) > 0;
+}
+
+/*
+ * Read what the server has sent until it has been quiet for ms
+ * milliseconds, keeping the last complete line (without its EOL) in last.
+ * Returns 1 if the connection was closed, otherwise 0.
+ */
+static int raw_last_line(int fd, int ms, char *last, size_t size) {
+    char buf[4096], line[256];
+    size_t used = 0;
+    last[0] = '\0';
+    while(raw_wait(fd, ms)) {
+	ssize_t n = recv(fd, buf, sizeof(buf), 0);
+	if(n <= 0) return 1;
+	for(ssize_t i = 0; i < n; i++) {
+	    if(used < sizeof(line) - 1) line[used++] = buf[i];
+	    if(used >= 2 && line[used - 2] == '\r' && line[used - 1] == '\n') {
+		line[used - 2] = '\0';
+		snprintf(last, size, "%s", line);
+		used = 0;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * Read one line (without its EOL) from the server, waiting up to ms
+ * milliseconds for each part of it.  Returns 0 if a line was read, -1 if
+ * the wait ran out, 1 if the connection was closed.
+ */
+static int raw_read_line(int fd, int ms, char *line, size_t size) {
+    size_t used = 0;
+    while(raw_wait(fd, ms)) {
+	char c;
+	if(recv(fd, &c, 1, 0) <= 0) return 1;
+	if(used < size - 1) line[used++] = c;
+	if(used >= 2 && line[used - 2] == '\r' && line[used - 1] == '\n') {
+	    line[used - 2] = '\0';
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/*
+ * Close a client's connection with a reset, so the server's end, closed
+ * first, is torn down rather than left in TIME_WAIT holding the port.
+ */
+static void raw_abort(int fd) {
+    struct linger l = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    close(fd);
+}
+
+#define MANY_CLIENTS 600 // enough for the shutdown to be split among threads
+
+/*
+ * With many clients connected, the server shuts down promptly on SIGHUP,
+ * with exit status 0, and every client's connection is closed.
+ */
+static void many_clients_shutdown(void) {
+    static int fds[MANY_CLIENTS];
+    char line[256];
+    for(int i = 0; i < MANY_CLIENTS; i++) {
+	fds[i] = raw_connect();
+	cr_assert(fds[i] != -1, "Can't connect client %d\n", i);
+    }
+    for(int i = 0; i < MANY_CLIENTS; i++) {
+	int ret = raw_read_line(fds[i], 5000, line, sizeof(line));
+	cr_assert(ret == 0 && strncmp(line, "ON HOOK ", 8) == 0, "Client %d was not registered\n", i);
+    }
+
+    fini(1);
+
+    int closed = 0;
+    for(int i = 0; i < MANY_CLIENTS; i++) {
+	closed += raw_read_line(fds[i], 1000, line, sizeof(line)) == 1;
+	raw_abort(fds[i]);
+    }
+    cr_assert_eq(closed, MANY_CLIENTS, "Only %d of %d connections were closed\n", closed, MANY_CLIENTS);
+}
+
+#define TEST_NAME many_clients_shutdown_test
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 60) {
+    many_clients_shutdown();
+}
+#undef TEST_NAME
+
+#define TEST_NAME epoll_many_clients_shutdown_test
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 60) {
+    many_clients_shutdown();
+}
+#undef TEST_NAME
+
+#define TEST_NAME uring_many_clients_shutdown_test
+Test(SUITE, TEST_NAME, .init = init_uring, .fini = killall, .timeout = 60) {
+    many_clients_shutdown();
+}
+#undef TEST_NAME
+
+#define STRESS_THREADS 4
+#define STRESS_CLIENTS_PER_THREAD 4
+#define STRESS_CLIENTS (STRESS_THREADS * STRESS_CLIENTS_PER_THREAD)
+#define STRESS_OPS 500
+
+static int stress_fds[STRESS_CLIENTS];
+static int stress_exts[STRESS_CLIENTS];
+
+// Pick up, dial, chat and hang up at random on one thread's clients, reading whatever comes back
+static void *stress_thread(void *arg) {
+    int first = (int)(long)arg * STRESS_CLIENTS_PER_THREAD;
+    unsigned seed = first + 1;
+    char cmd[64], buf[4096];
+    for(int op = 0; op < STRESS_OPS; op++) {
+	int fd = stress_fds[first + rand_r(&seed) % STRESS_CLIENTS_PER_THREAD];
+	switch(rand_r(&seed) % 4) {
+	case 0: raw_send(fd, "pickup"); break;
+	case 1: raw_send(fd, "hangup"); break;
+	case 2:
+	    snprintf(cmd, sizeof(cmd), "dial %d", stress_exts[rand_r(&seed) % STRESS_CLIENTS]); // itself included
+	    raw_send(fd, cmd);
+	    break;
+	case 3: raw_send(fd, "chat hello"); break;
+	}
+	for(int i = first; i < first + STRESS_CLIENTS_PER_THREAD; i++) {
+	    while(recv(stress_fds[i], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Clients dialing each other, answering and hanging up all at once, on
+ * threads of their own: the server neither deadlocks nor crashes, every
+ * client ends up on hook once all have hung up, and the server exits
+ * cleanly.
+ */
+static void dial_hangup_stress(void) {
+    char line[256];
+    for(int i = 0; i < STRESS_CLIENTS; i++) {
+	stress_fds[i] = raw_connect();
+	cr_assert(stress_fds[i] != -1, "Can't connect client %d\n", i);
+	int ret = raw_read_line(stress_fds[i], 5000, line, sizeof(line));
+	cr_assert(ret == 0 && sscanf(line, "ON HOOK %d", &stress_exts[i]) == 1, "Client %d was not registered\n", i);
+    }
+
+    pthread_t tids[STRESS_THREADS];
+    for(long t = 0; t < STRESS_THREADS; t++)
+	pthread_create(&tids[t], NULL, stress_thread, (void *)t);
+    for(int t = 0; t < STRESS_THREADS; t++)
+	pthread_join(tids[t], NULL);
+
+    for(int i = 0; i < STRESS_CLIENTS; i++)
+	raw_send(stress_fds[i], "hangup");
+    for(int i = 0; i < STRESS_CLIENTS; i++) {
+	char expected[32];
+	snprintf(expected, sizeof(expected), "ON HOOK %d", stress_exts[i]);
+	int closed = raw_last_line(stress_fds[i], 300, line, sizeof(line));
+	cr_assert(!closed, "Client %d was disconnected\n", i);
+	cr_assert(strcmp(line, expected) == 0, "Client %d ended with '%s', expected '%s'\n", i, line, expected);
+    }
+
+    // Still serving new clients
+    int fd = raw_connect();
+    cr_assert(fd != -1 && raw_read_line(fd, 5000, line, sizeof(line)) == 0 && strncmp(line, "ON HOOK ", 8) == 0,
+	      "Server no longer registers clients\n");
+    close(fd);
+    for(int i = 0; i < STRESS_CLIENTS; i++)
+	close(stress_fds[i]);
+    fini(1);
+}
+
+#define TEST_NAME dial_hangup_stress_test
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 60) {
+    dial_hangup_stress();
+}
+#undef TEST_NAME
+
+#define TEST_NAME epoll_dial_hangup_stress_test
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 60) {
+    dial_hangup_stress();
+}
+#undef TEST_NAME
+
+#define TEST_NAME reuseport_dial_hangup_stress_test
+Test(SUITE, TEST_NAME, .init = init_reuseport, .fini = killall, .timeout = 60) {
+    dial_hangup_stress();
+}
+#undef TEST_NAME
+
+#define TEST_NAME uring_dial_hangup_stress_test
+Test(SUITE, TEST_NAME, .init = init_uring, .fini = killall, .timeout = 60) {
+    dial_hangup_stress();
+}
+#undef TEST_NAME
@@ -0,0 +1,105 @@
+/*
+ * Unit tests of the extension table: slots stay put and stay findable while
+ * the directory grows under readers.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "rcu.h"
+#include "exttable.h"
+
+// What the tests store in the slot of ext: never dereferenced by the table
+#define MARK(ext) ((TU *)(uintptr_t)(((ext) + 1) * 8))
+
+#define SUITE exttable_suite
+
+Test(SUITE, slots_are_stable_across_growth, .timeout = 30) {
+    EXT_TABLE *t = ext_table_init();
+    cr_assert(t, "ext_table_init failed\n");
+
+    rcu_read_lock();
+    cr_assert_null(ext_table_lookup(t, 5), "slot found for a number never used\n");
+    rcu_read_unlock();
+    cr_assert_null(ext_table_slot(t, -1), "slot created for a negative number\n");
+
+    // Numbers far apart, each one past the end of the directory as it stands
+    static const int exts[] = { 0, 1, 63, 64, 1000, 65536, 1000000, 9999999, 123456789, 2147483647 };
+    enum { NEXTS = sizeof(exts) / sizeof(exts[0]) };
+    _Atomic(TU *) *slots[NEXTS];
+    for (int i = 0; i < NEXTS; i++) {
+        slots[i] = ext_table_slot(t, exts[i]);
+        cr_assert(slots[i], "no slot for %d\n", exts[i]);
+        atomic_store(slots[i], MARK(exts[i]));
+    }
+
+    rcu_read_lock();
+    for (int i = 0; i < NEXTS; i++) {
+        cr_assert_eq(ext_table_lookup(t, exts[i]), slots[i], "slot of %d moved\n", exts[i]);
+        cr_assert_eq(atomic_load(slots[i]), MARK(exts[i]), "slot of %d lost its TU\n", exts[i]);
+    }
+    cr_assert_null(ext_table_lookup(t, 500000), "slot found in a page never used\n");
+    rcu_read_unlock();
+
+    ext_table_fini(t);
+}
+
+Test(SUITE, memory_follows_numbers_in_use, .timeout = 30) {
+    EXT_TABLE *t = ext_table_init();
+    cr_assert(t, "ext_table_init failed\n");
+
+    // A 7-digit dial plan with a thousand numbers in use: a page each, and a directory of 2 MiB at most
+    for (int i = 0; i < 1000; i++) {
+        cr_assert(ext_table_slot(t, 1000000 + i * 9000), "no slot for %d\n", 1000000 + i * 9000);
+    }
+    size_t pages = 1000 * EXT_TABLE_PAGE_SIZE * sizeof(TU *);
+    size_t most = pages + 2 * 1024 * 1024 + 64 * 1024; // and a little for the headers
+    cr_assert(ext_table_memory(t) <= most, "table takes %zu bytes, expected %zu at most\n", ext_table_memory(t), most);
+    ext_table_fini(t);
+}
+
+#define NREADERS 4
+#define NPUBLISHED 200000
+
+static EXT_TABLE *table;
+static atomic_int published; // numbers below this have their slot filled
+static atomic_long wrong;
+
+// Look up published numbers, high and low, while the table grows
+static void *lookup_thread(void *arg) {
+    unsigned seed = (uintptr_t)arg;
+    int n;
+    while ((n = atomic_load(&published)) < NPUBLISHED) {
+        if (n == 0) continue;
+        int ext = rand_r(&seed) % 2 ? n - 1 : rand_r(&seed) % n;
+        rcu_read_lock();
+        _Atomic(TU *) *slot = ext_table_lookup(table, ext);
+        if (!slot || atomic_load_explicit(slot, memory_order_acquire) != MARK(ext)) atomic_fetch_add(&wrong, 1);
+        rcu_read_unlock();
+    }
+    return NULL;
+}
+
+Test(SUITE, lookups_during_growth, .timeout = 60) {
+    table = ext_table_init();
+    cr_assert(table, "ext_table_init failed\n");
+
+    pthread_t tids[NREADERS];
+    for (int i = 0; i < NREADERS; i++) pthread_create(&tids[i], NULL, lookup_thread, (void *)(uintptr_t)(i + 1));
+
+    for (int ext = 0; ext < NPUBLISHED; ext++) {
+        _Atomic(TU *) *slot = ext_table_slot(table, ext);
+        cr_assert(slot, "no slot for %d\n", ext);
+        atomic_store_explicit(slot, MARK(ext), memory_order_release);
+        atomic_store(&published, ext + 1);
+    }
+    for (int i = 0; i < NREADERS; i++) pthread_join(tids[i], NULL);
+
+    cr_assert_eq(atomic_load(&wrong), 0, "%ld lookups missed a published slot\n", atomic_load(&wrong));
+    ext_table_fini(table);
+}
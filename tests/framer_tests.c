@@ -0,0 +1,214 @@
+/*
+ * Unit tests of the line framer: lines must come out the same however the
+ * stream is split into reads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h" // for EOL
+#include "session.h" // for CHUNK_SIZE
+#include "framer.h"
+
+#define MAX_LINES 1024
+
+// The lines a framer has handed over, copied
+typedef struct lines {
+    int n;
+    char *line[MAX_LINES];
+    size_t len[MAX_LINES];
+} LINES;
+
+static void collect(void *arg, char *line, size_t len) {
+    LINES *l = arg;
+    if (l->n == MAX_LINES) return;
+    l->line[l->n] = malloc(len + 1);
+    memcpy(l->line[l->n], line, len + 1);
+    l->len[l->n] = len;
+    l->n++;
+}
+
+static void lines_free(LINES *l) {
+    for (int i = 0; i < l->n; i++) free(l->line[i]);
+    l->n = 0;
+}
+
+// Whether two sets of lines are the same
+static int lines_equal(LINES *a, LINES *b) {
+    if (a->n != b->n) return 0;
+    for (int i = 0; i < a->n; i++) {
+        if (a->len[i] != b->len[i] || memcmp(a->line[i], b->line[i], a->len[i]) != 0) return 0;
+    }
+    return 1;
+}
+
+// Feed a stream to a fresh framer in reads of the given sizes (the last one repeated), collecting its lines
+static int frame(const char *stream, size_t len, const size_t *reads, int nreads, LINES *out) {
+    FRAMER f;
+    framer_init(&f);
+    char *copy = malloc(len + 1); // the framer writes into what it is given
+    memcpy(copy, stream, len);
+
+    int ret = 0;
+    size_t off = 0;
+    for (int i = 0; off < len && ret == 0; i++) {
+        size_t n = reads[i < nreads ? i : nreads - 1];
+        if (n > len - off) n = len - off;
+        ret = framer_input(&f, copy + off, n, collect, out);
+        off += n;
+    }
+
+    framer_fini(&f);
+    free(copy);
+    return ret;
+}
+
+#define SUITE framer_suite
+
+Test(SUITE, eol_split_across_reads, .timeout = 10) {
+    LINES l = { 0 };
+    FRAMER f;
+    framer_init(&f);
+    char a[] = "pickup\r";
+    char b[] = "\nhangup\r";
+    char c[] = "\n";
+    cr_assert_eq(framer_input(&f, a, strlen(a), collect, &l), 0, "framer_input failed\n");
+    cr_assert_eq(l.n, 0, "a line was handed over before its EOL was complete\n");
+    cr_assert_eq(framer_input(&f, b, strlen(b), collect, &l), 0, "framer_input failed\n");
+    cr_assert_eq(framer_input(&f, c, strlen(c), collect, &l), 0, "framer_input failed\n");
+    framer_fini(&f);
+
+    cr_assert_eq(l.n, 2, "expected 2 lines, got %d\n", l.n);
+    cr_assert(strcmp(l.line[0], "pickup") == 0, "first line was '%s'\n", l.line[0]);
+    cr_assert(strcmp(l.line[1], "hangup") == 0, "second line was '%s'\n", l.line[1]);
+    lines_free(&l);
+}
+
+Test(SUITE, every_split_point, .timeout = 10) {
+    // Stray CRs and LFs are part of a line; only CR LF ends one
+    const char stream[] = "pickup\r\ndial 5\r\n\r\nchat a\rb\nc\r\r\n\n\r\nhangup\r\npartial";
+    size_t len = sizeof(stream) - 1;
+
+    LINES whole = { 0 };
+    size_t all = len;
+    cr_assert_eq(frame(stream, len, &all, 1, &whole), 0, "framer_input failed\n");
+    cr_assert_eq(whole.n, 6, "expected 6 lines, got %d\n", whole.n);
+    cr_assert(strcmp(whole.line[3], "chat a\rb\nc\r") == 0, "stray CR/LF mishandled: '%s'\n", whole.line[3]);
+    cr_assert(strcmp(whole.line[4], "\n") == 0, "stray LF mishandled: '%s'\n", whole.line[4]);
+
+    for (size_t k = 1; k < len; k++) {
+        LINES split = { 0 };
+        size_t reads[] = { k, len };
+        cr_assert_eq(frame(stream, len, reads, 2, &split), 0, "framer_input failed\n");
+        cr_assert(lines_equal(&whole, &split), "lines differ when the stream is split at %zu\n", k);
+        lines_free(&split);
+    }
+
+    for (size_t k = 1; k <= 3; k++) { // and a few bytes at a time
+        LINES bytes = { 0 };
+        cr_assert_eq(frame(stream, len, &k, 1, &bytes), 0, "framer_input failed\n");
+        cr_assert(lines_equal(&whole, &bytes), "lines differ when read %zu bytes at a time\n", k);
+        lines_free(&bytes);
+    }
+    lines_free(&whole);
+}
+
+Test(SUITE, lines_longer_than_a_chunk, .timeout = 10) {
+    size_t long_len = 3 * CHUNK_SIZE + 5;
+    size_t len = long_len + 2 + 4 + 2 + long_len + 2;
+    char *stream = malloc(len);
+    char *p = stream;
+    for (size_t i = 0; i < long_len; i++) *p++ = 'a' + i % 26;
+    memcpy(p, EOL "ab" EOL, 6); // a short line right after
+    p += 6;
+    for (size_t i = 0; i < long_len; i++) *p++ = 'A' + i % 26;
+    memcpy(p, EOL, 2);
+
+    size_t chunk = CHUNK_SIZE;
+    LINES l = { 0 };
+    cr_assert_eq(frame(stream, len, &chunk, 1, &l), 0, "framer_input failed\n");
+    cr_assert_eq(l.n, 3, "expected 3 lines, got %d\n", l.n);
+    cr_assert_eq(l.len[0], long_len, "first long line has length %zu, expected %zu\n", l.len[0], long_len);
+    cr_assert(memcmp(l.line[0], stream, long_len) == 0, "first long line was garbled\n");
+    cr_assert(strcmp(l.line[1], "ab") == 0, "short line was '%s'\n", l.line[1]);
+    cr_assert_eq(l.len[2], long_len, "second long line has length %zu, expected %zu\n", l.len[2], long_len);
+    cr_assert(memcmp(l.line[2], stream + long_len + 6, long_len) == 0, "second long line was garbled\n");
+    lines_free(&l);
+
+    // Chunk boundaries falling inside the EOL of a long line
+    size_t reads[] = { long_len + 1, 1, CHUNK_SIZE };
+    cr_assert_eq(frame(stream, len, reads, 3, &l), 0, "framer_input failed\n");
+    cr_assert_eq(l.n, 3, "expected 3 lines with the EOL split, got %d\n", l.n);
+    cr_assert_eq(l.len[0], long_len, "long line with split EOL has length %zu\n", l.len[0]);
+    lines_free(&l);
+    free(stream);
+}
+
+static const char *scanner_names[] = { "scalar", "sse2", "avx2" };
+#define NSCANNERS (sizeof(scanner_names) / sizeof(scanner_names[0]))
+
+// Fill a stream with bytes drawn mostly from CR, LF and one letter, so EOLs, stray halves and runs abound
+static void random_stream(char *s, size_t len, unsigned *seed) {
+    static const char alphabet[] = "\r\n\r\nx\rx\nxyz";
+    for (size_t i = 0; i < len; i++) {
+        s[i] = alphabet[rand_r(seed) % (sizeof(alphabet) - 1)];
+    }
+}
+
+Test(SUITE, scanners_agree_on_eol_position, .timeout = 10) {
+    // A single EOL at every offset across several vector widths, with and without a CR just before it
+    char stream[200];
+    for (size_t k = 0; k + 2 <= sizeof(stream); k++) {
+        for (int cr_before = 0; cr_before <= 1; cr_before++) {
+            if (cr_before && k == 0) continue;
+            memset(stream, 'x', sizeof(stream));
+            memcpy(stream + k, EOL, 2);
+            if (cr_before) stream[k - 1] = '\r';
+            for (size_t i = 0; i < NSCANNERS; i++) {
+                if (framer_use_scanner(scanner_names[i]) == -1) continue; // this CPU can't run it
+                LINES l = { 0 };
+                size_t all = sizeof(stream);
+                cr_assert_eq(frame(stream, sizeof(stream), &all, 1, &l), 0, "framer_input failed\n");
+                cr_assert_eq(l.n, 1, "%s: expected 1 line with EOL at %zu, got %d\n", scanner_names[i], k, l.n);
+                cr_assert_eq(l.len[0], k, "%s: EOL at %zu found at %zu\n", scanner_names[i], k, l.len[0]);
+                lines_free(&l);
+            }
+        }
+    }
+}
+
+Test(SUITE, scanners_agree_on_random_streams, .timeout = 30) {
+    unsigned seed = 12345;
+    static const size_t read_sizes[] = { 1, 7, 16, 17, 31, 32, 33, 63, 64, 65, 100, CHUNK_SIZE };
+    char stream[4096];
+
+    int tested = 0;
+    for (size_t i = 0; i < NSCANNERS; i++) {
+        if (framer_use_scanner(scanner_names[i]) == 0) tested++;
+        else fprintf(stderr, "Scanner %s not supported on this CPU - not tested\n", scanner_names[i]);
+    }
+    cr_assert(tested >= 1, "no scanner could be selected\n");
+
+    for (int round = 0; round < 200; round++) {
+        size_t len = 1 + rand_r(&seed) % sizeof(stream);
+        random_stream(stream, len, &seed);
+        size_t reads = read_sizes[round % (sizeof(read_sizes) / sizeof(read_sizes[0]))];
+
+        LINES expected = { 0 };
+        cr_assert_eq(framer_use_scanner("scalar"), 0, "the scalar scanner must always be available\n");
+        cr_assert_eq(frame(stream, len, &reads, 1, &expected), 0, "framer_input failed\n");
+
+        for (size_t i = 1; i < NSCANNERS; i++) {
+            if (framer_use_scanner(scanner_names[i]) == -1) continue;
+            LINES got = { 0 };
+            cr_assert_eq(frame(stream, len, &reads, 1, &got), 0, "framer_input failed\n");
+            cr_assert(lines_equal(&expected, &got), "%s disagrees with scalar on round %d (%zu bytes read %zu at a time)\n",
+                      scanner_names[i], round, len, reads);
+            lines_free(&got);
+        }
+        lines_free(&expected);
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * Unit tests of the PBX registry, run in-process with a PBX of their own:
+ * each TU is given one end of a socket pair, as if a client had connected.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "tu_ext.h"
+
+// A TU on one end of a socket pair, whose other end is stored in *client
+static TU *unit_tu(int *client) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) return NULL;
+    TU *tu = tu_init(sv[0]);
+    if (!tu) return NULL;
+    *client = sv[1];
+    return tu;
+}
+
+#define SUITE pbx_suite
+
+#define NTHREADS 8
+#define NEXTS 16 // extensions each thread registers on, spread over the stripes
+#define ROUNDS 2000
+
+typedef struct churn {
+    PBX *pbx;
+    int id;
+    int failures; // operations that should have succeeded but didn't
+} CHURN;
+
+// The extension number a thread uses for its i-th TU: neighbours belong to other threads
+static int churn_ext(int id, int i) {
+    return i * NTHREADS + id;
+}
+
+/*
+ * Register, dial about and unregister, over and over, on this thread's own
+ * extensions, while the other threads do the same on theirs.
+ */
+static void *churn_thread(void *arg) {
+    CHURN *c = arg;
+    unsigned seed = c->id;
+    for (int round = 0; round < ROUNDS; round++) {
+        int i = round % NEXTS, client;
+        int ext = churn_ext(c->id, i);
+        TU *tu = unit_tu(&client);
+        if (!tu) {
+            c->failures++;
+            continue;
+        }
+        if (pbx_register(c->pbx, tu, ext) == -1) c->failures++; // it was unregistered last time round
+        tu_pickup(tu);
+        pbx_dial(c->pbx, tu, rand_r(&seed) % (NTHREADS * NEXTS)); // anyone's - registered or not
+        tu_hangup(tu);
+        if (pbx_unregister(c->pbx, tu) == -1) c->failures++;
+        tu_unref(tu, "test");
+        close(client);
+    }
+    return NULL;
+}
+
+Test(SUITE, concurrent_register_dial_unregister, .timeout = 60) {
+    PBX *pbx = pbx_init();
+    cr_assert(pbx, "pbx_init failed\n");
+
+    pthread_t tids[NTHREADS];
+    CHURN churn[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++) {
+        churn[i] = (CHURN){ .pbx = pbx, .id = i };
+        pthread_create(&tids[i], NULL, churn_thread, &churn[i]);
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        pthread_join(tids[i], NULL);
+        cr_assert_eq(churn[i].failures, 0, "thread %d had %d operations fail\n", i, churn[i].failures);
+    }
+
+    // Every extension was left free, and can be registered again exactly once
+    TU *tus[NTHREADS * NEXTS];
+    int clients[NTHREADS * NEXTS];
+    for (int ext = 0; ext < NTHREADS * NEXTS; ext++) {
+        tus[ext] = unit_tu(&clients[ext]);
+        cr_assert(tus[ext], "can't create TU\n");
+        cr_assert_eq(pbx_register(pbx, tus[ext], ext), 0, "extension %d was left registered\n", ext);
+        int client;
+        TU *dup = unit_tu(&client);
+        cr_assert_eq(pbx_register(pbx, dup, ext), -1, "extension %d registered twice\n", ext);
+        tu_unref(dup, "test");
+        close(client);
+    }
+    for (int ext = 0; ext < NTHREADS * NEXTS; ext++) {
+        pbx_unregister(pbx, tus[ext]);
+        tu_unref(tus[ext], "test");
+        close(clients[ext]);
+    }
+    pbx_shutdown(pbx); // returns only once every unregistered TU has been released
+}
@@ -0,0 +1,192 @@
+/*
+ * Unit tests of RCU: nothing is reclaimed while a reader that might still
+ * see it is inside its read-side critical section.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "rcu.h"
+
+#define SUITE rcu_suite
+
+// A reader that stays inside its critical section until told to leave
+typedef struct held_reader {
+    pthread_t thread;
+    atomic_int inside;
+    atomic_int leave;
+} HELD_READER;
+
+static void *held_reader_thread(void *arg) {
+    HELD_READER *h = arg;
+    rcu_read_lock();
+    rcu_read_lock(); // nested: only the outermost unlock leaves
+    atomic_store(&h->inside, 1);
+    while (!atomic_load(&h->leave)) usleep(1000);
+    rcu_read_unlock();
+    atomic_store(&h->inside, 2); // still inside the outer section
+    usleep(100 * 1000);
+    rcu_read_unlock();
+    return NULL;
+}
+
+static void held_reader_start(HELD_READER *h) {
+    atomic_init(&h->inside, 0);
+    atomic_init(&h->leave, 0);
+    pthread_create(&h->thread, NULL, held_reader_thread, h);
+    while (!atomic_load(&h->inside)) usleep(1000);
+}
+
+static atomic_int synchronized;
+
+static void *synchronize_thread(void *arg) {
+    (void)arg;
+    rcu_synchronize();
+    atomic_store(&synchronized, 1);
+    return NULL;
+}
+
+Test(SUITE, synchronize_waits_for_reader, .timeout = 30) {
+    HELD_READER h;
+    held_reader_start(&h);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, synchronize_thread, NULL);
+    usleep(100 * 1000);
+    cr_assert_eq(atomic_load(&synchronized), 0, "rcu_synchronize returned with a reader inside\n");
+
+    atomic_store(&h.leave, 1);
+    while (atomic_load(&h.inside) != 2) usleep(1000);
+    cr_assert_eq(atomic_load(&synchronized), 0, "rcu_synchronize returned inside a nested section\n");
+
+    pthread_join(h.thread, NULL);
+    pthread_join(tid, NULL);
+    cr_assert_eq(atomic_load(&synchronized), 1, "rcu_synchronize did not return\n");
+}
+
+typedef struct counted {
+    RCU_HEAD head;
+    atomic_int *ran;
+} COUNTED;
+
+static void count_callback(RCU_HEAD *head) {
+    COUNTED *c = (COUNTED *)head;
+    atomic_fetch_add(c->ran, 1);
+}
+
+Test(SUITE, call_rcu_waits_for_reader, .timeout = 30) {
+    HELD_READER h;
+    held_reader_start(&h);
+
+    atomic_int ran = 0;
+    COUNTED c = { .ran = &ran };
+    call_rcu(&c.head, count_callback); // returns at once, with the reader inside
+    usleep(100 * 1000);
+    cr_assert_eq(atomic_load(&ran), 0, "callback ran with a reader inside\n");
+
+    atomic_store(&h.leave, 1);
+    pthread_join(h.thread, NULL);
+    rcu_barrier();
+    cr_assert_eq(atomic_load(&ran), 1, "callback did not run by rcu_barrier\n");
+}
+
+#define NCALLBACKS 1000
+
+typedef struct ordered {
+    RCU_HEAD head;
+    int seq;
+} ORDERED;
+
+static int next_seq;
+static int out_of_order;
+
+static void order_callback(RCU_HEAD *head) {
+    ORDERED *o = (ORDERED *)head;
+    if (o->seq != next_seq++) out_of_order++;
+}
+
+Test(SUITE, callbacks_run_in_order, .timeout = 30) {
+    static ORDERED o[NCALLBACKS];
+    for (int i = 0; i < NCALLBACKS; i++) {
+        o[i].seq = i;
+        call_rcu(&o[i].head, order_callback);
+        if (i % 100 == 0) usleep(1000); // spread over several batches
+    }
+    rcu_barrier();
+    cr_assert_eq(next_seq, NCALLBACKS, "%d of %d callbacks ran by rcu_barrier\n", next_seq, NCALLBACKS);
+    cr_assert_eq(out_of_order, 0, "%d callbacks ran out of order\n", out_of_order);
+}
+
+/*
+ * Readers check an object they found through a shared pointer, while a
+ * writer keeps replacing it and marking each one it replaced dead once a
+ * grace period has passed: no reader may ever find a dead one.  (Readers
+ * sleeping inside is only for the test.)
+ */
+#define NREADERS 4
+#define NOBJECTS 2000
+#define LIVE 1
+#define DEAD 2
+
+typedef struct object {
+    RCU_HEAD head;
+    atomic_int state;
+} OBJECT;
+
+static _Atomic(OBJECT *) shared;
+static atomic_int writer_done;
+static atomic_long dead_seen;
+static atomic_int readers_started;
+
+static void *checking_reader(void *arg) {
+    (void)arg;
+    atomic_fetch_add(&readers_started, 1);
+    while (!atomic_load(&writer_done)) {
+        rcu_read_lock();
+        OBJECT *obj = atomic_load_explicit(&shared, memory_order_acquire);
+        if (atomic_load(&obj->state) != LIVE) atomic_fetch_add(&dead_seen, 1);
+        usleep(50); // stay inside while the writer replaces it, even on one CPU
+        if (atomic_load(&obj->state) != LIVE) atomic_fetch_add(&dead_seen, 1);
+        rcu_read_unlock();
+    }
+    return NULL;
+}
+
+static void kill_callback(RCU_HEAD *head) {
+    atomic_store(&((OBJECT *)head)->state, DEAD); // kept, not freed, so a reader that sees it can say so
+}
+
+Test(SUITE, readers_never_see_reclaimed_objects, .timeout = 60) {
+    OBJECT *objects = calloc(NOBJECTS, sizeof(OBJECT));
+    atomic_init(&objects[0].state, LIVE);
+    atomic_store(&shared, &objects[0]);
+
+    pthread_t tids[NREADERS];
+    for (int i = 0; i < NREADERS; i++) pthread_create(&tids[i], NULL, checking_reader, NULL);
+    while (atomic_load(&readers_started) < NREADERS) usleep(1000);
+
+    for (int i = 1; i < NOBJECTS; i++) {
+        atomic_init(&objects[i].state, LIVE);
+        OBJECT *old = atomic_exchange_explicit(&shared, &objects[i], memory_order_acq_rel);
+        if (i % 2) call_rcu(&old->head, kill_callback); // both ways of waiting
+        else {
+            rcu_synchronize();
+            kill_callback(&old->head);
+        }
+        usleep(20); // let the readers find the new one
+    }
+    rcu_barrier();
+    atomic_store(&writer_done, 1);
+    for (int i = 0; i < NREADERS; i++) pthread_join(tids[i], NULL);
+
+    cr_assert_eq(atomic_load(&dead_seen), 0, "readers saw %ld reclaimed objects\n", atomic_load(&dead_seen));
+    for (int i = 0; i < NOBJECTS - 1; i++) {
+        cr_assert_eq(atomic_load(&objects[i].state), DEAD, "object %d was never reclaimed\n", i);
+    }
+    free(objects);
+}
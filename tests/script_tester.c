@@ -15,7 +15,7 @@
 #include "debug.h"
 
 #define NUM_STATES 7
-#define NUM_COMMANDS 5
+#define NUM_COMMANDS 7
 #define DELAY_COMMAND (NUM_COMMANDS-1)
 
 /*
@@ -69,6 +69,8 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
       1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_HANGUP_CMD
       1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_DIAL_CMD
       1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_CHAT_CMD
+      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_PAGE_CMD
+      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC) | 1<<(TU_RING_BACK+RESYNC),    // TU_CAMP_CMD
       1<<(TU_ON_HOOK+RESYNC) | 1<<(TU_RINGING+RESYNC)                       // DELAY
   },
   [TU_RINGING] {
@@ -76,14 +78,18 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
       1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_HANGUP_CMD
       1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_DIAL_CMD
       1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_CHAT_CMD
+      1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_PAGE_CMD
+      1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_CAMP_CMD
       1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC)                       // DELAY
   },
   [TU_DIAL_TONE] {
       1<<TU_DIAL_TONE,                                                      // TU_PICKUP_CMD
       1<<TU_ON_HOOK | 1<<(TU_DIAL_TONE+RESYNC),                             // TU_HANGUP_CMD
       1<<TU_RING_BACK | 1<<TU_BUSY_SIGNAL | 1<<TU_ERROR
-                      | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_DIAL_CMD
+                      | 1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),         // TU_DIAL_CMD (CONNECTED: a room)
       1<<TU_DIAL_TONE,                                                      // TU_CHAT_CMD
+      1<<TU_DIAL_TONE,                                                      // TU_PAGE_CMD
+      1<<TU_DIAL_TONE | 1<<(TU_RING_BACK+RESYNC),                           // TU_CAMP_CMD
       1<<(TU_DIAL_TONE+RESYNC)                                              // DELAY
   },
   [TU_RING_BACK] {
@@ -92,6 +98,8 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
                     | 1<<(TU_RING_BACK+RESYNC),                             // TU_HANGUP_CMD
       1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_DIAL_CMD
       1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_CHAT_CMD
+      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_PAGE_CMD
+      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_CAMP_CMD
       1<<(TU_RING_BACK+RESYNC) | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC) // DELAY
   },
   [TU_BUSY_SIGNAL] {
@@ -99,6 +107,8 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
       1<<TU_ON_HOOK | 1<<(TU_BUSY_SIGNAL+RESYNC),                           // TU_HANGUP_CMD
       1<<TU_BUSY_SIGNAL,                                                    // TU_DIAL_CMD
       1<<TU_BUSY_SIGNAL,                                                    // TU_CHAT_CMD
+      1<<TU_BUSY_SIGNAL,                                                    // TU_PAGE_CMD
+      1<<TU_BUSY_SIGNAL | 1<<(TU_RING_BACK+RESYNC),                         // TU_CAMP_CMD
       1<<(TU_BUSY_SIGNAL+RESYNC)                                            // DELAY
   },
   [TU_CONNECTED] {
@@ -106,6 +116,8 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
       1<<TU_ON_HOOK | 1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),  // TU_HANGUP_CMD
       1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_DIAL_CMD
       1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_CHAT_CMD
+      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_PAGE_CMD
+      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_CAMP_CMD
       1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC)                   // DELAY
   },
   [TU_ERROR] {
@@ -113,6 +125,8 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
       1<<TU_ON_HOOK | 1<<(TU_ERROR+RESYNC),                                 // TU_HANGUP_CMD
       1<<TU_ERROR,                                                          // TU_DIAL_CMD
       1<<TU_ERROR,                                                          // TU_CHAT_CMD
+      1<<TU_ERROR,                                                          // TU_PAGE_CMD
+      1<<TU_ERROR,                                                          // TU_CAMP_CMD
       1<<(TU_ERROR+RESYNC)                                                  // DELAY
   }
 };
@@ -212,7 +226,7 @@ static char *timestamp(void);
 static int connect_command(TU *tu, int port);
 static void disconnect_command(TU *tu);
 static int connect_to_server(struct in_addr *addr, int port);
-static int read_responses(TU *tu, TU_STATE exp, struct timeval tv);
+static int read_responses(TU *tu, TU_STATE exp, char *line, struct timeval tv);
 
 /*
  * Temporary main until this is fleshed out.
@@ -257,7 +271,7 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	TU *tu = &tus[ts->id];
 
 	// First, deal with performing any explicit action.
-	switch(ts->command) {
+	switch(cmd) {  // the commands of command.h are not among the enum's own values
 	// Meta-commands
 	case TU_NO_CMD:
 	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_NO_CMD\n", timestamp(), TU_ID(tu), ts - scr);
@@ -303,6 +317,14 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    fflush(tu->out);
 	    break;
 	case TU_DIAL_CMD:
+	    if(ts->text) {
+		// Dial a number given as text, rather than the extension of a TU.
+		fprintf(stderr, "%s: [%ld] (step #%ld) %s %s\n",
+			timestamp(), TU_ID(tu), ts - scr, tu_command_names[cmd], ts->text);
+		fprintf(tu->out, "%s %s%s", tu_command_names[cmd], ts->text, EOL);
+		fflush(tu->out);
+		break;
+	    }
 	    ext = tus[ts->id_to_dial].extension;
 	    fprintf(stderr, "%s: [%ld] (step #%ld) %s extension %d (id %d)\n",
 		    timestamp(), TU_ID(tu), ts - scr, tu_command_names[cmd], ext, ts->id_to_dial);
@@ -310,19 +332,45 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    fflush(tu->out);
 	    break;
 	case TU_CHAT_CMD:
+	    if(ts->text) {
+		fprintf(stderr, "%s: [%ld] (step #%ld) %s %s\n",
+			timestamp(), TU_ID(tu), ts - scr, tu_command_names[cmd], ts->text);
+		fprintf(tu->out, "%s %s%s", tu_command_names[cmd], ts->text, EOL);
+		fflush(tu->out);
+		break;
+	    }
 	    fprintf(stderr, "%s: [%ld] (step #%ld) %s\n",
 		    timestamp(), TU_ID(tu), ts - scr, tu_command_names[cmd]);
 	    fprintf(tu->out, "%s%s", tu_command_names[cmd], EOL);
 	    fflush(tu->out);
 	    break;
 
+	case TU_PAGE_CMD:
+	    // The text is the group and the message.
+	    fprintf(stderr, "%s: [%ld] (step #%ld) page %s\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->text);
+	    fprintf(tu->out, "page %s%s", ts->text, EOL);
+	    fflush(tu->out);
+	    break;
+	case TU_CAMP_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) camp\n", timestamp(), TU_ID(tu), ts - scr);
+	    fprintf(tu->out, "camp%s", EOL);
+	    fflush(tu->out);
+	    break;
+	case TU_LINE_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_LINE_CMD \"%s\"\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->text);
+	    fprintf(tu->out, "%s%s", ts->text, EOL);
+	    fflush(tu->out);
+	    break;
+
 	// Unknown command
 	default:
 	    fprintf(stderr, "%s: [%ld] (step #%ld) Test error: unknown command (%d)\n",
 		  timestamp(), TU_ID(tu), ts - scr, cmd);
 	    return -1;
 	}
-	if(cmd <= TU_CHAT_CMD) {
+	if(cmd <= TU_CAMP_CMD) {
 	    tu->last_command = cmd;
 	    tu->expected_states = next_states[tu->current_state][cmd];
 	} else if(cmd == TU_CONNECT_CMD) {
@@ -344,7 +392,10 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	// If expected response seen, go to next step.
 	// If unexpected response seen, fail.
 	// If timeout occurs, shutdown the connection so that read will fail.
-	if(tu->infd && read_responses(tu, ts->response, ts->timeout) == -1)
+	// A line sent as is gets no response of its own.
+	// For meta-commands, a text given is a line to wait for instead.
+	if(tu->infd && cmd != TU_LINE_CMD &&
+	   read_responses(tu, ts->response, cmd >= TU_NO_CMD ? ts->text : NULL, ts->timeout) == -1)
 	    return -1;
 
 	// Advance script to next test step.
@@ -432,15 +483,16 @@ static void alarm_handler(int sig) {
 }
 
 /*
- * Read responses from the server for a specified TU until an expected state is reached.
+ * Read responses from the server for a specified TU until an expected state is reached,
+ * or, if line is not NULL, until that exact line has been received.
  */
-static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
+static int read_responses(TU *tu, TU_STATE exp, char *line, struct timeval tv) {
     TU_STATE new;
     char msg[MAX_MESSAGE_LEN];
     char *arg;
     int ret = 0;
     fprintf(stderr, "%s: [%ld] Read responses until %s\n",
-	    timestamp(), TU_ID(tu), exp == -1 ? "EOF" : tu_state_names[exp]);
+	    timestamp(), TU_ID(tu), line ? line : exp == -1 ? "EOF" : tu_state_names[exp]);
     tu_to_read = tu;
     struct itimerval itv = {0};
     struct sigaction sa = {0}, oa;
@@ -472,7 +524,7 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 			    timestamp(), TU_ID(tu));
 		    goto disarm;
 		} else {
-		    if(exp == -1) {
+		    if(exp == -1 && !line) {
 			fprintf(stderr, "%s: [%ld] Expected EOF correctly seen\n",
 				timestamp(), TU_ID(tu));
 		    } else {
@@ -487,11 +539,22 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 	trim_eol(msg);
 	fprintf(stderr, "%s: [%ld] Message from server: %s\n", timestamp(), TU_ID(tu), msg);
 	new = parse_message(msg, &arg);
-	if(new > NUM_STATES) {
+	if(new > NUM_STATES+1) {
 	    // Tracing output already produced by parse_message.
 	    ret = -1;
 	    goto disarm;
 	}
+	if(new == NUM_STATES+1) {
+	    // The message is a notice, such as a page or a place in a call queue.
+	    // There is no state transition, but it has to be the line we are waiting for.
+	    if(!line || strcmp(msg, line)) {
+		fprintf(stderr, "%s: [%ld] Notice received when not expected\n",
+			timestamp(), TU_ID(tu));
+		ret = -1;
+		goto disarm;
+	    }
+	    continue;
+	}
 	if(new == NUM_STATES) {
 	    // The message is chat.  There is no state transition, but we must be
 	    // in the connected state.
@@ -547,7 +610,7 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 	    if(tu->expected_states != ~0)
 		tu->expected_states = next_states[new][tu->last_command];
 	}
-    } while(tu->current_state != exp);
+    } while(line ? strcmp(msg, line) : tu->current_state != exp);
 
  disarm:
     itv = (struct itimerval) {0};
@@ -559,6 +622,8 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 
 /*
  * Parse a message from the PBX, determining the new state.
+ * Returns NUM_STATES for chat, NUM_STATES+1 for a notice that is not a state,
+ * and NUM_STATES+2 for anything unrecognized.
  */
 static TU_STATE parse_message(char *msg, char **arg) {
     for(int i = 0; i < NUM_STATES; i++) {
@@ -573,8 +638,18 @@ static TU_STATE parse_message(char *msg, char **arg) {
 	      *arg = msg + strlen("CHAT");
 	  return NUM_STATES;
     }
+    if(strstr(msg, "PAGE") == msg) {
+	  if(arg)
+	      *arg = msg + strlen("PAGE");
+	  return NUM_STATES+1;
+    }
+    if(strstr(msg, "QUEUED") == msg) {
+	  if(arg)
+	      *arg = msg + strlen("QUEUED");
+	  return NUM_STATES+1;
+    }
     fprintf(stderr, "%s: Unrecognized message: %s\n", timestamp(), msg);
-    return NUM_STATES+1;
+    return NUM_STATES+2;
 }
 
 /*
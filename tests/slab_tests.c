@@ -0,0 +1,154 @@
+/*
+ * Unit tests of the slab allocator: freed objects are handed out again,
+ * whichever thread freed them, before any new slot is carved.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <criterion/criterion.h>
+
+#include "slab.h"
+
+#define SUITE slab_suite
+
+#define NOBJS 1000 // many magazines' worth
+#define OBJ_SIZE 100
+
+typedef struct objs {
+    SLAB_CACHE *cache;
+    void *obj[NOBJS];
+} OBJS;
+
+static void objs_alloc(OBJS *o) {
+    for (int i = 0; i < NOBJS; i++) o->obj[i] = slab_alloc(o->cache);
+}
+
+static void objs_free(OBJS *o) {
+    for (int i = 0; i < NOBJS; i++) slab_free(o->cache, o->obj[i]);
+}
+
+static void *free_thread(void *arg) {
+    objs_free(arg);
+    return NULL;
+}
+
+static int ptr_compare(const void *a, const void *b) {
+    uintptr_t pa = (uintptr_t)*(void *const *)a, pb = (uintptr_t)*(void *const *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+Test(SUITE, objects_are_aligned_and_apart, .timeout = 30) {
+    static OBJS o;
+    o.cache = slab_cache_create("test", OBJ_SIZE);
+    cr_assert(o.cache, "slab_cache_create failed\n");
+    objs_alloc(&o);
+    qsort(o.obj, NOBJS, sizeof(void *), ptr_compare);
+    for (int i = 0; i < NOBJS; i++) {
+        cr_assert(o.obj[i], "slab_alloc failed\n");
+        cr_assert_eq((uintptr_t)o.obj[i] % 64, 0, "object at %p is not on a cache line\n", o.obj[i]);
+        if (i > 0) {
+            cr_assert((uintptr_t)o.obj[i] - (uintptr_t)o.obj[i - 1] >= 128, "objects at %p and %p share a line\n",
+                      o.obj[i - 1], o.obj[i]);
+        }
+    }
+    objs_free(&o);
+}
+
+#define ROUNDS 50
+#define MAGAZINE 32 // objects a thread may hold in a magazine (SLAB_MAGAZINE_SIZE)
+
+/*
+ * Objects allocated by one thread and freed by another go back through the
+ * depot, and the allocating thread gets them again: round after round, the
+ * cache hands out the same objects, plus at most what the two threads hold
+ * in their magazines.
+ */
+Test(SUITE, cross_thread_frees_are_reused, .timeout = 30) {
+    static OBJS o;
+    static void *seen[ROUNDS * NOBJS];
+    o.cache = slab_cache_create("test", OBJ_SIZE);
+    cr_assert(o.cache, "slab_cache_create failed\n");
+
+    for (int round = 0; round < ROUNDS; round++) {
+        objs_alloc(&o);
+        for (int i = 0; i < NOBJS; i++) seen[round * NOBJS + i] = o.obj[i];
+        pthread_t tid;
+        pthread_create(&tid, NULL, free_thread, &o);
+        pthread_join(tid, NULL);
+    }
+
+    qsort(seen, ROUNDS * NOBJS, sizeof(void *), ptr_compare);
+    int distinct = 0;
+    for (int i = 0; i < ROUNDS * NOBJS; i++) distinct += i == 0 || seen[i] != seen[i - 1];
+    cr_assert(distinct <= NOBJS + 2 * MAGAZINE, "%d distinct objects handed out for %d live at a time\n", distinct, NOBJS);
+}
+
+static atomic_int inits; // slots carved from a type-stable cache
+
+static void count_init(void *obj) {
+    *(int *)obj = 42;
+    atomic_fetch_add(&inits, 1);
+}
+
+#define KEPT 10 // objects the exiting thread doesn't free, so it leaves a magazine partly filled
+
+static void *alloc_free_most_thread(void *arg) {
+    OBJS *o = arg;
+    objs_alloc(o);
+    for (int i = KEPT; i < NOBJS; i++) slab_free(o->cache, o->obj[i]);
+    return NULL;
+}
+
+/*
+ * The magazines of a thread that exits are not lost: what was left in them
+ * is handed out again before any new slot is carved, including a magazine
+ * it had only partly filled.
+ */
+Test(SUITE, exited_threads_objects_are_reused, .timeout = 30) {
+    static OBJS first;
+    first.cache = slab_cache_create_typesafe("test", OBJ_SIZE, count_init);
+    cr_assert(first.cache, "slab_cache_create_typesafe failed\n");
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, alloc_free_most_thread, &first);
+    pthread_join(tid, NULL);
+
+    // Every slot carved but those still held is free: allocating them all carves nothing
+    int carved = atomic_load(&inits), nfree = carved - KEPT;
+    void **second = malloc(nfree * sizeof(void *));
+    for (int i = 0; i < nfree; i++) second[i] = slab_alloc(first.cache);
+    cr_assert_eq(atomic_load(&inits), carved, "%d slots carved with %d left by an exited thread\n",
+                 atomic_load(&inits) - carved, nfree);
+    for (int i = 0; i < nfree; i++) slab_free(first.cache, second[i]);
+    free(second);
+}
+
+/*
+ * A type-stable object is initialized once, when carved, and keeps what
+ * was put in it across being freed and allocated again.
+ */
+Test(SUITE, typesafe_init_runs_once, .timeout = 30) {
+    static OBJS o;
+    o.cache = slab_cache_create_typesafe("test", OBJ_SIZE, count_init);
+    cr_assert(o.cache, "slab_cache_create_typesafe failed\n");
+
+    objs_alloc(&o);
+    for (int i = 0; i < NOBJS; i++) {
+        cr_assert_eq(*(int *)o.obj[i], 42, "object %d not initialized\n", i);
+        *(int *)o.obj[i] = 43;
+    }
+    int carved = atomic_load(&inits);
+    cr_assert(carved >= NOBJS, "%d objects initialized for %d allocated\n", carved, NOBJS);
+    objs_free(&o);
+
+    objs_alloc(&o);
+    for (int i = 0; i < NOBJS; i++) {
+        cr_assert_eq(*(int *)o.obj[i], 43, "object %d initialized again, or not one of those freed\n", i);
+    }
+    cr_assert_eq(atomic_load(&inits), carved, "objects initialized again on reuse\n");
+    objs_free(&o);
+}
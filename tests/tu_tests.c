@@ -0,0 +1,706 @@
+/*
+ * Unit tests of the TU module, run in-process: each TU is given one end of
+ * a socket pair, and the test plays its client on the other end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <criterion/criterion.h>
+
+#include "pbx.h"
+#include "tu_ext.h"
+
+#define QUIET_MSEC 200 // a client that has been sent nothing for this long has been sent everything
+#define MAX_TEXT (1024 * 1024) // most a test client reads
+
+/*
+ * Create a TU for the given extension, as if a client had connected; the
+ * client's end of the connection is stored in *client.
+ *
+ * @param type  SOCK_STREAM, like a TCP connection, or SOCK_SEQPACKET, so
+ * that each read returns exactly what one write sent.
+ */
+static TU *unit_tu(int type, int ext, int *client) {
+    int sv[2];
+    if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, sv) == -1) return NULL;
+    TU *tu = tu_init(sv[0]);
+    if (!tu) return NULL;
+    tu_set_extension(tu, ext);
+    *client = sv[1];
+    return tu;
+}
+
+/*
+ * Read one write's worth (SOCK_SEQPACKET) or whatever is there (SOCK_STREAM),
+ * waiting up to ms milliseconds for it.
+ *
+ * @return the number of bytes read, 0 at EOF, -1 if nothing came.
+ */
+static ssize_t client_read(int fd, char *buf, size_t size, int ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, ms) <= 0) return -1;
+    ssize_t n = recv(fd, buf, size - 1, MSG_DONTWAIT);
+    if (n < 0) return errno == EAGAIN ? -1 : 0;
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+ * Everything sent to a client until nothing more arrives for QUIET_MSEC,
+ * NUL-terminated (to be freed by the caller).  *eof is set if the
+ * connection was shut down.
+ */
+static char *client_text(int fd, int *eof) {
+    char *text = malloc(MAX_TEXT + 1);
+    size_t used = 0;
+    *eof = 0;
+    while (used < MAX_TEXT) {
+        ssize_t n = client_read(fd, text + used, MAX_TEXT + 1 - used, QUIET_MSEC);
+        if (n == -1) break;
+        if (n == 0) {
+            *eof = 1;
+            break;
+        }
+        used += n;
+    }
+    text[used] = '\0';
+    return text;
+}
+
+// Discard whatever a client has been sent
+static void client_discard(int fd) {
+    int eof;
+    free(client_text(fd, &eof));
+}
+
+/*
+ * The next line of a client's text, with its EOL stripped and the filler of
+ * client_fill() skipped, advancing *p past it; NULL if there are no more
+ * complete lines.
+ */
+static char *next_line(char **p) {
+    while (**p == '#') (*p)++;
+    char *eol = strstr(*p, EOL);
+    if (!eol) return NULL;
+    char *line = *p;
+    *eol = '\0';
+    *p = eol + sizeof(EOL) - 1;
+    return line;
+}
+
+/*
+ * Fill the connection to a TU's client with filler ('#', no EOL), as if the
+ * client had stopped reading, so that nothing more can be written to it
+ * until the client reads.
+ */
+static void client_fill(TU *tu) {
+    char filler[4096];
+    memset(filler, '#', sizeof(filler));
+    while (send(tu_fileno(tu), filler, sizeof(filler), MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+        ;
+    while (send(tu_fileno(tu), filler, 1, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) // to the last byte
+        ;
+}
+
+/*
+ * Put two TUs in a call, the first having dialed the second, and discard
+ * the notifications of setting it up.
+ */
+static int unit_call(TU *a, int ca, TU *b, int cb) {
+    if (tu_pickup(a) || tu_dial(a, b) || tu_pickup(b)) return -1;
+    client_discard(ca);
+    client_discard(cb);
+    return 0;
+}
+
+#define SUITE tu_suite
+
+#define CHAT_LEN 95 // so each chat line is 102 bytes
+#define OUTPUT_LIMIT 4096
+
+// Chat from a to its peer, numbered so the order of arrival can be checked
+static void numbered_chat(TU *a, int i) {
+    char msg[CHAT_LEN + 1];
+    snprintf(msg, sizeof(msg), "%05d", i);
+    memset(msg + 5, 'x', CHAT_LEN - 5);
+    msg[CHAT_LEN] = '\0';
+    tu_chat(a, msg);
+}
+
+// Check that a line is chat number i
+static int is_chat(char *line, int i) {
+    char head[16];
+    snprintf(head, sizeof(head), "CHAT %05d", i);
+    return line && strncmp(line, head, strlen(head)) == 0 && strlen(line) == 5 + CHAT_LEN;
+}
+
+Test(SUITE, slow_consumer_drop_chat, .timeout = 30) {
+    tu_set_output_limit(OUTPUT_LIMIT, TU_OUTPUT_DROP_CHAT);
+    int ca, cb;
+    TU *a = unit_tu(SOCK_STREAM, 1, &ca);
+    TU *b = unit_tu(SOCK_STREAM, 2, &cb);
+    cr_assert(a && b, "can't create TUs\n");
+    cr_assert_eq(unit_call(a, ca, b, cb), 0, "can't set up a call\n");
+
+    client_fill(b);
+    for (int i = 0; i < 100; i++) numbered_chat(a, i); // far more than the limit
+    tu_hangup(a); // b's state change must still get through
+
+    int eof;
+    char *text = client_text(cb, &eof), *p = text, *line;
+    int n = 0;
+    while ((line = next_line(&p)) && is_chat(line, n)) n++;
+    cr_assert(n > 0, "no chat was kept for the slow client\n");
+    cr_assert(n * (5 + CHAT_LEN + 2) <= OUTPUT_LIMIT, "%d chats kept, more than the limit allows\n", n);
+    cr_assert(line && strcmp(line, tu_state_names[TU_DIAL_TONE]) == 0,
+              "expected the state change after the chats, got '%s'\n", line ? line : "(nothing)");
+    cr_assert_eq(eof, 0, "the slow client was disconnected, rather than missing chat\n");
+    free(text);
+
+    tu_hangup(b);
+    text = client_text(cb, &eof);
+    cr_assert(strncmp(text, "ON HOOK 2", 9) == 0, "client no longer served after catching up: '%s'\n", text);
+    free(text);
+    tu_unref(a, "test");
+    tu_unref(b, "test");
+}
+
+Test(SUITE, slow_consumer_disconnect, .timeout = 30) {
+    tu_set_output_limit(OUTPUT_LIMIT, TU_OUTPUT_DISCONNECT);
+    int ca, cb;
+    TU *a = unit_tu(SOCK_STREAM, 1, &ca);
+    TU *b = unit_tu(SOCK_STREAM, 2, &cb);
+    cr_assert(a && b, "can't create TUs\n");
+    cr_assert_eq(unit_call(a, ca, b, cb), 0, "can't set up a call\n");
+
+    client_fill(b);
+    for (int i = 0; i < 100; i++) numbered_chat(a, i);
+
+    int eof;
+    char *text = client_text(cb, &eof), *p = text, *line;
+    int n = 0;
+    while ((line = next_line(&p)) && is_chat(line, n)) n++;
+    cr_assert(n * (5 + CHAT_LEN + 2) <= OUTPUT_LIMIT, "%d chats sent, more than the limit allows\n", n);
+    cr_assert_eq(eof, 1, "the slow client was not disconnected\n");
+    free(text);
+
+    // The TU that was chatting is not held up by its peer's client
+    text = client_text(ca, &eof);
+    p = text;
+    int replies = 0;
+    while ((line = next_line(&p))) replies += strcmp(line, "CONNECTED 2") == 0;
+    cr_assert_eq(replies, 100, "expected a reply to each of 100 chats, got %d\n", replies);
+    cr_assert_eq(eof, 0, "the fast client was disconnected\n");
+    free(text);
+    tu_hangup(a);
+    tu_unref(a, "test");
+    tu_unref(b, "test");
+}
+
+Test(SUITE, slow_consumer_park, .timeout = 30) {
+    tu_set_output_limit(OUTPUT_LIMIT, TU_OUTPUT_PARK);
+    int ca, cb;
+    TU *a = unit_tu(SOCK_STREAM, 1, &ca);
+    TU *b = unit_tu(SOCK_STREAM, 2, &cb);
+    cr_assert(a && b, "can't create TUs\n");
+    cr_assert_eq(unit_call(a, ca, b, cb), 0, "can't set up a call\n");
+
+    // Well past the limit but within 16 times it: all of it is kept, in order
+    int nchats = 8 * OUTPUT_LIMIT / (5 + CHAT_LEN + 2);
+    client_fill(b);
+    for (int i = 0; i < nchats; i++) numbered_chat(a, i);
+
+    int eof;
+    char *text = client_text(cb, &eof), *p = text, *line;
+    int n = 0;
+    while ((line = next_line(&p)) && is_chat(line, n)) n++;
+    cr_assert_eq(n, nchats, "expected all %d chats in order once the client read again, got %d\n", nchats, n);
+    cr_assert_eq(eof, 0, "a parked client was disconnected within 16 times the limit\n");
+    free(text);
+
+    // Past 16 times the limit, the client is dropped
+    nchats = 17 * OUTPUT_LIMIT / (5 + CHAT_LEN + 2);
+    client_fill(b);
+    for (int i = 0; i < nchats; i++) numbered_chat(a, i);
+    text = client_text(cb, &eof);
+    cr_assert_eq(eof, 1, "a parked client was kept past 16 times the limit\n");
+    free(text);
+    tu_hangup(a);
+    tu_unref(a, "test");
+    tu_unref(b, "test");
+}
+
+/*
+ * A chat to a peer with nothing queued goes out as a single write, straight
+ * from the message.
+ */
+Test(SUITE, chat_is_one_write, .timeout = 30) {
+    int ca, cb;
+    TU *a = unit_tu(SOCK_SEQPACKET, 1, &ca);
+    TU *b = unit_tu(SOCK_SEQPACKET, 2, &cb);
+    cr_assert(a && b, "can't create TUs\n");
+    cr_assert_eq(unit_call(a, ca, b, cb), 0, "can't set up a call\n");
+
+    char buf[1024];
+    for (int i = 0; i < 3; i++) {
+        cr_assert_eq(tu_chat(a, "hello"), 0, "chat failed\n");
+        ssize_t n = client_read(cb, buf, sizeof(buf), 1000);
+        cr_assert(n > 0 && strcmp(buf, "CHAT hello" EOL) == 0, "expected one write of the chat, got '%s'\n", n > 0 ? buf : "");
+        cr_assert_eq(client_read(cb, buf, sizeof(buf), 50), -1, "more than one write for a chat: '%s'\n", buf);
+        n = client_read(ca, buf, sizeof(buf), 1000);
+        cr_assert(n > 0 && strcmp(buf, "CONNECTED 2" EOL) == 0, "expected the sender's state, got '%s'\n", n > 0 ? buf : "");
+    }
+    tu_hangup(a);
+    tu_unref(a, "test");
+    tu_unref(b, "test");
+}
+
+// Chats from a TU, for a thread of its own
+static void *chat_thread(void *arg) {
+    TU *a = arg;
+    for (int i = 0; i < 1000; i++) numbered_chat(a, i);
+    return NULL;
+}
+
+/*
+ * A chat that can't go out at once is queued, and so is every chat after it
+ * until the queue has gone, so chats arrive complete and in order whether
+ * they were written directly or from the queue.
+ */
+Test(SUITE, chat_falls_back_to_queue, .timeout = 30) {
+    int ca, cb;
+    TU *a = unit_tu(SOCK_SEQPACKET, 1, &ca);
+    TU *b = unit_tu(SOCK_SEQPACKET, 2, &cb);
+    cr_assert(a && b, "can't create TUs\n");
+    cr_assert_eq(unit_call(a, ca, b, cb), 0, "can't set up a call\n");
+
+    client_fill(b); // the first chats must be queued
+    pthread_t tid;
+    pthread_create(&tid, NULL, chat_thread, a);
+
+    // Read slowly while the chats go on, so the queue empties and fills again
+    char *text = malloc(MAX_TEXT + 1);
+    size_t used = 0;
+    ssize_t n;
+    while (used < MAX_TEXT && (n = client_read(cb, text + used, MAX_TEXT + 1 - used, QUIET_MSEC)) > 0) {
+        used += n;
+        usleep(100);
+    }
+    text[used] = '\0';
+    pthread_join(tid, NULL);
+    client_discard(ca);
+
+    char *p = text, *line;
+    int count = 0;
+    while ((line = next_line(&p)) && is_chat(line, count)) count++;
+    cr_assert_eq(count, 1000, "expected 1000 chats in order, got %d (then '%s')\n", count, line ? line : "(nothing)");
+    free(text);
+    tu_hangup(a);
+    tu_unref(a, "test");
+    tu_unref(b, "test");
+}
+
+/*
+ * Everything a batch queues for a client is held back until the batch ends,
+ * then sent in one write, in the order it was produced.
+ */
+Test(SUITE, batch_sends_one_write_per_client, .timeout = 30) {
+    int ca;
+    TU *a = unit_tu(SOCK_SEQPACKET, 1, &ca);
+    cr_assert(a, "can't create TU\n");
+    char buf[1024];
+    cr_assert(client_read(ca, buf, sizeof(buf), 1000) > 0, "no notification of the extension\n");
+
+    tu_batch_begin();
+    tu_batch_begin(); // nested: only the outermost end sends
+    tu_pickup(a);
+    tu_hangup(a);
+    tu_batch_end();
+    cr_assert_eq(client_read(ca, buf, sizeof(buf), 50), -1, "sent before the outermost batch ended: '%s'\n", buf);
+    tu_pickup(a);
+    cr_assert_eq(client_read(ca, buf, sizeof(buf), 50), -1, "sent before the batch ended: '%s'\n", buf);
+    tu_batch_end();
+
+    ssize_t n = client_read(ca, buf, sizeof(buf), 1000);
+    cr_assert(n > 0 && strcmp(buf, "DIAL TONE" EOL "ON HOOK 1" EOL "DIAL TONE" EOL) == 0,
+              "expected the batch in one write, got '%s'\n", n > 0 ? buf : "");
+    cr_assert_eq(client_read(ca, buf, sizeof(buf), 50), -1, "more than one write for the batch: '%s'\n", buf);
+    tu_hangup(a);
+    tu_unref(a, "test");
+}
+
+Test(SUITE, batch_sets_up_a_call, .timeout = 30) {
+    int ca, cb;
+    TU *a = unit_tu(SOCK_SEQPACKET, 1, &ca);
+    TU *b = unit_tu(SOCK_SEQPACKET, 2, &cb);
+    cr_assert(a && b, "can't create TUs\n");
+    client_discard(ca);
+    client_discard(cb);
+
+    tu_batch_begin();
+    tu_pickup(a);
+    tu_dial(a, b);
+    tu_pickup(b);
+    tu_chat(a, "hi"); // queued behind b's held notifications, not sent ahead of them
+    tu_batch_end();
+
+    char buf[1024];
+    ssize_t n = client_read(ca, buf, sizeof(buf), 1000);
+    cr_assert(n > 0 && strcmp(buf, "DIAL TONE" EOL "RING BACK" EOL "CONNECTED 2" EOL "CONNECTED 2" EOL) == 0,
+              "caller got '%s'\n", n > 0 ? buf : "");
+    n = client_read(cb, buf, sizeof(buf), 1000);
+    cr_assert(n > 0 && strcmp(buf, "RINGING" EOL "CONNECTED 1" EOL "CHAT hi" EOL) == 0,
+              "callee got '%s'\n", n > 0 ? buf : "");
+    cr_assert_eq(client_read(cb, buf, sizeof(buf), 50), -1, "more than one write for the batch: '%s'\n", buf);
+    tu_hangup(a);
+    tu_unref(a, "test");
+    tu_unref(b, "test");
+}
+
+/*
+ * A batch touching more TUs than it can hold back flushes the rest at once;
+ * nothing is lost or sent twice.
+ */
+Test(SUITE, batch_of_many_tus, .timeout = 30) {
+    enum { NTUS = 40 };
+    TU *tus[NTUS];
+    int clients[NTUS];
+    for (int i = 0; i < NTUS; i++) {
+        tus[i] = unit_tu(SOCK_SEQPACKET, i, &clients[i]);
+        cr_assert(tus[i], "can't create TU %d\n", i);
+        client_discard(clients[i]);
+    }
+
+    tu_batch_begin();
+    for (int i = 0; i < NTUS; i++) tu_pickup(tus[i]);
+    for (int i = 0; i < NTUS; i++) tu_hangup(tus[i]);
+    tu_batch_end();
+
+    for (int i = 0; i < NTUS; i++) {
+        int eof;
+        char *text = client_text(clients[i], &eof);
+        char expected[64];
+        snprintf(expected, sizeof(expected), "DIAL TONE" EOL "ON HOOK %d" EOL, i);
+        cr_assert(strcmp(text, expected) == 0, "TU %d got '%s'\n", i, text);
+        free(text);
+        tu_unref(tus[i], "test");
+    }
+}
+
+#define NREFS 8
+
+typedef struct ref_thread {
+    pthread_t thread;
+    TU *tu;
+} REF_THREAD;
+
+// Take and drop references to a TU, then drop the one the thread was given
+static void *ref_thread(void *arg) {
+    REF_THREAD *r = arg;
+    for (int i = 0; i < 100000; i++) {
+        tu_ref(r->tu, "test");
+        if (i % 1000 == 0) sched_yield();
+        tu_unref(r->tu, "test");
+    }
+    tu_unref(r->tu, "test");
+    return NULL;
+}
+
+/*
+ * References taken and dropped by many threads at once are counted exactly:
+ * the TU is freed, closing its client's connection, on the last unref and
+ * not before.
+ */
+Test(SUITE, concurrent_refs, .timeout = 60) {
+    for (int last = 0; last <= 1; last++) { // the test's reference dropped last, then first
+        int ca;
+        TU *a = unit_tu(SOCK_STREAM, 1, &ca);
+        cr_assert(a, "can't create TU\n");
+        client_discard(ca);
+
+        REF_THREAD r[NREFS];
+        for (int i = 0; i < NREFS; i++) {
+            r[i].tu = a;
+            tu_ref(a, "test"); // the thread's own
+            pthread_create(&r[i].thread, NULL, ref_thread, &r[i]);
+        }
+        if (!last) tu_unref(a, "test");
+        for (int i = 0; i < NREFS; i++) pthread_join(r[i].thread, NULL);
+
+        char buf[64];
+        if (last) {
+            cr_assert_eq(client_read(ca, buf, sizeof(buf), 50), -1, "TU freed while a reference remained\n");
+            tu_unref(a, "test");
+        }
+        cr_assert_eq(client_read(ca, buf, sizeof(buf), 1000), 0, "TU not freed on the last unref\n");
+        close(ca);
+    }
+}
+
+/*
+ * TUs start on a cache line and are whole lines apart, so what one TU's
+ * threads write never shares a line with another TU.
+ */
+Test(SUITE, tus_do_not_share_cache_lines, .timeout = 30) {
+    enum { NTUS = 200, LINE = 64 };
+    TU *tus[NTUS];
+    int clients[NTUS];
+    for (int i = 0; i < NTUS; i++) {
+        tus[i] = unit_tu(SOCK_STREAM, i, &clients[i]);
+        cr_assert(tus[i], "can't create TU %d\n", i);
+        cr_assert_eq((uintptr_t)tus[i] % LINE, 0, "TU %d at %p is not on a cache line\n", i, (void *)tus[i]);
+    }
+    uintptr_t gap = UINTPTR_MAX;
+    for (int i = 0; i < NTUS; i++) {
+        for (int j = 0; j < NTUS; j++) {
+            uintptr_t d = (uintptr_t)tus[j] - (uintptr_t)tus[i];
+            if (i != j && (uintptr_t)tus[j] > (uintptr_t)tus[i] && d < gap) gap = d;
+        }
+    }
+    // At least the fixed fields, the reference count and the call state each have a line
+    cr_assert(gap >= 3 * LINE, "TUs only %zu bytes apart\n", (size_t)gap);
+    for (int i = 0; i < NTUS; i++) {
+        tu_unref(tus[i], "test");
+        close(clients[i]);
+    }
+}
+
+#define MAX_CLIENTS 32
+#define MAX_LINE 256
+
+/*
+ * Reads the clients of many TUs as they are sent to, on a thread of its
+ * own, keeping the last complete line each was sent.
+ */
+typedef struct collector {
+    pthread_t thread;
+    int n;
+    int fds[MAX_CLIENTS];
+    char partial[MAX_CLIENTS][MAX_LINE];
+    size_t used[MAX_CLIENTS];
+    char last[MAX_CLIENTS][MAX_LINE]; // without its EOL
+    atomic_int stop; // set to stop once nothing has come for QUIET_MSEC
+} COLLECTOR;
+
+// Read what has arrived for client i; 0 if nothing had
+static int collector_read(COLLECTOR *c, int i) {
+    char buf[4096];
+    ssize_t n = recv(c->fds[i], buf, sizeof(buf), MSG_DONTWAIT);
+    for (ssize_t k = 0; k < n; k++) {
+        if (c->used[i] < MAX_LINE - 1) c->partial[i][c->used[i]++] = buf[k];
+        if (c->used[i] >= 2 && memcmp(c->partial[i] + c->used[i] - 2, EOL, 2) == 0) {
+            memcpy(c->last[i], c->partial[i], c->used[i] - 2);
+            c->last[i][c->used[i] - 2] = '\0';
+            c->used[i] = 0;
+        }
+    }
+    return n > 0;
+}
+
+static void *collector_thread(void *arg) {
+    COLLECTOR *c = arg;
+    struct pollfd pfds[MAX_CLIENTS];
+    for (int i = 0; i < c->n; i++) pfds[i] = (struct pollfd){ .fd = c->fds[i], .events = POLLIN };
+    for (;;) {
+        int ready = poll(pfds, c->n, QUIET_MSEC);
+        if (ready <= 0) {
+            if (atomic_load(&c->stop)) return NULL;
+            continue;
+        }
+        for (int i = 0; i < c->n; i++) {
+            if (pfds[i].revents & POLLIN) collector_read(c, i);
+        }
+    }
+}
+
+static void collector_init(COLLECTOR *c, int *fds, int n) {
+    memset(c, 0, sizeof(*c));
+    c->n = n;
+    memcpy(c->fds, fds, n * sizeof(int));
+}
+
+static void collector_start(COLLECTOR *c, int *fds, int n) {
+    collector_init(c, fds, n);
+    pthread_create(&c->thread, NULL, collector_thread, c);
+}
+
+// Wait until everything sent has been read
+static void collector_stop(COLLECTOR *c) {
+    atomic_store(&c->stop, 1);
+    pthread_join(c->thread, NULL);
+}
+
+#define NPAIRS 4
+#define DIALS 2000
+
+typedef struct dialer {
+    pthread_t thread;
+    TU *self;
+    TU *peer; // dialed back by the peer at the same time
+    TU *other; // in another pair, to mix calls across pairs
+} DIALER;
+
+static void *dialer_thread(void *arg) {
+    DIALER *d = arg;
+    unsigned seed = (uintptr_t)d;
+    for (int i = 0; i < DIALS; i++) {
+        tu_pickup(d->self); // answers, if the peer got through first
+        tu_dial(d->self, rand_r(&seed) % 8 ? d->peer : d->other);
+        tu_pickup(d->self);
+        if (rand_r(&seed) % 2) tu_chat(d->self, "hello");
+        tu_hangup(d->self);
+    }
+    return NULL;
+}
+
+/*
+ * Pairs of TUs dialing each other at the same moment, over and over, each
+ * side on a thread of its own and now and then across pairs: however the
+ * two ends of a call lock each other, nothing deadlocks, and once all hang
+ * up every client has been told it is on hook.
+ */
+Test(SUITE, mutual_dialing, .timeout = 60) {
+    TU *tus[2 * NPAIRS];
+    int clients[2 * NPAIRS];
+    for (int i = 0; i < 2 * NPAIRS; i++) {
+        tus[i] = unit_tu(SOCK_STREAM, i, &clients[i]);
+        cr_assert(tus[i], "can't create TU %d\n", i);
+    }
+    COLLECTOR c;
+    collector_start(&c, clients, 2 * NPAIRS);
+
+    DIALER d[2 * NPAIRS];
+    for (int i = 0; i < 2 * NPAIRS; i++) {
+        d[i] = (DIALER){ .self = tus[i], .peer = tus[i ^ 1], .other = tus[(i + 2) % (2 * NPAIRS)] };
+        pthread_create(&d[i].thread, NULL, dialer_thread, &d[i]);
+    }
+    for (int i = 0; i < 2 * NPAIRS; i++) pthread_join(d[i].thread, NULL);
+
+    for (int i = 0; i < 2 * NPAIRS; i++) tu_hangup(tus[i]);
+    collector_stop(&c);
+    for (int i = 0; i < 2 * NPAIRS; i++) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "ON HOOK %d", i);
+        cr_assert(strcmp(c.last[i], expected) == 0, "TU %d ended with '%s'\n", i, c.last[i]);
+        tu_unref(tus[i], "test");
+    }
+}
+
+#define CALLERS 4
+#define TUS_PER_CALLER 3
+#define NCALLING (CALLERS * TUS_PER_CALLER)
+#define ROUNDS 1000
+#define OPS_PER_ROUND 50
+
+static pthread_barrier_t round_start, round_end;
+
+typedef struct caller {
+    pthread_t thread;
+    TU **tus; // all of them
+    int first; // the caller's own are first to first + TUS_PER_CALLER - 1
+} CALLER;
+
+// Pick up, dial anyone and hang up at random on a caller's own TUs, a round at a time
+static void *caller_thread(void *arg) {
+    CALLER *c = arg;
+    unsigned seed = c->first + 1;
+    for (int round = 0; round < ROUNDS; round++) {
+        pthread_barrier_wait(&round_start);
+        for (int i = 0; i < OPS_PER_ROUND; i++) {
+            TU *tu = c->tus[c->first + rand_r(&seed) % TUS_PER_CALLER];
+            switch (rand_r(&seed) % 3) {
+            case 0: tu_pickup(tu); break;
+            case 1: tu_dial(tu, c->tus[rand_r(&seed) % NCALLING]); break;
+            case 2: tu_hangup(tu); break;
+            }
+        }
+        pthread_barrier_wait(&round_end);
+    }
+    return NULL;
+}
+
+/*
+ * Check that the last lines the clients have are states, and that the two
+ * ends of each call agree.  Returns 0 if so, else -1 with the reason in why.
+ */
+static int check_last_lines(COLLECTOR *c, char *why, size_t size) {
+    int ringing = 0, ring_back = 0;
+    for (int i = 0; i < NCALLING; i++) {
+        int peer;
+        if (sscanf(c->last[i], "CONNECTED %d", &peer) == 1) {
+            char expected[32];
+            snprintf(expected, sizeof(expected), "CONNECTED %d", i);
+            if (peer < 0 || peer >= NCALLING || strcmp(c->last[peer], expected) != 0) {
+                snprintf(why, size, "TU %d was told it is connected to %d, which was told '%s'", i, peer,
+                         peer >= 0 && peer < NCALLING ? c->last[peer] : "");
+                return -1;
+            }
+        } else if (!c->last[i][0]) {
+            snprintf(why, size, "TU %d was sent no complete notification", i);
+            return -1;
+        } else {
+            ringing += strcmp(c->last[i], tu_state_names[TU_RINGING]) == 0;
+            ring_back += strcmp(c->last[i], tu_state_names[TU_RING_BACK]) == 0;
+        }
+    }
+    if (ringing != ring_back) {
+        snprintf(why, size, "%d TUs were told they are ringing but %d that they hear ring back", ringing, ring_back);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * However state changes race, each client's notifications arrive in the
+ * order the changes were made, so whenever things pause the last one each
+ * client has is its TU's state, and the two ends of every call agree.
+ */
+Test(SUITE, last_notification_is_the_state, .timeout = 60) {
+    TU *tus[NCALLING];
+    int clients[NCALLING];
+    for (int i = 0; i < NCALLING; i++) {
+        tus[i] = unit_tu(SOCK_STREAM, i, &clients[i]);
+        cr_assert(tus[i], "can't create TU %d\n", i);
+    }
+    COLLECTOR c;
+    collector_init(&c, clients, NCALLING);
+
+    pthread_barrier_init(&round_start, NULL, CALLERS + 1);
+    pthread_barrier_init(&round_end, NULL, CALLERS + 1);
+    CALLER callers[CALLERS];
+    for (int i = 0; i < CALLERS; i++) {
+        callers[i] = (CALLER){ .tus = tus, .first = i * TUS_PER_CALLER };
+        pthread_create(&callers[i].thread, NULL, caller_thread, &callers[i]);
+    }
+    for (int round = 0; round < ROUNDS; round++) {
+        pthread_barrier_wait(&round_start);
+        pthread_barrier_wait(&round_end);
+        // Every operation has returned, so everything it sent is there to read
+        for (int i = 0; i < NCALLING; i++) {
+            while (collector_read(&c, i))
+                ;
+        }
+        char why[256];
+        cr_assert_eq(check_last_lines(&c, why, sizeof(why)), 0, "round %d: %s\n", round, why);
+    }
+    for (int i = 0; i < CALLERS; i++) pthread_join(callers[i].thread, NULL);
+
+    collector_start(&c, clients, NCALLING);
+    for (int i = 0; i < NCALLING; i++) tu_hangup(tus[i]);
+    collector_stop(&c);
+    for (int i = 0; i < NCALLING; i++) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "ON HOOK %d", i);
+        cr_assert(strcmp(c.last[i], expected) == 0, "TU %d ended with '%s' after all hung up\n", i, c.last[i]);
+        tu_unref(tus[i], "test");
+    }
+}